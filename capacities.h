@@ -0,0 +1,255 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#ifndef __CAPACITIES_H__
+#define __CAPACITIES_H__
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCHED_CAPACITY_SCALE	1024
+
+#define SYSFS_CPU_CAPACITY	"/sys/devices/system/cpu/cpu%d/cpu_capacity"
+
+/*
+ * CPU capacity tables.
+ *
+ * cap[] holds the unique capacities sorted in ascending order, one entry per
+ * cluster. cpu_cap[] is the capacity of each CPU and cpu_cluster[] the index
+ * of its cluster in cap[].
+ *
+ * fit_cap[] maps a uclamp value to the smallest capacity that fits it, or
+ * ULONG_MAX if none does. lower_cap[] maps a capacity to the largest capacity
+ * that is smaller than it, or 0. Both make the per event checks constant
+ * work regardless of the number of CPUs.
+ */
+struct capacities {
+	unsigned long *cap;
+	unsigned int len;
+	unsigned int *cluster_nr_cpus;
+
+	unsigned long *cpu_cap;
+	unsigned int *cpu_cluster;
+	unsigned int nr_cpus;
+
+	unsigned long fit_cap[SCHED_CAPACITY_SCALE + 1];
+	unsigned long lower_cap[SCHED_CAPACITY_SCALE + 1];
+};
+
+static inline unsigned long capacity_fit(const struct capacities *caps, unsigned long value)
+{
+	return caps->fit_cap[value < SCHED_CAPACITY_SCALE ? value : SCHED_CAPACITY_SCALE];
+}
+
+static inline unsigned long capacity_lower(const struct capacities *caps, unsigned long value)
+{
+	return caps->lower_cap[value < SCHED_CAPACITY_SCALE ? value : SCHED_CAPACITY_SCALE];
+}
+
+static inline void capacities_free(struct capacities *caps)
+{
+	free(caps->cap);
+	free(caps->cluster_nr_cpus);
+	free(caps->cpu_cap);
+	free(caps->cpu_cluster);
+	memset(caps, 0, sizeof(*caps));
+}
+
+/*
+ * Build the cluster and lookup tables from cpu_cap[].
+ */
+static inline int capacities_build(struct capacities *caps)
+{
+	unsigned int cpu, i, j;
+	unsigned long v;
+
+	/* for_each_capacity() peeks one past the end */
+	caps->cap = calloc(caps->nr_cpus + 1, sizeof(unsigned long));
+	caps->cluster_nr_cpus = calloc(caps->nr_cpus, sizeof(unsigned int));
+	caps->cpu_cluster = calloc(caps->nr_cpus, sizeof(unsigned int));
+	if (!caps->cap || !caps->cluster_nr_cpus || !caps->cpu_cluster) {
+		perror("Failed to allocate capacities");
+		return -1;
+	}
+
+	/* Insertion sort of the unique capacities, there are only a handful */
+	caps->len = 0;
+	for (cpu = 0; cpu < caps->nr_cpus; cpu++) {
+		unsigned long cap = caps->cpu_cap[cpu];
+
+		for (i = 0; i < caps->len && caps->cap[i] < cap; i++)
+			;
+		if (i < caps->len && caps->cap[i] == cap)
+			continue;
+
+		for (j = caps->len; j > i; j--)
+			caps->cap[j] = caps->cap[j - 1];
+		caps->cap[i] = cap;
+		caps->len++;
+	}
+
+	for (cpu = 0; cpu < caps->nr_cpus; cpu++) {
+		for (i = 0; caps->cap[i] != caps->cpu_cap[cpu]; i++)
+			;
+		caps->cpu_cluster[cpu] = i;
+		caps->cluster_nr_cpus[i]++;
+	}
+
+	/* i is the number of capacities smaller than v */
+	for (v = 0, i = 0; v <= SCHED_CAPACITY_SCALE; v++) {
+		while (i < caps->len && caps->cap[i] < v)
+			i++;
+		caps->fit_cap[v] = i < caps->len ? caps->cap[i] : ULONG_MAX;
+		caps->lower_cap[v] = i ? caps->cap[i - 1] : 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the capacity of every CPU straight from sysfs. CPUs without a
+ * cpu_capacity file (!SMP asymmetric systems) are at SCHED_CAPACITY_SCALE.
+ */
+static inline int capacities_discover(struct capacities *caps)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	char path[64];
+	int cpu;
+
+	memset(caps, 0, sizeof(*caps));
+
+	if (nr_cpus <= 0) {
+		perror("Can't get number of CPUs");
+		return -1;
+	}
+
+	caps->nr_cpus = nr_cpus;
+	caps->cpu_cap = calloc(nr_cpus, sizeof(unsigned long));
+	if (!caps->cpu_cap) {
+		perror("Failed to allocate capacities");
+		return -1;
+	}
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		unsigned long cap = SCHED_CAPACITY_SCALE;
+		FILE *fp;
+
+		snprintf(path, sizeof(path), SYSFS_CPU_CAPACITY, cpu);
+		fp = fopen(path, "r");
+		if (fp) {
+			if (fscanf(fp, "%lu", &cap) != 1)
+				cap = SCHED_CAPACITY_SCALE;
+			fclose(fp);
+		}
+
+		caps->cpu_cap[cpu] = cap;
+	}
+
+	if (capacities_build(caps)) {
+		capacities_free(caps);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The capacity table is saved next to the traces so that they can be checked
+ * offline on another machine.
+ */
+#define CAPACITIES_CSV_FILE	"uclamp_test_thermal_pressure_capacities.csv"
+#define CAPACITIES_CSV_HEADER	"cpu, capacity\n"
+
+static inline int capacities_save(const struct capacities *caps, const char *path)
+{
+	FILE *file;
+	unsigned int cpu;
+
+	file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "Failed to create %s file\n", path);
+		return -1;
+	}
+
+	fprintf(file, CAPACITIES_CSV_HEADER);
+	for (cpu = 0; cpu < caps->nr_cpus; cpu++)
+		fprintf(file, "%u, %lu\n", cpu, caps->cpu_cap[cpu]);
+
+	fclose(file);
+	return 0;
+}
+
+static inline int capacities_load(struct capacities *caps, const char *path)
+{
+	unsigned int size = 16, i;
+	char line[64];
+	FILE *file;
+
+	memset(caps, 0, sizeof(*caps));
+
+	file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "Failed to open %s file\n", path);
+		return -1;
+	}
+
+	caps->cpu_cap = calloc(size, sizeof(unsigned long));
+	if (!caps->cpu_cap)
+		goto err;
+
+	while (fgets(line, sizeof(line), file)) {
+		unsigned long cpu, cap;
+
+		/* Skip the header and anything that isn't a cpu, capacity pair */
+		if (sscanf(line, "%lu , %lu", &cpu, &cap) != 2)
+			continue;
+
+		while (cpu >= size) {
+			unsigned long *tmp;
+
+			tmp = realloc(caps->cpu_cap, 2 * size * sizeof(unsigned long));
+			if (!tmp)
+				goto err;
+			memset(tmp + size, 0, size * sizeof(unsigned long));
+			caps->cpu_cap = tmp;
+			size *= 2;
+		}
+
+		caps->cpu_cap[cpu] = cap;
+		if (cpu >= caps->nr_cpus)
+			caps->nr_cpus = cpu + 1;
+	}
+
+	fclose(file);
+
+	if (!caps->nr_cpus) {
+		fprintf(stderr, "%s: empty capacity table\n", path);
+		capacities_free(caps);
+		return -1;
+	}
+
+	/* A missing cpu would show up as a cluster of capacity 0 */
+	for (i = 0; i < caps->nr_cpus; i++) {
+		if (!caps->cpu_cap[i]) {
+			fprintf(stderr, "%s: no capacity for cpu%u\n", path, i);
+			capacities_free(caps);
+			return -1;
+		}
+	}
+
+	if (capacities_build(caps)) {
+		capacities_free(caps);
+		return -1;
+	}
+
+	return 0;
+err:
+	perror("Failed to load capacities");
+	fclose(file);
+	capacities_free(caps);
+	return -1;
+}
+
+#endif /* __CAPACITIES_H__ */
@@ -3,63 +3,166 @@
 #ifndef __EVENTS_DEFS_H__
 #define __EVENTS_DEFS_H__
 
-#define INIT_EVENT_RB(event)	struct ring_buffer *event##_rb = NULL
-
-#define CREATE_EVENT_RB(event) do {							\
-		event##_rb = ring_buffer__new(bpf_map__fd(skel->maps.event##_rb),	\
-					      handle_##event##_event, NULL, NULL);	\
-		if (!event##_rb) {							\
-			ret = -1;							\
-			fprintf(stderr, "Failed to create " #event " ringbuffer\n");	\
-			goto cleanup;							\
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+/*
+ * Per event type delivery statistics. Passed as ctx to the event handler so
+ * it can account the latency between the BPF side stamping the event and
+ * userspace handling it.
+ */
+struct event_stats {
+	const char *name;
+	unsigned long long events;
+	unsigned long long lat_sum_ns;
+	unsigned long long lat_max_ns;
+};
+
+/*
+ * Statistics of the single consumer thread servicing all ring buffers.
+ */
+struct events_consumer_stats {
+	unsigned long long wakeups;
+	unsigned long long events;
+	int max_per_wakeup;
+	/* Events picked up when epoll timed out, producers didn't wake us */
+	unsigned long long polled;
+};
+
+static inline void event_delivered(void *ctx, unsigned long long ts)
+{
+	struct event_stats *stats = ctx;
+	unsigned long long now, lat;
+	struct timespec tp;
+
+	if (!stats)
+		return;
+
+	/* bpf_ktime_get_ns() is CLOCK_MONOTONIC */
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	now = tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+	lat = now > ts ? now - ts : 0;
+
+	stats->events++;
+	stats->lat_sum_ns += lat;
+	if (lat > stats->lat_max_ns)
+		stats->lat_max_ns = lat;
+}
+
+static inline void print_event_stats(struct event_stats *stats)
+{
+	unsigned long long avg = stats->events ? stats->lat_sum_ns / stats->events : 0;
+
+	fprintf(stdout, "[%s] events: %llu delivery latency avg: %llu ns max: %llu ns\n",
+		stats->name, stats->events, avg, stats->lat_max_ns);
+}
+
+static inline void print_events_consumer_stats(struct events_consumer_stats *stats)
+{
+	double avg = stats->wakeups ? (double)stats->events / stats->wakeups : 0;
+
+	fprintf(stdout, "[consumer] wakeups: %llu events: %llu events/wakeup avg: %.2f max: %d polled: %llu\n",
+		stats->wakeups, stats->events, avg, stats->max_per_wakeup, stats->polled);
+}
+
+#define INIT_EVENT_STATS(event)	\
+	static struct event_stats event##_stats = { .name = #event }
+
+#define INIT_EVENTS_RB()	\
+	static struct ring_buffer *events_rb = NULL;				\
+	static struct events_consumer_stats events_consumer_stats
+
+/*
+ * The first event creates the ring_buffer manager, the rest are added to it.
+ * All of them are then serviced by a single epoll fd.
+ */
+#define ADD_EVENT_RB(event) do {							\
+		int __fd = bpf_map__fd(skel->maps.event##_rb);				\
+		if (!events_rb) {							\
+			events_rb = ring_buffer__new(__fd, handle_##event##_event,	\
+						     &event##_stats, NULL);		\
+			if (!events_rb) {						\
+				ret = -1;						\
+				fprintf(stderr, "Failed to create " #event " ringbuffer\n"); \
+				goto cleanup;						\
+			}								\
+		} else {								\
+			ret = ring_buffer__add(events_rb, __fd,				\
+					       handle_##event##_event, &event##_stats);	\
+			if (ret) {							\
+				fprintf(stderr, "Failed to add " #event " ringbuffer: %d\n", ret); \
+				goto cleanup;						\
+			}								\
 		}									\
 	} while(0)
 
-#define DESTROY_EVENT_RB(event) do {							\
-		ring_buffer__free(event##_rb);						\
+#define DESTROY_EVENTS_RB() do {							\
+		ring_buffer__free(events_rb);						\
+		events_rb = NULL;							\
 	} while(0)
 
-#define POLL_EVENT_RB(event) do {							\
-		ret = ring_buffer__poll(event##_rb, 1000);				\
-		if (ret == -EINTR) {							\
-			ret = 0;							\
-			break;								\
-		}									\
-		if (ret < 0) {								\
-			fprintf(stderr, "Error polling " #event " ring buffer: %d\n", ret); \
-			break;								\
-		}									\
-		pr_debug(stdout, "[" #event "] consumed %d events\n", ret);		\
+#define ACCOUNT_EVENTS_CONSUMED(nr) do {						\
+		events_consumer_stats.wakeups++;					\
+		events_consumer_stats.events += (nr);					\
+		if ((nr) > events_consumer_stats.max_per_wakeup)			\
+			events_consumer_stats.max_per_wakeup = (nr);			\
 	} while(0)
 
-#define INIT_EVENT_THREAD(event) pthread_t event##_tid
+#define INIT_EVENTS_THREAD() pthread_t events_tid
 
-#define CREATE_EVENT_THREAD(event) do {							\
-		ret = pthread_create(&event##_tid, NULL, event##_thread_fn, NULL);	\
+#define CREATE_EVENTS_THREAD() do {							\
+		ret = pthread_create(&events_tid, NULL, events_thread_fn, NULL);	\
 		if (ret) {								\
-			fprintf(stderr, "Failed to create " #event " thread: %d\n", ret); \
+			fprintf(stderr, "Failed to create events thread: %d\n", ret);	\
 			goto cleanup;							\
 		}									\
 	} while(0)
 
-#define DESTROY_EVENT_THREAD(event) do {						\
-		ret = pthread_join(event##_tid, NULL);					\
+#define DESTROY_EVENTS_THREAD() do {							\
+		ret = pthread_join(events_tid, NULL);					\
 		if (ret)								\
-			fprintf(stderr, "Failed to destory " #event " thread: %d\n", ret); \
+			fprintf(stderr, "Failed to destory events thread: %d\n", ret);	\
 	} while(0)
 
-#define EVENT_THREAD_FN(event)								\
-	void *event##_thread_fn(void *data)						\
+/*
+ * Block on the ring_buffer manager epoll fd and consume whatever is ready.
+ * Producers may submit without waking us up and only wake us once enough data
+ * piled up, so consume on timeout too to pick up what is below the threshold.
+ */
+#define EVENTS_THREAD_FN()								\
+	void *events_thread_fn(void *data)						\
 	{										\
-		int ret;								\
-		INIT_EVENT_RB(event);							\
-		CREATE_EVENT_RB(event);							\
-		while (!done) {							\
-			POLL_EVENT_RB(event);						\
-			usleep(10000);							\
+		struct epoll_event ev;							\
+		int epfd, ret;								\
+		epfd = ring_buffer__epoll_fd(events_rb);				\
+		while (!done) {								\
+			ret = epoll_wait(epfd, &ev, 1, 100);				\
+			if (ret < 0) {							\
+				if (errno == EINTR)					\
+					continue;					\
+				perror("Error waiting on events epoll fd");		\
+				break;							\
+			}								\
+			if (!ret) {							\
+				ret = ring_buffer__consume(events_rb);			\
+				if (ret > 0)						\
+					events_consumer_stats.polled += ret;		\
+				continue;						\
+			}								\
+			ret = ring_buffer__consume(events_rb);				\
+			if (ret < 0) {							\
+				fprintf(stderr, "Error consuming ring buffers: %d\n", ret); \
+				break;							\
+			}								\
+			pr_debug("[events] consumed %d events\n", ret);		\
+			ACCOUNT_EVENTS_CONSUMED(ret);					\
 		}									\
-	cleanup:									\
-		DESTROY_EVENT_RB(event);						\
+		/* Drain what was left behind after we were told to stop */		\
+		ret = ring_buffer__consume(events_rb);					\
+		if (ret > 0)								\
+			ACCOUNT_EVENTS_CONSUMED(ret);					\
 		return NULL;								\
 	}
 #endif /* __EVENTS_DEFS_H__ */
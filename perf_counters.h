@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Counters of the calling thread, on whatever CPU it runs. Each one is opened
+ * on its own so that task-clock still works where there's no PMU (VMs) and
+ * is read with the enabled/running times to scale for multiplexing.
+ *
+ * cycles and instructions only count userspace so they work with the default
+ * perf_event_paranoid. task-clock can't exclude the kernel, so cycles per
+ * task-clock ns undercounts the frequency by the share of kernel time.
+ */
+enum perf_counter {
+	PERF_COUNTER_TASK_CLOCK,
+	PERF_COUNTER_CYCLES,
+	PERF_COUNTER_INSTRUCTIONS,
+	NR_PERF_COUNTERS,
+};
+
+static const char * const perf_counter_names[NR_PERF_COUNTERS] = {
+	[PERF_COUNTER_TASK_CLOCK]	= "task-clock",
+	[PERF_COUNTER_CYCLES]		= "cycles",
+	[PERF_COUNTER_INSTRUCTIONS]	= "instructions",
+};
+
+/* As read(): value, time enabled, time running */
+struct perf_counter_raw {
+	unsigned long long value;
+	unsigned long long enabled;
+	unsigned long long running;
+};
+
+struct perf_counters {
+	int fd[NR_PERF_COUNTERS];
+	struct perf_counter_raw start[NR_PERF_COUNTERS];
+	/* Counted between the last perf_counters_start() and perf_counters_stop() */
+	unsigned long long delta[NR_PERF_COUNTERS];
+};
+
+static inline int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+				  int group_fd, unsigned long flags)
+{
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static inline bool perf_counter_valid(const struct perf_counters *pc, enum perf_counter c)
+{
+	return pc->fd[c] >= 0;
+}
+
+static inline void perf_counter_read(const struct perf_counters *pc, enum perf_counter c,
+				     struct perf_counter_raw *raw)
+{
+	if (!perf_counter_valid(pc, c) || read(pc->fd[c], raw, sizeof(*raw)) != sizeof(*raw))
+		memset(raw, 0, sizeof(*raw));
+}
+
+/*
+ * Scale what was counted between start and end by the share of that interval
+ * the counter was actually running for.
+ */
+static inline unsigned long long perf_counter_delta(const struct perf_counter_raw *start,
+						    const struct perf_counter_raw *end)
+{
+	unsigned long long value = end->value - start->value;
+	unsigned long long enabled = end->enabled - start->enabled;
+	unsigned long long running = end->running - start->running;
+
+	if (!running || end->running < start->running)
+		return 0;
+
+	return running < enabled ? (double)value * enabled / running : value;
+}
+
+/*
+ * Returns 0 if at least task-clock could be opened, the counters that
+ * couldn't are left invalid.
+ */
+static inline int perf_counters_open(struct perf_counters *pc)
+{
+	static const struct {
+		__u32 type;
+		__u64 config;
+	} events[NR_PERF_COUNTERS] = {
+		[PERF_COUNTER_TASK_CLOCK]	= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+		[PERF_COUNTER_CYCLES]		= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		[PERF_COUNTER_INSTRUCTIONS]	= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	};
+	struct perf_event_attr attr;
+	int i;
+
+	memset(pc, 0, sizeof(*pc));
+
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.exclude_kernel = events[i].type == PERF_TYPE_HARDWARE;
+		attr.exclude_hv = 1;
+
+		pc->fd[i] = perf_event_open(&attr, 0, -1, -1, 0);
+		if (pc->fd[i] < 0) {
+			fprintf(stderr, "Can't open %s counter: ", perf_counter_names[i]);
+			perror("");
+		}
+	}
+
+	return perf_counter_valid(pc, PERF_COUNTER_TASK_CLOCK) ? 0 : -1;
+}
+
+static inline void perf_counters_start(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; i++)
+		perf_counter_read(pc, i, &pc->start[i]);
+}
+
+static inline void perf_counters_stop(struct perf_counters *pc)
+{
+	struct perf_counter_raw end;
+	int i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		perf_counter_read(pc, i, &end);
+		pc->delta[i] = perf_counter_delta(&pc->start[i], &end);
+	}
+}
+
+static inline void perf_counters_close(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		if (pc->fd[i] >= 0)
+			close(pc->fd[i]);
+		pc->fd[i] = -1;
+	}
+}
+
+#endif /* __PERF_COUNTERS_H__ */
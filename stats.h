@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Simple latency samples collection. Samples are stored in a preallocated
+ * array so adding one is cheap enough to be done on the measured path;
+ * anything past the array size is dropped and only counted.
+ */
+struct samples {
+	unsigned long long *v;
+	size_t len;
+	size_t size;
+	unsigned long long dropped;
+	unsigned long long sum;
+	unsigned long long max;
+};
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int samples_init(struct samples *s, size_t size)
+{
+	memset(s, 0, sizeof(*s));
+
+	s->v = malloc(size * sizeof(*s->v));
+	if (!s->v)
+		return -1;
+
+	s->size = size;
+	return 0;
+}
+
+static inline void samples_free(struct samples *s)
+{
+	free(s->v);
+	memset(s, 0, sizeof(*s));
+}
+
+static inline void samples_add(struct samples *s, unsigned long long v)
+{
+	s->sum += v;
+	if (v > s->max)
+		s->max = v;
+
+	if (s->len == s->size) {
+		s->dropped++;
+		return;
+	}
+
+	s->v[s->len++] = v;
+}
+
+static inline void samples_merge(struct samples *dst, struct samples *src)
+{
+	size_t i;
+
+	for (i = 0; i < src->len; i++)
+		samples_add(dst, src->v[i]);
+
+	dst->dropped += src->dropped;
+}
+
+static inline unsigned long long samples_count(struct samples *s)
+{
+	return s->len + s->dropped;
+}
+
+static inline unsigned long long samples_mean(struct samples *s)
+{
+	unsigned long long count = samples_count(s);
+
+	return count ? s->sum / count : 0;
+}
+
+static inline int __samples_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Sorts the samples in place, call once all samples were added.
+ */
+static inline void samples_sort(struct samples *s)
+{
+	qsort(s->v, s->len, sizeof(*s->v), __samples_cmp);
+}
+
+/*
+ * @p is in [0, 100]. The samples must be sorted.
+ */
+static inline unsigned long long samples_percentile(struct samples *s, double p)
+{
+	size_t idx;
+
+	if (!s->len)
+		return 0;
+
+	idx = (size_t)(p / 100 * (s->len - 1) + 0.5);
+	return s->v[idx < s->len ? idx : s->len - 1];
+}
+
+/*
+ * Histogram of log2 slots as the BPF programs build them: slot 0 counts 0,
+ * slot i counts [2^(i - 1), 2^i) and the last one anything bigger.
+ *
+ * @p is in [0, 100]. Returns the upper bound of the slot the quantile falls
+ * in, no more than max. Pass ULLONG_MAX when the max isn't known.
+ */
+static inline unsigned long long log2_hist_quantile(const unsigned long long *slots,
+						    unsigned int nr_slots,
+						    unsigned long long count,
+						    unsigned long long max, double p)
+{
+	unsigned long long target = count * p / 100, sum = 0, v;
+	unsigned int i;
+
+	for (i = 0; i < nr_slots - 1; i++) {
+		sum += slots[i];
+		if (sum > target)
+			break;
+	}
+
+	v = i ? (1ULL << i) - 1 : 0;
+	return v < max ? v : max;
+}
+
+/*
+ * Fixed memory histogram of a util signal, [0, 1024] in UTIL_HIST_WIDTH wide
+ * slots with anything bigger going into the last one. Quantiles are accurate
+ * to UTIL_HIST_WIDTH however many values are added.
+ */
+#define UTIL_HIST_WIDTH		8
+#define UTIL_HIST_SLOTS		(1024 / UTIL_HIST_WIDTH + 1)
+
+struct util_hist {
+	unsigned long long count;
+	unsigned long max;
+	unsigned long long slots[UTIL_HIST_SLOTS];
+};
+
+static inline void util_hist_add(struct util_hist *h, unsigned long v)
+{
+	unsigned long slot = v / UTIL_HIST_WIDTH;
+
+	h->slots[slot < UTIL_HIST_SLOTS ? slot : UTIL_HIST_SLOTS - 1]++;
+	h->count++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/*
+ * @p is in [0, 100]. Returns the upper bound of the slot the quantile falls
+ * in.
+ */
+static inline unsigned long util_hist_quantile(const struct util_hist *h, double p)
+{
+	unsigned long long target = h->count * p / 100, sum = 0;
+	unsigned long v;
+	int i;
+
+	for (i = 0; i < UTIL_HIST_SLOTS; i++) {
+		sum += h->slots[i];
+		if (sum > target)
+			break;
+	}
+
+	v = (i + 1) * UTIL_HIST_WIDTH - 1;
+	return v < h->max ? v : h->max;
+}
+
+/*
+ * Fixed memory log-linear histogram of latencies in ns. Every power of 2 is
+ * split in LOGLIN_HIST_SUB linear slots, so quantiles are within
+ * 1/LOGLIN_HIST_SUB of the real value whatever its magnitude and however many
+ * values are added.
+ */
+#define LOGLIN_HIST_SUB_BITS	6
+#define LOGLIN_HIST_SUB		(1 << LOGLIN_HIST_SUB_BITS)
+#define LOGLIN_HIST_SLOTS	((64 - LOGLIN_HIST_SUB_BITS + 1) * LOGLIN_HIST_SUB)
+
+struct loglin_hist {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned long long slots[LOGLIN_HIST_SLOTS];
+};
+
+static inline unsigned int loglin_hist_slot(unsigned long long v)
+{
+	unsigned int shift;
+
+	if (v < LOGLIN_HIST_SUB)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - LOGLIN_HIST_SUB_BITS;
+	return (shift + 1) * LOGLIN_HIST_SUB + (v >> shift) - LOGLIN_HIST_SUB;
+}
+
+/* Smallest value that goes in slot */
+static inline unsigned long long loglin_hist_slot_min(unsigned int slot)
+{
+	unsigned int shift;
+
+	if (slot < LOGLIN_HIST_SUB)
+		return slot;
+
+	shift = slot / LOGLIN_HIST_SUB - 1;
+	return (unsigned long long)(LOGLIN_HIST_SUB + slot % LOGLIN_HIST_SUB) << shift;
+}
+
+static inline void loglin_hist_add(struct loglin_hist *h, unsigned long long v)
+{
+	h->slots[loglin_hist_slot(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+static inline void loglin_hist_merge(struct loglin_hist *dst, const struct loglin_hist *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < LOGLIN_HIST_SLOTS; i++)
+		dst->slots[i] += src->slots[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static inline unsigned long long loglin_hist_mean(const struct loglin_hist *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+/*
+ * @p is in [0, 100]. Returns the upper bound of the slot the quantile falls
+ * in.
+ */
+static inline unsigned long long loglin_hist_quantile(const struct loglin_hist *h, double p)
+{
+	unsigned long long target = h->count * p / 100, sum = 0, v;
+	unsigned int i;
+
+	for (i = 0; i < LOGLIN_HIST_SLOTS - 1; i++) {
+		sum += h->slots[i];
+		if (sum > target)
+			break;
+	}
+
+	v = loglin_hist_slot_min(i + 1) - 1;
+	return v < h->max ? v : h->max;
+}
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,413 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#ifndef __UCLAMP_CGROUP_H__
+#define __UCLAMP_CGROUP_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capacities.h"
+#include "stats.h"
+
+/*
+ * A cgroup v2 hierarchy to clamp tasks with cpu.uclamp.min/max.
+ *
+ * The tree is depth levels of fanout children each under a base group made
+ * at the root of the cgroup2 mount. Nodes are numbered breadth first, node 0
+ * is the base and the children of node n are n * fanout + 1 to
+ * n * fanout + fanout. All but the base are threaded so that the threads of
+ * the calling process can be spread over the leaves, cpu is a threaded
+ * controller.
+ *
+ * The requested values of every node are kept and the effective ones worked
+ * out like cpu_util_update_eff() does, so that the clamp a task should end up
+ * with can be told without reading anything back from the kernel.
+ */
+#define CGROUP2_MOUNT		"/sys/fs/cgroup"
+#define CGROUP_MAX_DEPTH	32
+#define CGROUP_MAX_NODES	4096
+
+enum uclamp_cgroup_knob {
+	UCLAMP_CGROUP_MIN,
+	UCLAMP_CGROUP_MAX,
+	NR_UCLAMP_CGROUP_KNOBS,
+};
+
+static const char * const uclamp_cgroup_names[NR_UCLAMP_CGROUP_KNOBS] = {
+	[UCLAMP_CGROUP_MIN]	= "cpu.uclamp.min",
+	[UCLAMP_CGROUP_MAX]	= "cpu.uclamp.max",
+};
+
+struct uclamp_cgroup_tree {
+	int depth;
+	int fanout;
+	int nr_nodes;
+	char **path;
+	unsigned long *req[NR_UCLAMP_CGROUP_KNOBS];
+	unsigned long *eff[NR_UCLAMP_CGROUP_KNOBS];
+	/* The cgroup the process was in before uclamp_cgroup_enter() */
+	char orig[PATH_MAX];
+	/* cpu was enabled in the root's subtree_control by us */
+	bool root_cpu;
+};
+
+/* Returns -1 if the tree would be deeper or bigger than we allow */
+static inline int uclamp_cgroup_nr_nodes(int depth, int fanout)
+{
+	long nodes = 1, level = 1;
+	int i;
+
+	if (depth < 0 || depth > CGROUP_MAX_DEPTH || fanout < 1)
+		return -1;
+
+	for (i = 0; i < depth; i++) {
+		level *= fanout;
+		nodes += level;
+		if (nodes > CGROUP_MAX_NODES)
+			return -1;
+	}
+
+	return nodes;
+}
+
+static inline int uclamp_cgroup_level_first(const struct uclamp_cgroup_tree *t, int level)
+{
+	return level ? uclamp_cgroup_nr_nodes(level - 1, t->fanout) : 0;
+}
+
+static inline int uclamp_cgroup_nr_leaves(const struct uclamp_cgroup_tree *t)
+{
+	return t->nr_nodes - uclamp_cgroup_level_first(t, t->depth);
+}
+
+static inline int uclamp_cgroup_parent(const struct uclamp_cgroup_tree *t, int node)
+{
+	return node ? (node - 1) / t->fanout : -1;
+}
+
+static inline int uclamp_cgroup_write(const char *dir, const char *file, const char *str)
+{
+	char path[PATH_MAX];
+	ssize_t len = strlen(str);
+	int fd, ret = 0;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path)) {
+		fprintf(stderr, "Path of %s in %s is too long\n", file, dir);
+		return -1;
+	}
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, str, len) != len) {
+		fprintf(stderr, "Can't write '%s' to %s: %s\n", str, path, strerror(errno));
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+/* Whether controller is enabled in the space separated list of dir/file */
+static inline int uclamp_cgroup_has_controller(const char *dir, const char *file,
+					       const char *controller)
+{
+	char path[PATH_MAX], buf[256], *tok, *save;
+	int found = 0;
+	FILE *f;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path)) {
+		fprintf(stderr, "Path of %s in %s is too long\n", file, dir);
+		return -1;
+	}
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Can't read %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fgets(buf, sizeof(buf), f)) {
+		for (tok = strtok_r(buf, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+			if (!strcmp(tok, controller)) {
+				found = 1;
+				break;
+			}
+		}
+	}
+	fclose(f);
+
+	return found;
+}
+
+/*
+ * Effective clamps of every node: each is restricted by its parent's, and
+ * min can't be above max. The root group doesn't restrict anything.
+ */
+static inline void uclamp_cgroup_update_eff(struct uclamp_cgroup_tree *t)
+{
+	unsigned long *eff_min = t->eff[UCLAMP_CGROUP_MIN];
+	unsigned long *eff_max = t->eff[UCLAMP_CGROUP_MAX];
+	int n, parent;
+
+	for (n = 0; n < t->nr_nodes; n++) {
+		unsigned long parent_min = SCHED_CAPACITY_SCALE, parent_max = SCHED_CAPACITY_SCALE;
+
+		parent = uclamp_cgroup_parent(t, n);
+		if (parent >= 0) {
+			parent_min = eff_min[parent];
+			parent_max = eff_max[parent];
+		}
+
+		eff_min[n] = t->req[UCLAMP_CGROUP_MIN][n];
+		eff_max[n] = t->req[UCLAMP_CGROUP_MAX][n];
+		if (eff_min[n] > parent_min)
+			eff_min[n] = parent_min;
+		if (eff_max[n] > parent_max)
+			eff_max[n] = parent_max;
+		if (eff_min[n] > eff_max[n])
+			eff_min[n] = eff_max[n];
+	}
+}
+
+/*
+ * What uclamp_tg_restrict() makes of a task request in node. The system
+ * defaults are assumed to be left at 1024 and not to restrict anything.
+ */
+static inline unsigned long uclamp_cgroup_task_eff(const struct uclamp_cgroup_tree *t, int node,
+						   unsigned long req)
+{
+	unsigned long tg_min = t->eff[UCLAMP_CGROUP_MIN][node];
+	unsigned long tg_max = t->eff[UCLAMP_CGROUP_MAX][node];
+
+	if (req < tg_min)
+		return tg_min;
+	if (req > tg_max)
+		return tg_max;
+	return req;
+}
+
+static inline void uclamp_cgroup_tree_free(struct uclamp_cgroup_tree *t)
+{
+	int i;
+
+	if (t->path) {
+		for (i = 0; i < t->nr_nodes; i++)
+			free(t->path[i]);
+	}
+	free(t->path);
+	for (i = 0; i < NR_UCLAMP_CGROUP_KNOBS; i++) {
+		free(t->req[i]);
+		free(t->eff[i]);
+	}
+	memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Remove the groups children first, they must be empty by now. cpu is
+ * disabled again at the root if it was enabled by uclamp_cgroup_tree_create().
+ */
+static inline void uclamp_cgroup_tree_destroy(struct uclamp_cgroup_tree *t)
+{
+	int n;
+
+	for (n = t->nr_nodes - 1; n >= 0; n--) {
+		if (t->path[n] && rmdir(t->path[n]) && errno != ENOENT)
+			fprintf(stderr, "Can't remove %s: %s\n", t->path[n], strerror(errno));
+	}
+
+	if (t->root_cpu)
+		uclamp_cgroup_write(CGROUP2_MOUNT, "cgroup.subtree_control", "-cpu");
+
+	uclamp_cgroup_tree_free(t);
+}
+
+static inline int uclamp_cgroup_tree_create(struct uclamp_cgroup_tree *t, int depth, int fanout)
+{
+	char path[PATH_MAX];
+	int n, i, leaves, ret;
+
+	memset(t, 0, sizeof(*t));
+	t->depth = depth;
+	t->fanout = fanout;
+	t->nr_nodes = uclamp_cgroup_nr_nodes(depth, fanout);
+	if (t->nr_nodes < 0) {
+		fprintf(stderr, "cgroup tree of depth %d and fan-out %d is too big\n", depth, fanout);
+		return -1;
+	}
+
+	t->path = calloc(t->nr_nodes, sizeof(*t->path));
+	for (i = 0; i < NR_UCLAMP_CGROUP_KNOBS; i++) {
+		t->req[i] = calloc(t->nr_nodes, sizeof(*t->req[i]));
+		t->eff[i] = calloc(t->nr_nodes, sizeof(*t->eff[i]));
+		if (!t->req[i] || !t->eff[i])
+			goto err_alloc;
+	}
+	if (!t->path)
+		goto err_alloc;
+
+	for (n = 0; n < t->nr_nodes; n++)
+		t->req[UCLAMP_CGROUP_MAX][n] = SCHED_CAPACITY_SCALE;
+	uclamp_cgroup_update_eff(t);
+
+	/*
+	 * The base needs cpu to enable it for its children. Usually done
+	 * already, if not it's only enabled for as long as the tree exists.
+	 */
+	ret = uclamp_cgroup_has_controller(CGROUP2_MOUNT, "cgroup.subtree_control", "cpu");
+	if (ret < 0)
+		goto err;
+	if (!ret) {
+		if (uclamp_cgroup_write(CGROUP2_MOUNT, "cgroup.subtree_control", "+cpu"))
+			goto err;
+		t->root_cpu = true;
+	}
+
+	leaves = uclamp_cgroup_nr_leaves(t);
+	for (n = 0; n < t->nr_nodes; n++) {
+		if (n)
+			snprintf(path, sizeof(path), "%s/%d", t->path[uclamp_cgroup_parent(t, n)],
+				 (n - 1) % fanout);
+		else
+			snprintf(path, sizeof(path), "%s/uclamp_test.%d", CGROUP2_MOUNT, getpid());
+
+		if (mkdir(path, 0755)) {
+			fprintf(stderr, "Can't create %s: %s\n", path, strerror(errno));
+			goto err;
+		}
+
+		t->path[n] = strdup(path);
+		if (!t->path[n]) {
+			rmdir(path);
+			goto err_alloc;
+		}
+
+		/* New groups under a threaded one start invalid until made threaded */
+		if (n && uclamp_cgroup_write(path, "cgroup.type", "threaded"))
+			goto err;
+
+		if (n < t->nr_nodes - leaves &&
+		    uclamp_cgroup_write(path, "cgroup.subtree_control", "+cpu"))
+			goto err;
+	}
+
+	return 0;
+err_alloc:
+	perror("Failed to allocate cgroup tree");
+err:
+	if (t->path)
+		uclamp_cgroup_tree_destroy(t);
+	else
+		uclamp_cgroup_tree_free(t);
+	return -1;
+}
+
+/*
+ * Move the whole process into the base group, its threads can only be spread
+ * over the threaded groups under it from there.
+ */
+static inline int uclamp_cgroup_enter(struct uclamp_cgroup_tree *t)
+{
+	char line[PATH_MAX + 8], str[16];
+	FILE *file;
+
+	t->orig[0] = '\0';
+	file = fopen("/proc/self/cgroup", "r");
+	if (!file) {
+		perror("Can't open /proc/self/cgroup");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		if (strncmp(line, "0::", 3))
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		if (snprintf(t->orig, sizeof(t->orig), "%s%s", CGROUP2_MOUNT,
+			     line + 3) >= (int)sizeof(t->orig))
+			t->orig[0] = '\0';
+		break;
+	}
+	fclose(file);
+
+	if (!t->orig[0]) {
+		fprintf(stderr, "Not in a cgroup v2 hierarchy\n");
+		return -1;
+	}
+
+	snprintf(str, sizeof(str), "%d", getpid());
+	return uclamp_cgroup_write(t->path[0], "cgroup.procs", str);
+}
+
+static inline int uclamp_cgroup_leave(struct uclamp_cgroup_tree *t)
+{
+	char str[16];
+
+	snprintf(str, sizeof(str), "%d", getpid());
+	return uclamp_cgroup_write(t->orig, "cgroup.procs", str);
+}
+
+static inline int uclamp_cgroup_attach_thread(struct uclamp_cgroup_tree *t, int node, pid_t tid)
+{
+	char str[16];
+
+	snprintf(str, sizeof(str), "%d", tid);
+	return uclamp_cgroup_write(t->path[node], "cgroup.threads", str);
+}
+
+/* Request value, in the 0..1024 capacity scale, for the knob of node */
+static inline void uclamp_cgroup_set_req(struct uclamp_cgroup_tree *t, int node,
+					 enum uclamp_cgroup_knob knob, unsigned long value)
+{
+	if (value > SCHED_CAPACITY_SCALE)
+		value = SCHED_CAPACITY_SCALE;
+
+	t->req[knob][node] = value;
+	uclamp_cgroup_update_eff(t);
+}
+
+/*
+ * Write the requested value of the knob of node. The files take a percentage
+ * with two decimals which the kernel rounds back to the same capacity.
+ *
+ * write_ns is how long the write() took: the kernel updates the effective
+ * clamps of all the descendants and of their runnable tasks before it
+ * returns.
+ */
+static inline int uclamp_cgroup_write_knob(struct uclamp_cgroup_tree *t, int node,
+					   enum uclamp_cgroup_knob knob,
+					   unsigned long long *write_ns)
+{
+	unsigned long value = t->req[knob][node];
+	unsigned long pct = (value * 10000 + SCHED_CAPACITY_SCALE / 2) / SCHED_CAPACITY_SCALE;
+	unsigned long long start;
+	char path[PATH_MAX], str[16];
+	ssize_t len, ret;
+	int fd;
+
+	if (value == SCHED_CAPACITY_SCALE)
+		len = snprintf(str, sizeof(str), "max");
+	else
+		len = snprintf(str, sizeof(str), "%lu.%02lu", pct / 100, pct % 100);
+
+	snprintf(path, sizeof(path), "%s/%s", t->path[node], uclamp_cgroup_names[knob]);
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	start = now_ns();
+	ret = write(fd, str, len);
+	*write_ns = now_ns() - start;
+	if (ret != len)
+		fprintf(stderr, "Can't write '%s' to %s: %s\n", str, path, strerror(errno));
+	close(fd);
+
+	return ret == len ? 0 : -1;
+}
+
+#endif /* __UCLAMP_CGROUP_H__ */
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#ifndef __UCLAMP_SYSCTL_H__
+#define __UCLAMP_SYSCTL_H__
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The global uclamp knobs. The fds are kept open and accessed with
+ * pread()/pwrite() at offset 0 so that reading or writing a knob is a single
+ * syscall.
+ */
+enum uclamp_sysctl {
+	UCLAMP_SYSCTL_MIN,
+	UCLAMP_SYSCTL_MAX,
+	UCLAMP_SYSCTL_MIN_RT_DEFAULT,
+	NR_UCLAMP_SYSCTLS,
+};
+
+static const char * const uclamp_sysctl_names[NR_UCLAMP_SYSCTLS] = {
+	[UCLAMP_SYSCTL_MIN]		= "sched_util_clamp_min",
+	[UCLAMP_SYSCTL_MAX]		= "sched_util_clamp_max",
+	[UCLAMP_SYSCTL_MIN_RT_DEFAULT]	= "sched_util_clamp_min_rt_default",
+};
+
+#define PROCFS_UCLAMP_SYSCTL	"/proc/sys/kernel/%s"
+
+struct uclamp_sysctls {
+	int fd[NR_UCLAMP_SYSCTLS];
+	int orig[NR_UCLAMP_SYSCTLS];
+};
+
+static inline int uclamp_sysctl_read(struct uclamp_sysctls *s, enum uclamp_sysctl knob)
+{
+	char str[16] = {};
+	ssize_t len;
+
+	len = pread(s->fd[knob], str, sizeof(str) - 1, 0);
+	if (len <= 0) {
+		perror("Can't read procfs");
+		return -1;
+	}
+
+	return atoi(str);
+}
+
+static inline int uclamp_sysctl_write(struct uclamp_sysctls *s, enum uclamp_sysctl knob, int value)
+{
+	char str[16];
+	int len;
+
+	len = snprintf(str, sizeof(str), "%d", value);
+	if (pwrite(s->fd[knob], str, len, 0) != len)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Open all the knobs and save their current value, uclamp_sysctl_close()
+ * restores them.
+ */
+static inline int uclamp_sysctl_open(struct uclamp_sysctls *s)
+{
+	char path[64];
+	int i;
+
+	for (i = 0; i < NR_UCLAMP_SYSCTLS; i++)
+		s->fd[i] = -1;
+
+	for (i = 0; i < NR_UCLAMP_SYSCTLS; i++) {
+		snprintf(path, sizeof(path), PROCFS_UCLAMP_SYSCTL, uclamp_sysctl_names[i]);
+		s->fd[i] = open(path, O_RDWR);
+		if (s->fd[i] < 0) {
+			fprintf(stderr, "Can't open %s: ", path);
+			perror("");
+			goto err;
+		}
+
+		s->orig[i] = uclamp_sysctl_read(s, i);
+		if (s->orig[i] < 0)
+			goto err;
+	}
+
+	return 0;
+err:
+	for (i = 0; i < NR_UCLAMP_SYSCTLS; i++) {
+		if (s->fd[i] >= 0)
+			close(s->fd[i]);
+		s->fd[i] = -1;
+	}
+	return -1;
+}
+
+static inline void uclamp_sysctl_close(struct uclamp_sysctls *s)
+{
+	int i;
+
+	if (s->fd[0] < 0)
+		return;
+
+	/*
+	 * The kernel rejects sched_util_clamp_min > sched_util_clamp_max, open
+	 * up max first so that min can be restored whatever they are now.
+	 */
+	uclamp_sysctl_write(s, UCLAMP_SYSCTL_MAX, 1024);
+	uclamp_sysctl_write(s, UCLAMP_SYSCTL_MIN, s->orig[UCLAMP_SYSCTL_MIN]);
+	uclamp_sysctl_write(s, UCLAMP_SYSCTL_MAX, s->orig[UCLAMP_SYSCTL_MAX]);
+	uclamp_sysctl_write(s, UCLAMP_SYSCTL_MIN_RT_DEFAULT, s->orig[UCLAMP_SYSCTL_MIN_RT_DEFAULT]);
+
+	for (i = 0; i < NR_UCLAMP_SYSCTLS; i++) {
+		close(s->fd[i]);
+		s->fd[i] = -1;
+	}
+}
+
+#endif /* __UCLAMP_SYSCTL_H__ */
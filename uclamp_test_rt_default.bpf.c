@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+
+#include "uclamp_test_rt_default.h"
+
+char LICENSE[] SEC("license") = "GPL";
+
+
+/* Global public variables shared with userspace*/
+/* Only the children of this process are checked */
+pid_t parent_tgid = 0;
+/* The value sched_util_clamp_min_rt_default was just set to */
+unsigned int expected_uclamp_min = 0;
+
+/* Reset by userspace before every pass */
+unsigned long long nr_checked = 0;
+unsigned long long nr_mismatches = 0;
+
+/*
+ * Propagation latency mode. Userspace bumps gen and sets write_ts right before
+ * every write to sched_util_clamp_min_rt_default; latencies are relative to
+ * write_ts.
+ */
+unsigned int gen = 0;
+unsigned long long write_ts = 0;
+unsigned long long nr_req = 0;
+unsigned long long nr_eff = 0;
+unsigned long long req_hist[LAT_HIST_SLOTS] = {};
+unsigned long long eff_hist[LAT_HIST_SLOTS] = {};
+
+
+/* Maps */
+/* Sized by userspace to the number of children in latency mode */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 1);
+	__type(key, pid_t);
+	__type(value, unsigned int);
+} eff_gen_map SEC(".maps");
+
+
+static __always_inline u32 log2_u64(u64 v)
+{
+	u32 shift, r;
+
+	r = (v > 0xFFFFFFFF) << 5; v >>= r;
+	shift = (v > 0xFFFF) << 4; v >>= shift; r |= shift;
+	shift = (v > 0xFF) << 3; v >>= shift; r |= shift;
+	shift = (v > 0xF) << 2; v >>= shift; r |= shift;
+	shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+	r |= (v >> 1);
+
+	return r;
+}
+
+static __always_inline void account_latency(unsigned long long *hist, unsigned long long *nr)
+{
+	u64 delta = bpf_ktime_get_ns() - write_ts;
+	u32 slot = delta ? log2_u64(delta) + 1 : 0;
+
+	if (slot >= LAT_HIST_SLOTS)
+		slot = LAT_HIST_SLOTS - 1;
+
+	__sync_fetch_and_add(&hist[slot], 1);
+	__sync_fetch_and_add(nr, 1);
+}
+
+static __always_inline bool is_child(struct task_struct *p)
+{
+	return BPF_CORE_READ(p, real_parent, tgid) == parent_tgid;
+}
+
+
+/*
+ * Walk all the tasks in the system and write a struct uclamp_mismatch to the
+ * iterator's seq_file for every child of parent_tgid whose uclamp_min request
+ * isn't expected_uclamp_min. A single read() of the iterator fd then verifies
+ * all the children.
+ */
+SEC("iter/task")
+int verify_uclamp_min(struct bpf_iter__task *ctx)
+{
+	struct seq_file *seq = ctx->meta->seq;
+	struct task_struct *p = ctx->task;
+	struct uclamp_mismatch m;
+
+	if (!p)
+		return 0;
+
+	if (BPF_CORE_READ(p, real_parent, tgid) != parent_tgid)
+		return 0;
+
+	nr_checked++;
+
+	m.uclamp_min = BPF_CORE_READ_BITFIELD(&p->uclamp_req[UCLAMP_MIN], value);
+	if (m.uclamp_min == expected_uclamp_min)
+		return 0;
+
+	m.pid = p->pid;
+	m.effective_uclamp_min = BPF_CORE_READ_BITFIELD(&p->uclamp[UCLAMP_MIN], value);
+	m.user_defined = BPF_CORE_READ_BITFIELD(&p->uclamp_req[UCLAMP_MIN], user_defined);
+	nr_mismatches++;
+
+	bpf_seq_write(seq, &m, sizeof(m));
+
+	return 0;
+}
+
+/*
+ * The sysctl handler walks all the tasks and updates the uclamp_min request of
+ * every RT task that didn't set one itself. It's a static function and might
+ * be inlined, so userspace treats it as optional.
+ */
+SEC("kprobe/uclamp_update_util_min_rt_default")
+int BPF_KPROBE(kprobe_uclamp_update_util_min_rt_default, struct task_struct *p)
+{
+	if (!gen || !is_child(p))
+		return 0;
+
+	account_latency(req_hist, &nr_req);
+
+	return 0;
+}
+
+/*
+ * The effective uclamp value is only refreshed when the task is enqueued,
+ * uclamp_rq_inc() runs just before enqueue_task_rt(). Account the first
+ * enqueue of every child with the new value.
+ */
+SEC("kprobe/enqueue_task_rt")
+int BPF_KPROBE(kprobe_enqueue_task_rt, struct rq *rq, struct task_struct *p)
+{
+	unsigned int uclamp_min, cur_gen = gen;
+	unsigned int *eff_gen;
+	pid_t pid;
+
+	if (!cur_gen || !is_child(p))
+		return 0;
+
+	uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(&p->uclamp[UCLAMP_MIN], value);
+	if (uclamp_min != expected_uclamp_min)
+		return 0;
+
+	pid = BPF_CORE_READ(p, pid);
+	eff_gen = bpf_map_lookup_elem(&eff_gen_map, &pid);
+	if (eff_gen) {
+		if (*eff_gen == cur_gen)
+			return 0;
+		*eff_gen = cur_gen;
+	} else {
+		bpf_map_update_elem(&eff_gen_map, &pid, &cur_gen, BPF_ANY);
+	}
+
+	account_latency(eff_hist, &nr_eff);
+
+	return 0;
+}
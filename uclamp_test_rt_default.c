@@ -1,7 +1,12 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 /* Copyright (C) 2022 Qais Yousef */
 #include "sched.h"
+#include "stats.h"
+#include "uclamp_sysctl.h"
 
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -11,10 +16,57 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "uclamp_test_rt_default.h"
+#include "uclamp_test_rt_default.skel.h"
+
 #define NR_FORKS	10000
 
-static int nr_forks = NR_FORKS;
-static pid_t pids[NR_FORKS];
+static int nr_tasks = NR_FORKS;
+static int nr_forks;
+static int nr_pids;
+static pid_t *pids;
+
+/*
+ * Fork storm mode: nr_fork_threads SCHED_FIFO threads, each pinned to a
+ * different CPU, fork nr_tasks children between them as fast as they can.
+ * Each forks an even share, so its latency samples are sized to that share.
+ */
+static bool storm = false;
+static int nr_fork_threads = 1;
+static int storm_cpus[CPU_SETSIZE];
+
+/*
+ * Verify all the children with a single read() of a BPF task iterator rather
+ * than a sched_getattr() per child. NULL if we fell back to sched_getattr().
+ */
+static struct uclamp_test_rt_default_bpf *skel;
+static bool force_getattr = false;
+
+/*
+ * Propagation latency mode: measure how long it takes for a new
+ * sched_util_clamp_min_rt_default to reach the children, for an increasing
+ * number of children.
+ */
+#define LATENCY_MIN_TASKS	100
+#define LATENCY_PASSES		10
+#define LATENCY_POLL_US		1000
+#define LATENCY_TIMEOUT_NS	(5 * 1000000000ULL)
+
+static bool latency = false;
+
+/*
+ * The children join the process group of an idle leader, so that a single
+ * kill() wakes all of them up and nothing else.
+ */
+static pid_t child_pgid;
+
+/*
+ * Sysctl sweep mode: time the kernel's global clamp update path by writing
+ * all the uclamp knobs concurrently.
+ */
+#define SWEEP_WRITES		10000
+
+static bool sweep = false;
 
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
@@ -26,67 +78,63 @@ static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 #define pr_debug(...)
 #endif
 
-#define PROCFS_RT_MIN	"/proc/sys/kernel/sched_util_clamp_min_rt_default"
-static int orig_rt_min;
+static struct uclamp_sysctls sysctls;
 static int test_rt_min = 333;
 
-static int read_rt_min(void)
+static void write_rt_min(int value)
 {
-	char str[16] = {};
-	int read;
-
-	FILE *fp = fopen(PROCFS_RT_MIN, "r");
-	if (!fp) {
-		perror("Can't open procfs");
-		return -1;
-	}
+	if (uclamp_sysctl_write(&sysctls, UCLAMP_SYSCTL_MIN_RT_DEFAULT, value))
+		perror("Failed to write sched_util_clamp_min_rt_default");
 
-	read = fread(str, 1, 16, fp);
-	fclose(fp);
-	if (!read)
-		return -1;
+	pr_debug("write_rt_min = %d\n", value);
+}
 
-	pr_debug("read_rt_min = %s\n", str);
+/*
+ * In latency mode the children must run to pick up the new effective
+ * uclamp_min, otherwise they just block until they're killed. They wait for
+ * the SIGUSR1 measure_propagation() sends to child_pgid after every write.
+ */
+static void child_wait(void)
+{
+	if (latency) {
+		setpgid(0, child_pgid);
+		for (;;)
+			pause();
+	}
 
-	return atoi(str);
+	pthread_mutex_lock(&mutex);
+	pthread_cond_wait(&cond, &mutex);
+	pthread_mutex_unlock(&mutex);
 }
 
-static void write_rt_min(int value)
+static int set_fifo(void)
 {
-	char str[16] = {};
-
-	FILE *fp = fopen(PROCFS_RT_MIN, "w");
-	if (!fp) {
-		perror("Can't open procfs");
-		return;
-	}
+	struct sched_param param;
+	int ret;
 
-	snprintf(str, 16, "%d", value);
-	fwrite(str, 1, strlen(str), fp);
-	fclose(fp);
+	param.sched_priority = 33;
+	ret = sched_setscheduler(0, SCHED_FIFO, &param);
+	if (ret)
+		perror("Failed to set policy to SCHED_FIFO");
 
-	pr_debug("write_rt_min = %s\n", str);
+	return ret;
 }
 
 static void *fork_loop(void *data)
 {
-	struct sched_param param;
-	int ret, i = 0;
+	int ret;
 	pid_t pid;
 
 	/* Set to SCHED_FIFO before we start */
-	param.sched_priority = 33;
-	ret = sched_setscheduler(0, SCHED_FIFO, &param);
-	if (ret) {
-		perror("Failed to set policy to SCHED_FIFO");
+	ret = set_fifo();
+	if (ret)
 		return NULL;
-	}
 
 	/*
 	 * fork() the specified number of threads saving the resulting pid in
 	 * pids[] array. Child process will then wait for a signal to exit.
 	 */
-	while (nr_forks--) {
+	while (nr_forks-- > 0) {
 		pid = fork();
 		if (!pid)
 			goto child;
@@ -94,17 +142,139 @@ static void *fork_loop(void *data)
 			perror("Failed to create a child process");
 			return NULL;
 		}
-		pids[i++] = pid;
+		/* Whichever of us runs first, the child is in the group before it's counted */
+		if (latency)
+			setpgid(pid, child_pgid);
+		pids[nr_pids++] = pid;
 
 		usleep(500);
 	}
 
 	return NULL;
 child:
-	pthread_mutex_lock(&mutex);
-	pthread_cond_wait(&cond, &mutex);
-	pthread_mutex_unlock(&mutex);
+	child_wait();
+
+	return NULL;
+}
+
+struct storm_thread {
+	pthread_t thread;
+	int cpu;
+	/* This thread's share of the forks */
+	int nr;
+	struct samples lat;
+};
+
+static void *storm_loop(void *data)
+{
+	struct storm_thread *st = data;
+	unsigned long long t0;
+	cpu_set_t cpuset;
+	int ret, i;
+	pid_t pid;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(st->cpu, &cpuset);
+	ret = sched_setaffinity(0, sizeof(cpuset), &cpuset);
+	if (ret) {
+		perror("Failed to set affinity");
+		return NULL;
+	}
+
+	ret = set_fifo();
+	if (ret)
+		return NULL;
+
+	while (st->nr-- > 0 && __atomic_fetch_sub(&nr_forks, 1, __ATOMIC_RELAXED) > 0) {
+		t0 = now_ns();
+		pid = fork();
+		if (!pid)
+			goto child;
+		if (pid == -1) {
+			perror("Failed to create a child process");
+			return NULL;
+		}
+		/* Whichever of us runs first, the child is in the group before it's counted */
+		if (latency)
+			setpgid(pid, child_pgid);
+		samples_add(&st->lat, now_ns() - t0);
+
+		i = __atomic_fetch_add(&nr_pids, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&pids[i], pid, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+child:
+	child_wait();
+
+	return NULL;
+}
+
+static void *storm_fork_loop(void *data)
+{
+	unsigned long long t0, elapsed;
+	struct storm_thread *threads = NULL;
+	int nr = __atomic_load_n(&nr_forks, __ATOMIC_RELAXED);
+	struct samples lat = {};
+	int nr_cpus = 0, cpu, i, ret;
+	cpu_set_t cpuset;
+
+	/* Only the CPUs we're allowed to run on, offline ones aren't in the mask */
+	CPU_ZERO(&cpuset);
+	if (sched_getaffinity(0, sizeof(cpuset), &cpuset)) {
+		perror("Failed to get affinity");
+		goto out;
+	}
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &cpuset))
+			storm_cpus[nr_cpus++] = cpu;
+	}
+
+	threads = calloc(nr_fork_threads, sizeof(*threads));
+	if (!threads || samples_init(&lat, nr > 0 ? nr : 1)) {
+		perror("Failed to allocate fork storm threads");
+		goto out;
+	}
+
+	t0 = now_ns();
+
+	for (i = 0; i < nr_fork_threads; i++) {
+		threads[i].cpu = storm_cpus[i % nr_cpus];
+		threads[i].nr = nr / nr_fork_threads + (i < nr % nr_fork_threads);
+		if (samples_init(&threads[i].lat, threads[i].nr ? threads[i].nr : 1)) {
+			perror("Failed to allocate fork latency samples");
+			break;
+		}
+		ret = pthread_create(&threads[i].thread, NULL, storm_loop, &threads[i]);
+		if (ret) {
+			perror("Failed to create fork storm thread");
+			samples_free(&threads[i].lat);
+			break;
+		}
+	}
+	nr_fork_threads = i;
 
+	for (i = 0; i < nr_fork_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		samples_merge(&lat, &threads[i].lat);
+		samples_free(&threads[i].lat);
+	}
+
+	elapsed = now_ns() - t0;
+
+	samples_sort(&lat);
+	printf("Forked %llu RT tasks from %d threads in %.3f s: %.0f forks/s\n",
+	       samples_count(&lat), nr_fork_threads, elapsed / 1e9,
+	       samples_count(&lat) * 1e9 / elapsed);
+	printf("fork latency p50: %llu us p99: %llu us max: %llu us\n",
+	       samples_percentile(&lat, 50) / 1000, samples_percentile(&lat, 99) / 1000,
+	       lat.max / 1000);
+
+out:
+	/* Make sure test_loop() doesn't wait for forks that will never happen */
+	__atomic_store_n(&nr_forks, 0, __ATOMIC_RELAXED);
+	samples_free(&lat);
+	free(threads);
 	return NULL;
 }
 
@@ -133,25 +303,24 @@ static int verify_pid(pid_t pid)
 	return 0;
 }
 
-static int verify(void)
+static int verify_getattr(void)
 {
 	int i, ret;
 
-	/* flush any messages we printed into stdout */
-	fflush(stdout);
-
-	for (i = 0; i < NR_FORKS; i++) {
+	for (i = 0; i < nr_tasks; i++) {
+		pid_t pid = __atomic_load_n(&pids[i], __ATOMIC_ACQUIRE);
 
 		/*
-		 * If a pid is 0, it means we got an error.
+		 * If a pid is 0, it means we got an error or the fork is still
+		 * in flight.
 		 *
 		 * We carry on anyway to cleanup and not end up with zombie
 		 * tasks.
 		 */
-		if (!pids[i])
+		if (!pid)
 			break;
 
-		ret = verify_pid(pids[i]);
+		ret = verify_pid(pid);
 		if (ret)
 			return ret;
 
@@ -162,13 +331,151 @@ static int verify(void)
 	return 0;
 }
 
-static void *test_loop(void *data)
+#define NR_MISMATCH_BUF	64
+
+static int verify_iter(void)
+{
+	struct uclamp_mismatch buf[NR_MISMATCH_BUF];
+	int nr_expected, fd, i, ret = 0;
+	size_t len = 0;
+	ssize_t n;
+
+	/* Every child counted in nr_pids has returned from fork() */
+	nr_expected = __atomic_load_n(&nr_pids, __ATOMIC_ACQUIRE);
+
+	skel->bss->expected_uclamp_min = test_rt_min;
+	skel->bss->nr_checked = 0;
+	skel->bss->nr_mismatches = 0;
+
+	fd = bpf_iter_create(bpf_link__fd(skel->links.verify_uclamp_min));
+	if (fd < 0) {
+		perror("Failed to create task iterator");
+		return -1;
+	}
+
+	while ((n = read(fd, (char *)buf + len, sizeof(buf) - len)) > 0) {
+		len += n;
+
+		for (i = 0; i < len / sizeof(buf[0]); i++) {
+			printf("pid %d has %u but default should be %d (effective %u%s)\n",
+			       buf[i].pid, buf[i].uclamp_min, test_rt_min,
+			       buf[i].effective_uclamp_min,
+			       buf[i].user_defined ? ", user defined" : "");
+		}
+
+		/* Keep any partial record for the next read() */
+		memmove(buf, &buf[i], len - i * sizeof(buf[0]));
+		len -= i * sizeof(buf[0]);
+	}
+	if (n < 0) {
+		perror("Failed to read task iterator");
+		ret = -1;
+	}
+
+	close(fd);
+
+	if (skel->bss->nr_mismatches)
+		ret = -1;
+
+	if (skel->bss->nr_checked < nr_expected) {
+		printf("Only found %llu of %d forked tasks\n",
+		       skel->bss->nr_checked, nr_expected);
+		ret = -1;
+	}
+
+	pr_debug("checked %llu tasks, %llu mismatches\n",
+		 skel->bss->nr_checked, skel->bss->nr_mismatches);
+
+	return ret;
+}
+
+static int verify(void)
+{
+	/* flush any messages we printed into stdout */
+	fflush(stdout);
+
+	if (skel)
+		return verify_iter();
+
+	return verify_getattr();
+}
+
+/*
+ * Load the task iterator and, in latency mode, the propagation probes. Any
+ * failure to load the iterator isn't fatal, verify() falls back to calling
+ * sched_getattr() on every child.
+ */
+static int skel_init(void)
 {
 	int ret;
 
-	orig_rt_min = read_rt_min();
+	if (force_getattr && !latency)
+		return 0;
+
+	skel = uclamp_test_rt_default_bpf__open();
+	if (!skel) {
+		fprintf(stderr, "Failed to open BPF skeleton\n");
+		goto fallback;
+	}
 
-	while (nr_forks > 0) {
+	skel->bss->parent_tgid = getpid();
+
+	bpf_program__set_autoload(skel->progs.kprobe_uclamp_update_util_min_rt_default, latency);
+	bpf_program__set_autoload(skel->progs.kprobe_enqueue_task_rt, latency);
+	if (latency) {
+		ret = bpf_map__set_max_entries(skel->maps.eff_gen_map, nr_tasks);
+		if (ret) {
+			fprintf(stderr, "Failed to size eff_gen_map: %d\n", ret);
+			goto fallback;
+		}
+	}
+
+	ret = uclamp_test_rt_default_bpf__load(skel);
+	if (ret) {
+		fprintf(stderr, "Failed to load and verify BPF skeleton\n");
+		goto fallback;
+	}
+
+	skel->links.verify_uclamp_min = bpf_program__attach(skel->progs.verify_uclamp_min);
+	if (!skel->links.verify_uclamp_min) {
+		fprintf(stderr, "Failed to attach BPF task iterator\n");
+		goto fallback;
+	}
+
+	if (latency) {
+		skel->links.kprobe_enqueue_task_rt =
+			bpf_program__attach(skel->progs.kprobe_enqueue_task_rt);
+		if (!skel->links.kprobe_enqueue_task_rt) {
+			fprintf(stderr, "Failed to attach enqueue_task_rt probe\n");
+			goto fallback;
+		}
+
+		skel->links.kprobe_uclamp_update_util_min_rt_default =
+			bpf_program__attach(skel->progs.kprobe_uclamp_update_util_min_rt_default);
+		if (!skel->links.kprobe_uclamp_update_util_min_rt_default)
+			fprintf(stderr, "uclamp_update_util_min_rt_default() can't be probed, only reporting enqueue latency\n");
+	}
+
+	/* Latency and sweep modes don't verify the children */
+	if (!latency && !sweep)
+		printf("Verifying with BPF task iterator\n");
+	return 0;
+fallback:
+	uclamp_test_rt_default_bpf__destroy(skel);
+	skel = NULL;
+
+	if (latency)
+		return -1;
+
+	fprintf(stderr, "Falling back to sched_getattr()\n");
+	return 0;
+}
+
+static void *test_loop(void *data)
+{
+	int ret;
+
+	while (__atomic_load_n(&nr_forks, __ATOMIC_RELAXED) > 0) {
 		if (test_rt_min > 1024)
 			test_rt_min = 0;
 
@@ -181,16 +488,384 @@ static void *test_loop(void *data)
 	printf("All forked RT tasks had the correct uclamp.min\n");
 
 out:
-	write_rt_min(orig_rt_min);
 	return NULL;
 }
 
+static void print_lat_hist(const char *name, unsigned long long *slots, unsigned long long count)
+{
+	int i;
+
+	if (!count) {
+		printf("  %s: no events\n", name);
+		return;
+	}
+
+	printf("  %s: %llu events p50: < %llu us p90: < %llu us p99: < %llu us\n", name, count,
+	       log2_hist_quantile(slots, LAT_HIST_SLOTS, count, ULLONG_MAX, 50) / 1000,
+	       log2_hist_quantile(slots, LAT_HIST_SLOTS, count, ULLONG_MAX, 90) / 1000,
+	       log2_hist_quantile(slots, LAT_HIST_SLOTS, count, ULLONG_MAX, 99) / 1000);
+
+	for (i = 0; i < LAT_HIST_SLOTS; i++) {
+		if (!slots[i])
+			continue;
+		printf("    [%12llu, %12llu) ns: %llu\n",
+		       i ? 1ULL << (i - 1) : 0, 1ULL << i, slots[i]);
+	}
+}
+
+/*
+ * Write LATENCY_PASSES new values, wake up the children and wait for every one
+ * of them to be enqueued with each of them. The histograms accumulate over all
+ * the passes, write_lat gets how long each write took.
+ */
+static int measure_propagation(int count, struct samples *write_lat)
+{
+	unsigned long long t0;
+	int pass;
+
+	memset(skel->bss->req_hist, 0, sizeof(skel->bss->req_hist));
+	memset(skel->bss->eff_hist, 0, sizeof(skel->bss->eff_hist));
+
+	for (pass = 0; pass < LATENCY_PASSES; pass++) {
+		if (test_rt_min > 1024)
+			test_rt_min = 0;
+		test_rt_min++;
+
+		skel->bss->nr_req = 0;
+		skel->bss->nr_eff = 0;
+		skel->bss->expected_uclamp_min = test_rt_min;
+		skel->bss->write_ts = now_ns();
+		/* Publish the new generation last, the probes key off it */
+		__atomic_store_n(&skel->bss->gen, skel->bss->gen + 1, __ATOMIC_RELEASE);
+
+		t0 = now_ns();
+		write_rt_min(test_rt_min);
+		samples_add(write_lat, now_ns() - t0);
+
+		if (kill(-child_pgid, SIGUSR1)) {
+			perror("Failed to wake up the children");
+			return -1;
+		}
+
+		t0 = now_ns();
+		while (__atomic_load_n(&skel->bss->nr_eff, __ATOMIC_RELAXED) < count) {
+			if (now_ns() - t0 > LATENCY_TIMEOUT_NS) {
+				printf("Only %llu of %d tasks picked up uclamp_min %d\n",
+				       skel->bss->nr_eff, count, test_rt_min);
+				return -1;
+			}
+			usleep(LATENCY_POLL_US);
+		}
+	}
+
+	return 0;
+}
+
+static void child_wakeup(int sig)
+{
+}
+
+static void run_latency(void)
+{
+	void *(*fork_fn)(void *) = storm ? storm_fork_loop : fork_loop;
+	unsigned long long nr_req = 0, nr_eff = 0;
+	struct sigaction sa = { .sa_handler = child_wakeup };
+	struct samples write_lat;
+	pthread_t fork_thread;
+	int count, ret, i;
+
+	/* Inherited by the children, SIGUSR1 only interrupts their pause() */
+	if (sigaction(SIGUSR1, &sa, NULL)) {
+		perror("Failed to set SIGUSR1 handler");
+		return;
+	}
+
+	child_pgid = fork();
+	if (!child_pgid) {
+		setpgid(0, 0);
+		for (;;)
+			pause();
+	}
+	if (child_pgid == -1) {
+		perror("Failed to create the children's process group leader");
+		child_pgid = 0;
+		return;
+	}
+	setpgid(child_pgid, child_pgid);
+
+	if (samples_init(&write_lat, LATENCY_PASSES)) {
+		perror("Failed to allocate write latency samples");
+		return;
+	}
+
+	for (count = LATENCY_MIN_TASKS; ; count *= 10) {
+		if (count > nr_tasks)
+			count = nr_tasks;
+
+		/* Grow the number of children from where the last step left it */
+		nr_forks = count - nr_pids;
+		ret = pthread_create(&fork_thread, NULL, fork_fn, NULL);
+		if (ret) {
+			perror("Failed to create fork thread");
+			break;
+		}
+		pthread_join(fork_thread, NULL);
+
+		if (nr_pids < count) {
+			printf("Only forked %d of %d tasks\n", nr_pids, count);
+			break;
+		}
+
+		write_lat.len = write_lat.sum = write_lat.max = 0;
+		ret = measure_propagation(count, &write_lat);
+
+		for (i = 0, nr_req = 0, nr_eff = 0; i < LAT_HIST_SLOTS; i++) {
+			nr_req += skel->bss->req_hist[i];
+			nr_eff += skel->bss->eff_hist[i];
+		}
+
+		samples_sort(&write_lat);
+		printf("%d RT tasks, %d writes:\n", count, LATENCY_PASSES);
+		printf("  sysctl write: p50: %llu us max: %llu us\n",
+		       samples_percentile(&write_lat, 50) / 1000, write_lat.max / 1000);
+		if (skel->links.kprobe_uclamp_update_util_min_rt_default)
+			print_lat_hist("uclamp_min request updated", skel->bss->req_hist, nr_req);
+		print_lat_hist("first enqueue with new uclamp_min", skel->bss->eff_hist, nr_eff);
+		fflush(stdout);
+
+		if (ret || count == nr_tasks)
+			break;
+	}
+
+	/* Stop accounting */
+	__atomic_store_n(&skel->bss->gen, 0, __ATOMIC_RELEASE);
+	samples_free(&write_lat);
+}
+
+struct sweep_thread {
+	pthread_t thread;
+	enum uclamp_sysctl knob;
+	unsigned long long rejected;
+	struct samples lat;
+};
+
+static void *sweep_loop(void *data)
+{
+	struct sweep_thread *st = data;
+	unsigned long long t0;
+	int i, value;
+
+	for (i = 0; i < SWEEP_WRITES; i++) {
+		/* Keep min <= max so that concurrent writers never conflict */
+		switch (st->knob) {
+		case UCLAMP_SYSCTL_MIN:
+			value = i % 513;
+			break;
+		case UCLAMP_SYSCTL_MAX:
+			value = 512 + i % 513;
+			break;
+		default:
+			value = i % 1025;
+			break;
+		}
+
+		t0 = now_ns();
+		if (uclamp_sysctl_write(&sysctls, st->knob, value)) {
+			st->rejected++;
+			continue;
+		}
+		samples_add(&st->lat, now_ns() - t0);
+	}
+
+	return NULL;
+}
+
+/*
+ * Hammer all the global uclamp knobs from nr_fork_threads threads, each one
+ * writing to a single knob, while the children exist so that the
+ * sched_util_clamp_min_rt_default writes have all of them to walk.
+ */
+static void run_sweep(void)
+{
+	struct samples lat[NR_UCLAMP_SYSCTLS] = {};
+	unsigned long long rejected[NR_UCLAMP_SYSCTLS] = {};
+	unsigned long long t0, elapsed;
+	struct sweep_thread *threads;
+	pthread_t fork_thread;
+	int i, ret;
+
+	ret = pthread_create(&fork_thread, NULL, storm ? storm_fork_loop : fork_loop, NULL);
+	if (ret) {
+		perror("Failed to create fork thread");
+		return;
+	}
+	pthread_join(fork_thread, NULL);
+
+	threads = calloc(nr_fork_threads, sizeof(*threads));
+	if (!threads) {
+		perror("Failed to allocate sweep threads");
+		return;
+	}
+
+	for (i = 0; i < NR_UCLAMP_SYSCTLS; i++) {
+		/* Threads i, i + NR_UCLAMP_SYSCTLS, ... write to knob i */
+		int nr = (nr_fork_threads + NR_UCLAMP_SYSCTLS - 1 - i) / NR_UCLAMP_SYSCTLS;
+
+		if (nr && samples_init(&lat[i], SWEEP_WRITES * nr)) {
+			perror("Failed to allocate sweep latency samples");
+			goto out;
+		}
+	}
+
+	uclamp_sysctl_write(&sysctls, UCLAMP_SYSCTL_MAX, 1024);
+
+	t0 = now_ns();
+
+	for (i = 0; i < nr_fork_threads; i++) {
+		threads[i].knob = i % NR_UCLAMP_SYSCTLS;
+		if (samples_init(&threads[i].lat, SWEEP_WRITES)) {
+			perror("Failed to allocate sweep latency samples");
+			break;
+		}
+		ret = pthread_create(&threads[i].thread, NULL, sweep_loop, &threads[i]);
+		if (ret) {
+			perror("Failed to create sweep thread");
+			samples_free(&threads[i].lat);
+			break;
+		}
+	}
+	nr_fork_threads = i;
+
+	for (i = 0; i < nr_fork_threads; i++) {
+		enum uclamp_sysctl knob = threads[i].knob;
+
+		pthread_join(threads[i].thread, NULL);
+		samples_merge(&lat[knob], &threads[i].lat);
+		rejected[knob] += threads[i].rejected;
+		samples_free(&threads[i].lat);
+	}
+
+	elapsed = now_ns() - t0;
+
+	printf("Swept uclamp sysctls from %d threads with %d RT tasks in %.3f s\n",
+	       nr_fork_threads, nr_pids, elapsed / 1e9);
+
+	for (i = 0; i < NR_UCLAMP_SYSCTLS; i++) {
+		if (!samples_count(&lat[i]) && !rejected[i])
+			continue;
+
+		samples_sort(&lat[i]);
+		printf("  %-32s %llu writes (%llu rejected) %.0f writes/s p50: %llu us p99: %llu us max: %llu us\n",
+		       uclamp_sysctl_names[i], samples_count(&lat[i]), rejected[i],
+		       samples_count(&lat[i]) * 1e9 / elapsed,
+		       samples_percentile(&lat[i], 50) / 1000,
+		       samples_percentile(&lat[i], 99) / 1000,
+		       lat[i].max / 1000);
+	}
+
+out:
+	for (i = 0; i < NR_UCLAMP_SYSCTLS; i++)
+		samples_free(&lat[i]);
+	free(threads);
+}
+
+static const struct option long_options[] = {
+	{ "storm",	no_argument,		0, 's' },
+	{ "threads",	required_argument,	0, 't' },
+	{ "tasks",	required_argument,	0, 'n' },
+	{ "getattr",	no_argument,		0, 'g' },
+	{ "latency",	no_argument,		0, 'l' },
+	{ "sweep",	no_argument,		0, 'w' },
+	{ "help",	no_argument,		0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS]\n", prog);
+	fprintf(stderr, "  -s, --storm\t\tFork from several pinned threads without sleeping\n");
+	fprintf(stderr, "  -t, --threads M\tNumber of forking threads in storm mode or writers in sweep mode (default: online cpus)\n");
+	fprintf(stderr, "  -n, --tasks N\t\tTotal number of RT tasks to fork (default: %d)\n", NR_FORKS);
+	fprintf(stderr, "  -g, --getattr\t\tVerify with sched_getattr() instead of a BPF task iterator\n");
+	fprintf(stderr, "  -l, --latency\t\tMeasure how long a new default takes to reach %d, %d, ... up to N RT tasks\n",
+		LATENCY_MIN_TASKS, LATENCY_MIN_TASKS * 10);
+	fprintf(stderr, "  -w, --sweep\t\tTime concurrent writes to all the uclamp sysctls with N RT tasks\n");
+	fprintf(stderr, "  -h, --help\t\tShow this help\n");
+}
+
 int main(int argc, char **argv)
 {
 	pthread_t fork_thread, test_thread;
-	int ret, i;
+	int ret, i, opt;
+
+	nr_fork_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt_long(argc, argv, "st:n:glwh", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			storm = true;
+			break;
+		case 't':
+			nr_fork_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_tasks = atoi(optarg);
+			break;
+		case 'g':
+			force_getattr = true;
+			break;
+		case 'l':
+			latency = true;
+			break;
+		case 'w':
+			sweep = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (nr_tasks <= 0 || nr_fork_threads <= 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
 
-	ret = pthread_create(&fork_thread, NULL, fork_loop, NULL);
+	nr_forks = nr_tasks;
+	pids = calloc(nr_tasks, sizeof(pid_t));
+	if (!pids) {
+		perror("Failed to allocate pids");
+		return EXIT_FAILURE;
+	}
+
+	/* Restored on exit */
+	ret = uclamp_sysctl_open(&sysctls);
+	if (ret) {
+		free(pids);
+		return EXIT_FAILURE;
+	}
+
+	ret = skel_init();
+	if (ret) {
+		uclamp_sysctl_close(&sysctls);
+		free(pids);
+		return EXIT_FAILURE;
+	}
+
+	if (latency) {
+		run_latency();
+		goto kill;
+	}
+
+	if (sweep) {
+		run_sweep();
+		goto kill;
+	}
+
+	ret = pthread_create(&fork_thread, NULL, storm ? storm_fork_loop : fork_loop, NULL);
 	if (ret) {
 		perror("Failed to create fork thread");
 		return EXIT_FAILURE;
@@ -205,8 +880,8 @@ int main(int argc, char **argv)
 	pthread_join(fork_thread, NULL);
 	pthread_join(test_thread, NULL);
 
-
-	for (i = 0; i < NR_FORKS; i++) {
+kill:
+	for (i = 0; i < nr_tasks; i++) {
 
 		if (!pids[i])
 			continue;
@@ -222,5 +897,11 @@ int main(int argc, char **argv)
 		kill(pids[i], SIGKILL);
 	}
 
+	if (child_pgid > 0)
+		kill(child_pgid, SIGKILL);
+
+	uclamp_sysctl_close(&sysctls);
+	uclamp_test_rt_default_bpf__destroy(skel);
+	free(pids);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#ifndef __UCLAMP_TEST_RT_DEFAULT_H__
+#define __UCLAMP_TEST_RT_DEFAULT_H__
+
+/* log2 slots of the propagation latency in ns */
+#define LAT_HIST_SLOTS	40
+
+/*
+ * Written by the verify_uclamp_min task iterator for every child that doesn't
+ * have the expected uclamp_min.
+ */
+struct uclamp_mismatch {
+	int pid;
+	unsigned int uclamp_min;
+	unsigned int effective_uclamp_min;
+	unsigned int user_defined;
+};
+
+#endif /* __UCLAMP_TEST_RT_DEFAULT_H__ */
@@ -0,0 +1,377 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#include "sched.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/*
+ * How fast uclamp can be changed with sched_setattr().
+ *
+ * K setter threads each change the uclamp of one task in a loop, as fast as
+ * they can and with nothing else on the path: the attr is built once, there
+ * is no sched_getattr(), no sleeping and nothing is printed until the end.
+ * uclamp_min alternates between two buckets so that every call moves the task
+ * from one to the other if it's enqueued.
+ *
+ * The task is either the setter itself, a task spinning on its CPU or one
+ * that sleeps. Every call takes the rq lock of the task's CPU. Spread, every
+ * task has a runqueue of its own. Shared, the tasks are all on one runqueue
+ * and the setters run on the other CPUs, contending on its lock. Setters on
+ * the shared CPU would only take turns on it, so there's no shared case for
+ * self, nor any on a single CPU.
+ */
+#define MAX_THREADS		256
+#define DEFAULT_DURATION_MS	1000
+
+/* Both in different buckets whatever the number of buckets */
+#define UCLAMP_LOW		0
+#define UCLAMP_HIGH		1024
+
+enum target {
+	TARGET_SELF,
+	TARGET_RUNNING,
+	TARGET_SLEEPING,
+	NR_TARGETS,
+};
+
+static const char * const target_names[NR_TARGETS] = {
+	[TARGET_SELF]		= "self",
+	[TARGET_RUNNING]	= "running",
+	[TARGET_SLEEPING]	= "sleeping",
+};
+
+enum rq_placement {
+	RQ_SHARED,
+	RQ_SPREAD,
+	NR_RQ_PLACEMENTS,
+};
+
+static const char * const rq_placement_names[NR_RQ_PLACEMENTS] = {
+	[RQ_SHARED]	= "shared",
+	[RQ_SPREAD]	= "spread",
+};
+
+struct setter {
+	pthread_t thread;
+	pthread_t target_thread;
+	pid_t target_tid;
+	int cpu;
+	int target_cpu;
+	unsigned long long calls;
+	unsigned long long errors;
+	int error;
+	struct loglin_hist lat;
+	bool volatile ready;
+};
+
+static int cpus[CPU_SETSIZE];
+static int nr_cpus;
+
+static enum target target;
+static enum rq_placement placement;
+
+static bool volatile go = false;
+static bool volatile stop = false;
+
+static int pin(int cpu)
+{
+	cpu_set_t cpuset;
+	int ret;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	ret = sched_setaffinity(0, sizeof(cpuset), &cpuset);
+	if (ret)
+		perror("Failed to set affinity");
+
+	return ret;
+}
+
+static int target_cpu(int i)
+{
+	return placement == RQ_SHARED ? cpus[0] : cpus[(i + 1) % nr_cpus];
+}
+
+static int setter_cpu(int i)
+{
+	if (target == TARGET_SELF)
+		return target_cpu(i);
+	if (placement == RQ_SHARED)
+		return cpus[1 + i % (nr_cpus - 1)];
+	return cpus[i % nr_cpus];
+}
+
+/* The setters of a shared runqueue must all be remote to contend on it */
+static bool case_valid(void)
+{
+	return placement != RQ_SHARED || (target != TARGET_SELF && nr_cpus > 1);
+}
+
+static void *target_fn(void *data)
+{
+	struct setter *s = data;
+
+	s->target_tid = gettid();
+	pin(s->target_cpu);
+
+	while (!stop) {
+		if (target == TARGET_SLEEPING)
+			usleep(10000);
+	}
+
+	return NULL;
+}
+
+static void *setter_fn(void *data)
+{
+	struct setter *s = data;
+	struct sched_attr attr;
+	unsigned long long t0;
+	pid_t pid;
+	int ret;
+
+	pin(s->cpu);
+
+	pid = target == TARGET_SELF ? 0 : s->target_tid;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_flags = SCHED_FLAG_KEEP_ALL | SCHED_FLAG_UTIL_CLAMP;
+	attr.sched_util_max = UCLAMP_HIGH;
+
+	s->ready = true;
+	while (!go)
+		;
+
+	while (!stop) {
+		attr.sched_util_min = s->calls & 1 ? UCLAMP_HIGH : UCLAMP_LOW;
+
+		t0 = now_ns();
+		ret = sched_setattr(pid, &attr, 0);
+		loglin_hist_add(&s->lat, now_ns() - t0);
+
+		s->calls++;
+		if (ret) {
+			s->errors++;
+			s->error = errno;
+		}
+	}
+
+	return NULL;
+}
+
+/* One target and rq placement, with nr setters for duration_ms */
+static int run(struct setter *setters, int nr, unsigned long long duration_ms)
+{
+	int i, nr_targets = 0, nr_setters = 0, ret = 0;
+	unsigned long long errors = 0, start, elapsed = 0;
+	struct loglin_hist lat;
+	int error = 0;
+
+	memset(setters, 0, nr * sizeof(*setters));
+	go = false;
+	stop = false;
+
+	for (i = 0; i < nr; i++) {
+		setters[i].cpu = setter_cpu(i);
+		setters[i].target_cpu = target_cpu(i);
+	}
+
+	if (target != TARGET_SELF) {
+		for (; nr_targets < nr; nr_targets++) {
+			ret = pthread_create(&setters[nr_targets].target_thread, NULL,
+					     target_fn, &setters[nr_targets]);
+			if (ret) {
+				perror("Failed to create target thread");
+				goto out;
+			}
+		}
+
+		/* The setters need the TIDs */
+		for (i = 0; i < nr; i++) {
+			while (!setters[i].target_tid)
+				usleep(1000);
+		}
+	}
+
+	for (; nr_setters < nr; nr_setters++) {
+		ret = pthread_create(&setters[nr_setters].thread, NULL,
+				     setter_fn, &setters[nr_setters]);
+		if (ret) {
+			perror("Failed to create setter thread");
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		while (!setters[i].ready)
+			usleep(1000);
+	}
+
+	start = now_ns();
+	go = true;
+	usleep(duration_ms * 1000);
+	stop = true;
+	elapsed = now_ns() - start;
+
+out:
+	go = true;
+	stop = true;
+	for (i = 0; i < nr_setters; i++)
+		pthread_join(setters[i].thread, NULL);
+	for (i = 0; i < nr_targets; i++)
+		pthread_join(setters[i].target_thread, NULL);
+
+	if (ret)
+		return -1;
+
+	memset(&lat, 0, sizeof(lat));
+	for (i = 0; i < nr; i++) {
+		loglin_hist_merge(&lat, &setters[i].lat);
+		errors += setters[i].errors;
+		if (setters[i].error)
+			error = setters[i].error;
+	}
+
+	fprintf(stdout, "%-8s %-6s %7d %12llu %12.0f %8llu %8llu %8llu %8llu %8llu %9llu %8llu\n",
+		target_names[target], rq_placement_names[placement], nr, lat.count,
+		lat.count * 1e9 / elapsed, loglin_hist_mean(&lat),
+		loglin_hist_quantile(&lat, 50), loglin_hist_quantile(&lat, 90),
+		loglin_hist_quantile(&lat, 99), loglin_hist_quantile(&lat, 99.9),
+		lat.max, errors);
+	if (errors)
+		fprintf(stderr, "sched_setattr() failed: %s\n", strerror(error));
+
+	return ret;
+}
+
+static int parse_choice(const char *str, const char * const *names, int nr)
+{
+	int i;
+
+	if (!strcmp(str, "all"))
+		return nr;
+
+	for (i = 0; i < nr; i++) {
+		if (!strcmp(str, names[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS]\n", prog);
+	fprintf(stderr, "  -n, --threads K\t\tNumber of setter threads (default: online cpus)\n");
+	fprintf(stderr, "  -d, --duration MS\t\tHow long to run every case (default: %d)\n",
+		DEFAULT_DURATION_MS);
+	fprintf(stderr, "  -t, --target self|running|sleeping|all\tTask whose uclamp is changed (default: all)\n");
+	fprintf(stderr, "  -r, --rq shared|spread|all\tAll the tasks on one runqueue or spread (default: all)\n");
+	fprintf(stderr, "  -h, --help\t\t\tShow this help\n");
+}
+
+static const struct option long_options[] = {
+	{ "threads",	required_argument,	0, 'n' },
+	{ "duration",	required_argument,	0, 'd' },
+	{ "target",	required_argument,	0, 't' },
+	{ "rq",		required_argument,	0, 'r' },
+	{ "help",	no_argument,		0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	unsigned long long duration_ms = DEFAULT_DURATION_MS;
+	int only_target = NR_TARGETS, only_placement = NR_RQ_PLACEMENTS;
+	struct setter *setters;
+	cpu_set_t cpuset;
+	int nr, opt, cpu, ret = 0;
+
+	CPU_ZERO(&cpuset);
+	if (sched_getaffinity(0, sizeof(cpuset), &cpuset)) {
+		perror("Failed to get affinity");
+		return EXIT_FAILURE;
+	}
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &cpuset))
+			cpus[nr_cpus++] = cpu;
+	}
+	nr = nr_cpus;
+
+	while ((opt = getopt_long(argc, argv, "n:d:t:r:h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			nr = atoi(optarg);
+			break;
+		case 'd':
+			duration_ms = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			only_target = parse_choice(optarg, target_names, NR_TARGETS);
+			break;
+		case 'r':
+			only_placement = parse_choice(optarg, rq_placement_names, NR_RQ_PLACEMENTS);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (nr < 1 || nr > MAX_THREADS) {
+		fprintf(stderr, "--threads must be between 1 and %d\n", MAX_THREADS);
+		return EXIT_FAILURE;
+	}
+
+	if (only_target < 0 || only_placement < 0 || !duration_ms) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	setters = calloc(nr, sizeof(*setters));
+	if (!setters) {
+		perror("Failed to allocate setters");
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stdout, "%d setters, %d cpus, %llu ms per case, latencies in ns\n",
+		nr, nr_cpus, duration_ms);
+	fprintf(stdout, "%-8s %-6s %7s %12s %12s %8s %8s %8s %8s %8s %9s %8s\n",
+		"target", "rq", "setters", "calls", "calls/s", "mean", "p50", "p90",
+		"p99", "p99.9", "max", "errors");
+
+	for (target = 0; !ret && target < NR_TARGETS; target++) {
+		if (only_target != NR_TARGETS && target != only_target)
+			continue;
+
+		for (placement = 0; !ret && placement < NR_RQ_PLACEMENTS; placement++) {
+			if (only_placement != NR_RQ_PLACEMENTS && placement != only_placement)
+				continue;
+			if (!case_valid()) {
+				fprintf(stderr, "Skipping %s %s, the setters would share the CPU of the runqueue\n",
+					target_names[target], rq_placement_names[placement]);
+				continue;
+			}
+
+			ret = run(setters, nr, duration_ms);
+		}
+	}
+
+	free(setters);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
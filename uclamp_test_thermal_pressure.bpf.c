@@ -15,25 +15,133 @@ char LICENSE[] SEC("license") = "GPL";
 #define ENQUEUE_WAKEUP  0x01
 
 #define PELT_TYPE_LEN	4
-#define RB_SIZE		(256 * 1024)
 
-/* Global public variables shared with userspace*/
-pid_t pid = 0;
+#define MAX_TRACKED_TASKS	4096
 
-/* Global private variables */
-struct task_struct *task = NULL;
-struct rq *etf_rq = NULL;
-struct task_struct *etf_p = NULL;
+/* Global public variables shared with userspace*/
+bool aggregate = false;
+bool wakeup_records = false;
+/*
+ * Wake the consumer up only once a ring buffer holds that many bytes, 0 wakes
+ * it up on every event. Userspace polls the ring buffers for what is left
+ * below the threshold.
+ */
+unsigned long rb_wakeup_bytes = 0;
+
+/*
+ * State passed from the kprobes to their kretprobes. Both enqueue_task_fair
+ * and select_task_rq_fair run with irqs disabled, so keeping it per-CPU is
+ * enough to pair them up.
+ *
+ * A kretprobe can be missed though, and the next return on this CPU may be
+ * of a call we didn't record. The entries keep the pid_tgid of the task
+ * making the call, the returns drop them and only use them if it's the same.
+ */
+struct probe_ctx {
+	struct rq *etf_rq;
+	struct task_struct *etf_p;
+	u64 etf_caller;
+	struct task_struct *strqf_p;
+	int strqf_prev_cpu;
+	u64 strqf_caller;
+};
+
+/*
+ * compute_energy() is called once without the task for every perf domain
+ * (dst_cpu == -1) before its candidates, base_energy holds the last one.
+ */
+struct compute_energy_ctx {
+	unsigned long long base_energy;
+	struct compute_energy_wire wire;
+};
 
 
 /* Maps */
+/* TIDs we trace, populated by userspace */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TRACKED_TASKS);
+	__type(key, pid_t);
+	__type(value, u8);
+} tracked_tasks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct probe_ctx);
+} probe_ctx_map SEC(".maps");
+
+/*
+ * compute_energy candidates of the select_task_rq_fair() call running on this
+ * CPU, emitted at once when it returns.
+ */
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__uint(max_entries, 1);
-	__type(key, int);
-	__type(value, struct compute_energy_event);
+	__type(key, u32);
+	__type(value, struct compute_energy_ctx);
 } compute_energy_map SEC(".maps");
 
+/*
+ * Sized by userspace to nr_cpus * UCLAMP_BUCKETS^2 in aggregation mode. Keyed
+ * by rq cpu, which isn't always the CPU doing the enqueue, so it's shared and
+ * updated atomically. Cumulative, userspace reports the difference at every
+ * phase end.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct rq_pelt_hist);
+} rq_pelt_hist_map SEC(".maps");
+
+/*
+ * Wakeup being built for each tracked task in wakeup_records mode, emitted
+ * as a whole on wakeup_rb once the task is enqueued.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TRACKED_TASKS);
+	__type(key, pid_t);
+	__type(value, struct wakeup_event);
+} wakeup_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, NR_RBS);
+	__type(key, u32);
+	__type(value, u64);
+} rb_drops SEC(".maps");
+
+/* Timestamp base of every ring buffer on this CPU, see struct ts_base_wire */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, NR_RBS);
+	__type(key, u32);
+	__type(value, u64);
+} ts_base_map SEC(".maps");
+
+static const struct wakeup_event zero_wakeup = { .strqf_cpu = -1, .strqf_prev_cpu = -1 };
+
+/* Wakeup timestamp of every traced task that is waiting to run */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TRACKED_TASKS);
+	__type(key, pid_t);
+	__type(value, u64);
+} wakeup_ts_map SEC(".maps");
+
+/* Cumulative, userspace reports the difference at every phase end */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, RUN_LAT_MAX_KEYS);
+	__type(key, struct run_lat_key);
+	__type(value, struct run_lat_hist);
+} run_lat_map SEC(".maps");
+
+static const struct run_lat_hist zero_run_lat;
+
 /* Ring Buffers */
 struct {
 	__uint(type, BPF_MAP_TYPE_RINGBUF);
@@ -50,6 +158,167 @@ struct {
 	__uint(max_entries, RB_SIZE);
 } compute_energy_rb SEC(".maps");
 
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, RB_SIZE);
+} wakeup_rb SEC(".maps");
+
+
+static __always_inline void *rb_reserve(void *rb, u32 id, u64 size)
+{
+	void *e = bpf_ringbuf_reserve(rb, size, 0);
+	u64 *drops;
+
+	if (!e) {
+		drops = bpf_map_lookup_elem(&rb_drops, &id);
+		if (drops)
+			(*drops)++;
+	}
+
+	return e;
+}
+
+static __always_inline void rb_submit(void *rb, void *e)
+{
+	u64 flags = 0;
+
+	if (rb_wakeup_bytes)
+		flags = bpf_ringbuf_query(rb, BPF_RB_AVAIL_DATA) >= rb_wakeup_bytes ?
+			BPF_RB_FORCE_WAKEUP : BPF_RB_NO_WAKEUP;
+
+	bpf_ringbuf_submit(e, flags);
+}
+
+/*
+ * Return in delta how far now is from the ts base of this CPU on rb, emitting
+ * a new base first if there's none yet or the delta would overflow. All the
+ * hooks run with irqs disabled, nothing can emit on the same CPU in between.
+ *
+ * Returns false if the base couldn't be emitted, the event must be dropped.
+ */
+static __always_inline bool wire_ts_delta(void *rb, u32 id, u64 now, u32 *delta)
+{
+	struct ts_base_wire *b;
+	u64 *base;
+
+	base = bpf_map_lookup_elem(&ts_base_map, &id);
+	if (!base)
+		return false;
+
+	if (!*base || now - *base > 0xFFFFFFFFULL) {
+		b = rb_reserve(rb, id, sizeof(*b));
+		if (!b)
+			return false;
+		b->ts = now;
+		b->src_cpu = bpf_get_smp_processor_id();
+		b->version = WIRE_VERSION;
+		rb_submit(rb, b);
+		*base = now;
+	}
+
+	*delta = now - *base;
+	return true;
+}
+
+static __always_inline void wire_hdr_init(struct wire_hdr *hdr, u32 delta, int cpu)
+{
+	hdr->ts_delta = delta;
+	hdr->src_cpu = bpf_get_smp_processor_id();
+	hdr->cpu = cpu;
+}
+
+static __always_inline u32 log2_u32(u32 v)
+{
+	u32 shift, r;
+
+	r = (v > 0xFFFF) << 4; v >>= r;
+	shift = (v > 0xFF) << 3; v >>= shift; r |= shift;
+	shift = (v > 0xF) << 2; v >>= shift; r |= shift;
+	shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+	r |= (v >> 1);
+
+	return r;
+}
+
+static __always_inline u32 log2_u64(u64 v)
+{
+	u32 hi = v >> 32;
+
+	return hi ? log2_u32(hi) + 32 : log2_u32(v);
+}
+
+static __always_inline u32 hist_log2_slot(unsigned long value)
+{
+	u32 slot = value ? log2_u32(value) + 1 : 0;
+
+	return slot < PELT_HIST_LOG2_SLOTS ? slot : PELT_HIST_LOG2_SLOTS - 1;
+}
+
+static __always_inline u32 hist_linear_slot(unsigned long value)
+{
+	u32 slot = value / PELT_HIST_LINEAR_WIDTH;
+
+	return slot < PELT_HIST_LINEAR_SLOTS ? slot : PELT_HIST_LINEAR_SLOTS - 1;
+}
+
+/*
+ * Mirror of the checks userspace does on every rq_pelt_event, so that the
+ * aggregated mode can give the same pass/fail summary.
+ */
+static __always_inline void account_rq_pelt_hist(int cpu,
+						 unsigned long rq_util_avg,
+						 unsigned long p_util_avg,
+						 unsigned long thermal_avg,
+						 unsigned long capacity_orig,
+						 unsigned long uclamp_min,
+						 unsigned long uclamp_max,
+						 int overutilized, int misfit)
+{
+	unsigned long capacity_thermal = capacity_orig - thermal_avg;
+	u32 key = rq_pelt_hist_key(cpu, uclamp_min, uclamp_max);
+	struct rq_pelt_hist *h;
+
+	h = bpf_map_lookup_elem(&rq_pelt_hist_map, &key);
+	if (!h)
+		return;
+
+	__sync_fetch_and_add(&h->count, 1);
+	__sync_fetch_and_add(&h->rq_util_avg[hist_log2_slot(rq_util_avg)], 1);
+	__sync_fetch_and_add(&h->p_util_avg[hist_log2_slot(p_util_avg)], 1);
+	__sync_fetch_and_add(&h->thermal_avg[hist_linear_slot(thermal_avg)], 1);
+	h->capacity_orig = capacity_orig;
+	/* Racy, but it can only miss a max that's raced with a higher one */
+	if (thermal_avg > h->thermal_max)
+		h->thermal_max = thermal_avg;
+	if (overutilized)
+		__sync_fetch_and_add(&h->overutilized, 1);
+	if (misfit)
+		__sync_fetch_and_add(&h->misfit, 1);
+
+	if (uclamp_min > capacity_orig)
+		__sync_fetch_and_add(&h->uclamp_min_gt_cap, 1);
+	if (thermal_avg && capacity_orig != 1024 && uclamp_min > capacity_thermal)
+		__sync_fetch_and_add(&h->uclamp_min_gt_cap_thermal, 1);
+	if ((uclamp_max > capacity_orig || uclamp_max == 1024) &&
+	    p_util_avg * 5 > capacity_orig * 4 && overutilized != SG_OVERUTILIZED)
+		__sync_fetch_and_add(&h->overutilized_not_set, 1);
+	if (uclamp_min > capacity_thermal && !misfit)
+		__sync_fetch_and_add(&h->misfit_not_set, 1);
+	if (p_util_avg < uclamp_min)
+		__sync_fetch_and_add(&h->p_util_lt_uclamp_min, 1);
+}
+
+static __always_inline bool is_tracked(pid_t tid)
+{
+	return bpf_map_lookup_elem(&tracked_tasks, &tid) != NULL;
+}
+
+static __always_inline struct probe_ctx *get_probe_ctx(void)
+{
+	u32 key = 0;
+
+	return bpf_map_lookup_elem(&probe_ctx_map, &key);
+}
 
 SEC("kprobe/enqueue_task_fair")
 int BPF_KPROBE(kprobe_enqueue_task_fair, struct rq *rq, struct task_struct *p,
@@ -59,72 +328,243 @@ int BPF_KPROBE(kprobe_enqueue_task_fair, struct rq *rq, struct task_struct *p,
 	if (!(flags & ENQUEUE_WAKEUP))
 		return 0;
 
-	pid_t ppid = BPF_CORE_READ(p, pid);
+	struct probe_ctx *pctx;
+	pid_t tid = BPF_CORE_READ(p, pid);
 
-	if (!pid || pid != ppid)
+	if (!is_tracked(tid))
 		return 0;
 
-	etf_rq = rq;
-	etf_p = p;
+	pctx = get_probe_ctx();
+	if (!pctx)
+		return 0;
+
+	pctx->etf_rq = rq;
+	pctx->etf_p = p;
+	pctx->etf_caller = bpf_get_current_pid_tgid();
 
 	return 0;
 }
 
-SEC("kretprobe/enqueue_task_fair")
-int BPF_KRETPROBE(kretprobe_enqueue_task_fair)
+static __always_inline struct wakeup_event *get_wakeup(pid_t tid)
 {
-	struct rq_pelt_event *e;
-	struct rq *rq = etf_rq;
-	struct task_struct *p = etf_p;
+	struct wakeup_event *w;
 
-	if (!rq || !p)
+	w = bpf_map_lookup_elem(&wakeup_map, &tid);
+	if (w)
+		return w;
+
+	bpf_map_update_elem(&wakeup_map, &tid, &zero_wakeup, BPF_NOEXIST);
+	return bpf_map_lookup_elem(&wakeup_map, &tid);
+}
+
+static __always_inline void read_rq_pelt(struct rq_pelt_event *e, struct rq *rq,
+					 struct task_struct *p)
+{
+	e->ts = bpf_ktime_get_ns();
+	e->cpu = BPF_CORE_READ(rq, cpu);
+	e->pid = BPF_CORE_READ(p, pid);
+	e->rq_util_avg = BPF_CORE_READ(rq, cfs.avg.util_avg);
+	e->p_util_avg = BPF_CORE_READ(p, se.avg.util_avg);
+	e->thermal_avg = BPF_CORE_READ(rq, avg_thermal.util_avg);
+	e->capacity_orig = BPF_CORE_READ(rq, cpu_capacity_orig);
+	e->uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MIN].value);
+	e->uclamp_max = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MAX].value);
+	e->overutilized = BPF_CORE_READ(rq, rd, overutilized) ? SG_OVERUTILIZED : 0;
+	e->misfit = !!BPF_CORE_READ(rq, misfit_task_load);
+}
+
+/*
+ * Emit the wakeup w of tid was building and start the next one.
+ */
+static __always_inline int emit_wakeup(struct wakeup_event *w)
+{
+	struct wakeup_event *e;
+
+	e = rb_reserve(&wakeup_rb, RB_WAKEUP, sizeof(*e));
+	if (e) {
+		__builtin_memcpy(e, w, sizeof(*e));
+		rb_submit(&wakeup_rb, e);
+	}
+
+	w->seq++;
+	w->strqf_ts = 0;
+	w->strqf_cpu = -1;
+	w->strqf_prev_cpu = -1;
+	w->nr_candidates = 0;
+
+	return 0;
+}
+
+/*
+ * Shared by the kretprobe and fexit backends, called once enqueue_task_fair()
+ * returned for a tracked task.
+ */
+static __always_inline int emit_rq_pelt(struct rq *rq, struct task_struct *p)
+{
+	struct rq_pelt_event ev;
+	struct rq_pelt_wire *e;
+	struct wakeup_event *w;
+	u32 delta;
+
+	if (aggregate) {
+		read_rq_pelt(&ev, rq, p);
+		account_rq_pelt_hist(ev.cpu, ev.rq_util_avg, ev.p_util_avg, ev.thermal_avg,
+				     ev.capacity_orig, ev.uclamp_min, ev.uclamp_max,
+				     ev.overutilized, ev.misfit);
 		return 0;
+	}
 
-	pid_t ppid = BPF_CORE_READ(p, pid);
+	if (wakeup_records) {
+		w = get_wakeup(BPF_CORE_READ(p, pid));
+		if (!w)
+			return 0;
 
-	if (!pid || pid != ppid)
+		read_rq_pelt(&w->enqueue, rq, p);
+		return emit_wakeup(w);
+	}
+
+	read_rq_pelt(&ev, rq, p);
+	if (!wire_ts_delta(&rq_pelt_rb, RB_RQ_PELT, ev.ts, &delta))
 		return 0;
 
-	etf_rq = NULL;
-	etf_p = NULL;
+	e = rb_reserve(&rq_pelt_rb, RB_RQ_PELT, sizeof(*e));
+	if (e) {
+		wire_hdr_init(&e->hdr, delta, ev.cpu);
+		e->pid = ev.pid;
+		e->rq_util_avg = ev.rq_util_avg;
+		e->p_util_avg = ev.p_util_avg;
+		e->capacity_orig = ev.capacity_orig;
+		e->thermal_avg = ev.thermal_avg;
+		e->uclamp_min = ev.uclamp_min;
+		e->uclamp_max = ev.uclamp_max;
+		e->flags = (ev.overutilized ? WIRE_OVERUTILIZED : 0) |
+			   (ev.misfit ? WIRE_MISFIT : 0);
+		rb_submit(&rq_pelt_rb, e);
+	}
+	return 0;
+}
 
-	int cpu = BPF_CORE_READ(rq, cpu);
+/*
+ * Emit the compute_energy candidates tid collected on this CPU along with the
+ * cpu select_task_rq_fair() picked.
+ */
+static __always_inline void emit_compute_energy(pid_t tid, int prev_cpu, int cpu, u64 now)
+{
+	struct compute_energy_wire *c, *e;
+	struct compute_energy_ctx *ctx;
+	u32 zero = 0, delta;
+
+	ctx = bpf_map_lookup_elem(&compute_energy_map, &zero);
+	if (!ctx)
+		return;
+
+	c = &ctx->wire;
+	if (c->pid != tid || !c->nr_candidates)
+		return;
+
+	c->prev_cpu = prev_cpu;
+
+	if (wire_ts_delta(&compute_energy_rb, RB_COMPUTE_ENERGY, now, &delta)) {
+		e = rb_reserve(&compute_energy_rb, RB_COMPUTE_ENERGY, sizeof(*e));
+		if (e) {
+			__builtin_memcpy(e, c, sizeof(*e));
+			wire_hdr_init(&e->hdr, delta, cpu);
+			rb_submit(&compute_energy_rb, e);
+		}
+	}
+
+	c->nr_candidates = 0;
+}
+
+/*
+ * Shared by the kretprobe and fexit backends, called once
+ * select_task_rq_fair() returned cpu for a tracked task that was on prev_cpu.
+ */
+static __always_inline int emit_select_task_rq_fair(struct task_struct *p, int prev_cpu,
+						    int cpu)
+{
+	struct select_task_rq_fair_wire *e;
+	u64 now = bpf_ktime_get_ns();
+	u32 delta;
+
+	pid_t tid = BPF_CORE_READ(p, pid);
+
+	if (wakeup_records) {
+		struct wakeup_event *w = get_wakeup(tid);
+
+		if (w) {
+			w->strqf_ts = now;
+			w->strqf_cpu = cpu;
+			w->strqf_prev_cpu = prev_cpu;
+		}
+		return 0;
+	}
 
-	unsigned long rq_util_avg = BPF_CORE_READ(rq, cfs.avg.util_avg);
 	unsigned long p_util_avg = BPF_CORE_READ(p, se.avg.util_avg);
-	unsigned long thermal_avg = BPF_CORE_READ(rq, avg_thermal.util_avg);
-	unsigned long capacity_orig = BPF_CORE_READ(rq, cpu_capacity_orig);
 	unsigned long uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MIN].value);
 	unsigned long uclamp_max = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MAX].value);
-	int overutilized = BPF_CORE_READ(rq, rd, overutilized);
-	int misfit = !!BPF_CORE_READ(rq, misfit_task_load);
 
-	e = bpf_ringbuf_reserve(&rq_pelt_rb, sizeof(*e), 0);
+	if (!wire_ts_delta(&select_task_rq_fair_rb, RB_SELECT_TASK_RQ_FAIR, now, &delta))
+		return 0;
+
+	e = rb_reserve(&select_task_rq_fair_rb, RB_SELECT_TASK_RQ_FAIR, sizeof(*e));
 	if (e) {
-		e->ts = bpf_ktime_get_ns();
-		e->cpu = cpu;
-		e->rq_util_avg = rq_util_avg;
+		wire_hdr_init(&e->hdr, delta, cpu);
+		e->pid = tid;
 		e->p_util_avg = p_util_avg;
-		e->thermal_avg = thermal_avg;
-		e->capacity_orig = capacity_orig;
 		e->uclamp_min = uclamp_min;
 		e->uclamp_max = uclamp_max;
-		e->overutilized = overutilized;
-		e->misfit = misfit;
-		bpf_ringbuf_submit(e, 0);
+		rb_submit(&select_task_rq_fair_rb, e);
 	}
+
+	emit_compute_energy(tid, prev_cpu, cpu, now);
 	return 0;
 }
 
+SEC("kretprobe/enqueue_task_fair")
+int BPF_KRETPROBE(kretprobe_enqueue_task_fair)
+{
+	struct probe_ctx *pctx = get_probe_ctx();
+	struct task_struct *p;
+	struct rq *rq;
+
+	if (!pctx)
+		return 0;
+
+	rq = pctx->etf_rq;
+	p = pctx->etf_p;
+	if (!rq || !p)
+		return 0;
+
+	/* Calls don't nest, the entry is either this call's or stale */
+	pctx->etf_rq = NULL;
+	pctx->etf_p = NULL;
+	if (pctx->etf_caller != bpf_get_current_pid_tgid())
+		return 0;
+
+	return emit_rq_pelt(rq, p);
+}
+
 SEC("kprobe/select_task_rq_fair")
-int BPF_KPROBE(kprobe_select_task_rq_fair, struct task_struct *p)
+int BPF_KPROBE(kprobe_select_task_rq_fair, struct task_struct *p, int prev_cpu)
 {
-	pid_t ppid = BPF_CORE_READ(p, pid);
+	struct probe_ctx *pctx;
+	pid_t tid = BPF_CORE_READ(p, pid);
 
-	if (!pid || pid != ppid)
+	if (!is_tracked(tid))
 		return 0;
 
-	task = p;
+	/* Only rq_pelt signals are aggregated, don't flood the ring buffers */
+	if (aggregate)
+		return 0;
+
+	pctx = get_probe_ctx();
+	if (!pctx)
+		return 0;
+
+	pctx->strqf_p = p;
+	pctx->strqf_prev_cpu = prev_cpu;
+	pctx->strqf_caller = bpf_get_current_pid_tgid();
 
 	return 0;
 }
@@ -133,62 +573,191 @@ SEC("kretprobe/select_task_rq_fair")
 int BPF_KRETPROBE(kretprobe_select_task_rq_fair)
 {
 	int cpu = PT_REGS_RC(ctx);
-	struct select_task_rq_fair_event *e;
-	struct task_struct *p = task;
+	struct probe_ctx *pctx = get_probe_ctx();
+	struct task_struct *p;
 
+	if (!pctx)
+		return 0;
+
+	p = pctx->strqf_p;
 	if (!p)
 		return 0;
 
-	pid_t ppid = BPF_CORE_READ(p, pid);
+	pctx->strqf_p = NULL;
+	if (pctx->strqf_caller != bpf_get_current_pid_tgid())
+		return 0;
+
+	return emit_select_task_rq_fair(p, pctx->strqf_prev_cpu, cpu);
+}
 
-	if (!pid || pid != ppid)
+/*
+ * fexit backend. The BPF trampoline gives us the arguments and the return
+ * value directly, so there's no need for a separate entry probe.
+ */
+SEC("fexit/enqueue_task_fair")
+int BPF_PROG(fexit_enqueue_task_fair, struct rq *rq, struct task_struct *p,
+	     int flags)
+{
+	/* We only cared about enqueues at wake up */
+	if (!(flags & ENQUEUE_WAKEUP))
 		return 0;
 
-	task = NULL;
+	if (!is_tracked(BPF_CORE_READ(p, pid)))
+		return 0;
 
-	unsigned long p_util_avg = BPF_CORE_READ(p, se.avg.util_avg);
-	unsigned long uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MIN].value);
-	unsigned long uclamp_max = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MAX].value);
+	return emit_rq_pelt(rq, p);
+}
 
-	e = bpf_ringbuf_reserve(&select_task_rq_fair_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_ns();
-		e->cpu = cpu;
-		e->p_util_avg = p_util_avg;
-		e->uclamp_min = uclamp_min;
-		e->uclamp_max = uclamp_max;
-		bpf_ringbuf_submit(e, 0);
-	}
-	return 0;
+/* Not loaded unless the kernel's prototype has these 3 arguments */
+SEC("fexit/select_task_rq_fair")
+int BPF_PROG(fexit_select_task_rq_fair, struct task_struct *p, int prev_cpu,
+	     int wake_flags, int cpu)
+{
+	if (!is_tracked(BPF_CORE_READ(p, pid)))
+		return 0;
+
+	/* Only rq_pelt signals are aggregated, don't flood the ring buffers */
+	if (aggregate)
+		return 0;
+
+	return emit_select_task_rq_fair(p, prev_cpu, cpu);
 }
 
 SEC("raw_tp/sched_compute_energy_tp")
 int BPF_PROG(handle_compute_energy, struct task_struct *p,
 	     int dst_cpu, unsigned long energy)
 {
-	struct compute_energy_event *e;
-	pid_t ppid = BPF_CORE_READ(p, pid);
+	struct compute_energy_wire *c;
+	struct compute_energy_ctx *ctx;
+	pid_t tid = BPF_CORE_READ(p, pid);
+	u32 zero = 0, nr;
 
-	if (dst_cpu == -1)
+	if (aggregate)
 		return 0;
 
-	if (!pid || pid != ppid)
+	if (!is_tracked(tid))
 		return 0;
 
-	unsigned long p_util_avg = BPF_CORE_READ(p, se.avg.util_avg);
-	unsigned long uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MIN].value);
-	unsigned long uclamp_max = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MAX].value);
+	ctx = bpf_map_lookup_elem(&compute_energy_map, &zero);
+	if (!ctx)
+		return 0;
 
-	e = bpf_ringbuf_reserve(&compute_energy_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_ns();
-		e->dst_cpu = dst_cpu;
-		e->p_util_avg = p_util_avg;
-		e->uclamp_min = uclamp_min;
-		e->uclamp_max = uclamp_max;
-		e->energy = energy;
-		bpf_ringbuf_submit(e, 0);
+	if (dst_cpu == -1) {
+		ctx->base_energy = energy;
+		return 0;
+	}
+
+	if (wakeup_records) {
+		struct wakeup_event *w = get_wakeup(tid);
+
+		if (!w)
+			return 0;
+
+		nr = w->nr_candidates;
+		if (nr < WAKEUP_MAX_CANDIDATES) {
+			w->candidates[nr].cpu = dst_cpu;
+			w->candidates[nr].energy = energy;
+			w->candidates[nr].base_energy = ctx->base_energy;
+		}
+		w->nr_candidates = nr + 1;
+		return 0;
+	}
+
+	/*
+	 * Candidates left behind by another task mean its select_task_rq_fair()
+	 * return was missed, start over.
+	 */
+	c = &ctx->wire;
+	if (c->pid != tid || !c->nr_candidates) {
+		c->pid = tid;
+		c->nr_candidates = 0;
+		c->p_util_avg = BPF_CORE_READ(p, se.avg.util_avg);
+		c->uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MIN].value);
+		c->uclamp_max = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MAX].value);
+	}
+
+	nr = c->nr_candidates;
+	if (nr < ENERGY_MAX_CANDIDATES) {
+		c->cpu[nr] = dst_cpu;
+		c->energy[nr] = energy;
+		c->base_energy[nr] = ctx->base_energy;
+	}
+	c->nr_candidates = nr + 1;
+
+	return 0;
+}
+
+/*
+ * Wakeup to running latency. sched_wakeup stamps the traced task, the
+ * sched_switch that puts it on a CPU accounts the delta.
+ */
+static __always_inline int stamp_wakeup(struct task_struct *p)
+{
+	pid_t tid = BPF_CORE_READ(p, pid);
+	u64 now;
+
+	if (!is_tracked(tid))
+		return 0;
+
+	/* Woken up while still running, it won't be switched in */
+	if (BPF_CORE_READ(p, on_cpu))
+		return 0;
+
+	now = bpf_ktime_get_ns();
+	bpf_map_update_elem(&wakeup_ts_map, &tid, &now, BPF_ANY);
+	return 0;
+}
+
+SEC("raw_tp/sched_wakeup")
+int BPF_PROG(handle_sched_wakeup, struct task_struct *p)
+{
+	return stamp_wakeup(p);
+}
+
+SEC("raw_tp/sched_wakeup_new")
+int BPF_PROG(handle_sched_wakeup_new, struct task_struct *p)
+{
+	return stamp_wakeup(p);
+}
+
+SEC("raw_tp/sched_switch")
+int BPF_PROG(handle_sched_switch, bool preempt, struct task_struct *prev,
+	     struct task_struct *next)
+{
+	pid_t tid = BPF_CORE_READ(next, pid);
+	struct run_lat_key key = {};
+	struct run_lat_hist *h;
+	u64 *ts, delta;
+	u32 slot;
+
+	ts = bpf_map_lookup_elem(&wakeup_ts_map, &tid);
+	if (!ts)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - *ts;
+	bpf_map_delete_elem(&wakeup_ts_map, &tid);
+
+	key.uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(next, uclamp[UCLAMP_MIN].value);
+	key.uclamp_max = BPF_CORE_READ_BITFIELD_PROBED(next, uclamp[UCLAMP_MAX].value);
+	key.cpu = bpf_get_smp_processor_id();
+
+	h = bpf_map_lookup_elem(&run_lat_map, &key);
+	if (!h) {
+		bpf_map_update_elem(&run_lat_map, &key, &zero_run_lat, BPF_NOEXIST);
+		h = bpf_map_lookup_elem(&run_lat_map, &key);
+		if (!h)
+			return 0;
 	}
 
+	slot = delta ? log2_u64(delta) + 1 : 0;
+	if (slot >= RUN_LAT_SLOTS)
+		slot = RUN_LAT_SLOTS - 1;
+
+	/* Only this CPU updates its keys */
+	h->count++;
+	h->slots[slot]++;
+	if (delta > h->max)
+		h->max = delta;
+
 	return 0;
 }
@@ -1,9 +1,13 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 /* Copyright (C) 2022 Qais Yousef */
-#include "events_defs.h"
 #include "sched.h"
+#include "events_defs.h"
+#include "perf_counters.h"
 
+#include <bpf/bpf.h>
+#include <bpf/btf.h>
 #include <bpf/libbpf.h>
+#include <getopt.h>
 #include <math.h>
 #include <pthread.h>
 #include <signal.h>
@@ -16,7 +20,13 @@
 #include <unistd.h>
 
 #include "uclamp_test_thermal_pressure.skel.h"
+#include "stats.h"
+#include "uclamp_cgroup.h"
+#include "uclamp_test_thermal_pressure_checks.h"
 #include "uclamp_test_thermal_pressure_events.h"
+#include "uclamp_test_thermal_pressure_model.h"
+#include "uclamp_test_thermal_pressure_trace.h"
+#include "workload.h"
 
 //#define DEBUG
 #ifdef DEBUG
@@ -31,88 +41,563 @@
 static bool volatile start = false;
 static bool volatile done = false;
 
-struct capacities {
-	unsigned long *cap;
-	unsigned int len;
-} capacities;
+struct capacities capacities;
 
 #define for_each_capacity(cap, i)	\
 	for ((i) = 0, (cap) = capacities.cap[(i)]; (i) < capacities.len; (i)+=1, (cap) = capacities.cap[(i)])
 
-#define PELT_CSV_FILE	"uclamp_test_thermal_pressure_pelt.csv"
-static int handle_rq_pelt_event(void *ctx, void *data, size_t data_sz)
+/*
+ * When set, events are appended in binary form to the trace instead of being
+ * formatted into the CSV files.
+ */
+static struct trace_writer *trace = NULL;
+
+/* Recording stops at the first failed write, the rest are only counted */
+static void record_event(enum trace_record_type type, const void *e, size_t len)
 {
-	struct rq_pelt_event *e = data;
-	static FILE *file = NULL;
-	static bool err_once = false;
-	unsigned long capacity_thermal, cap;
-	unsigned long smallest_uclamp_min_cap, smallest_uclamp_max_cap;
-	int i;
+	if (trace_write(trace, type, e, len) && trace->failed == 1)
+		fprintf(stderr, "Failed to record an event, recording stopped\n");
+}
 
-	capacity_thermal = e->capacity_orig - e->thermal_avg;
-	smallest_uclamp_min_cap = e->capacity_orig;
-	smallest_uclamp_max_cap = e->capacity_orig;
+/*
+ * Streaming per CPU stats of the rq_pelt signals and of the CPUs
+ * select_task_rq_fair picked. They are printed and reset at every phase end
+ * so memory stays bounded however long the run is.
+ */
+struct cpu_stream_stats {
+	struct util_hist rq_util_avg;
+	struct util_hist p_util_avg;
+	struct util_hist thermal_avg;
+	unsigned long long placements;
+};
 
-	if (!file) {
-		file = fopen(PELT_CSV_FILE, "w");
-		if (!file) {
-			if (!err_once) {
-				err_once = true;
-				fprintf(stderr, "Failed to create %s file\n", PELT_CSV_FILE);
-			}
-			return 0;
+static struct cpu_stream_stats *stream_stats;
+static int stream_nr_cpus;
+
+/*
+ * How often select_task_rq_fair picked the candidate with the lowest energy
+ * cost, and how far off it was when it didn't. compute_energy only reports
+ * the energy of the candidate's perf domain, so the cost compared is the
+ * delta against the base energy of that domain without the task.
+ *
+ * Wakeups that picked a CPU that wasn't evaluated are counted apart, and so
+ * are the ones that stayed on prev_cpu because the saving was within the
+ * margin find_energy_efficient_cpu() keeps it for: they aren't misses.
+ */
+struct energy_pick_stats {
+	unsigned long long wakeups;
+	unsigned long long lowest;
+	unsigned long long not_candidate;
+	unsigned long long prev_kept;
+	unsigned long long gap_sum;
+	unsigned long long gap_max;
+};
+
+static struct energy_pick_stats energy_picks;
+
+/*
+ * Placement model fed with every rq_pelt_event, it replaces the placement
+ * heuristics of check_rq_pelt_event(). Updated by the events thread, its
+ * verdicts are reported and reset with the streaming stats.
+ */
+static struct eas_model model;
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int stream_stats_init(void)
+{
+	stream_nr_cpus = libbpf_num_possible_cpus();
+	if (stream_nr_cpus <= 0) {
+		fprintf(stderr, "Failed to get the number of possible cpus\n");
+		return -1;
+	}
+
+	stream_stats = calloc(stream_nr_cpus, sizeof(*stream_stats));
+	if (!stream_stats) {
+		perror("Failed to allocate streaming stats");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void stream_account_rq_pelt(const struct rq_pelt_event *e)
+{
+	struct cpu_stream_stats *cs;
+
+	if (!stream_stats || e->cpu < 0 || e->cpu >= stream_nr_cpus)
+		return;
+
+	cs = &stream_stats[e->cpu];
+
+	pthread_mutex_lock(&stream_mutex);
+	util_hist_add(&cs->rq_util_avg, e->rq_util_avg);
+	util_hist_add(&cs->p_util_avg, e->p_util_avg);
+	util_hist_add(&cs->thermal_avg, e->thermal_avg);
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+static void stream_account_placement(int cpu)
+{
+	if (!stream_stats || cpu < 0 || cpu >= stream_nr_cpus)
+		return;
+
+	__atomic_add_fetch(&stream_stats[cpu].placements, 1, __ATOMIC_RELAXED);
+}
+
+/* prev_cpu only loses to a CPU saving more than 6% of its energy */
+static bool energy_within_margin(unsigned long long prev_delta, unsigned long long prev_base,
+				 unsigned long long best_delta)
+{
+	return prev_delta - best_delta <= (prev_delta + prev_base) >> 4;
+}
+
+static void stream_account_energy_pick(int picked, int prev_cpu, const int *cpu,
+				       const unsigned long long *energy,
+				       const unsigned long long *base, unsigned int nr)
+{
+	unsigned long long lowest = ULLONG_MAX, picked_delta = ULLONG_MAX, picked_base = 0;
+	unsigned long long delta;
+	unsigned int i;
+
+	if (!stream_stats || !nr)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		delta = energy[i] > base[i] ? energy[i] - base[i] : 0;
+		if (delta < lowest)
+			lowest = delta;
+		if (cpu[i] == picked && delta < picked_delta) {
+			picked_delta = delta;
+			picked_base = base[i];
+		}
+	}
+
+	pthread_mutex_lock(&stream_mutex);
+	energy_picks.wakeups++;
+	if (picked_delta == ULLONG_MAX) {
+		energy_picks.not_candidate++;
+	} else if (picked_delta == lowest) {
+		energy_picks.lowest++;
+	} else if (picked == prev_cpu && energy_within_margin(picked_delta, picked_base, lowest)) {
+		energy_picks.prev_kept++;
+	} else {
+		energy_picks.gap_sum += picked_delta - lowest;
+		if (picked_delta - lowest > energy_picks.gap_max)
+			energy_picks.gap_max = picked_delta - lowest;
+	}
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+static void print_util_hist_summary(const char *name, const struct util_hist *h)
+{
+	fprintf(stdout, "  %-12s p50: %4lu p90: %4lu p99: %4lu max: %4lu\n", name,
+		util_hist_quantile(h, 50), util_hist_quantile(h, 90),
+		util_hist_quantile(h, 99), h->max);
+}
+
+static void report_stream_stats(unsigned long long duration_ns)
+{
+	unsigned long long placements = 0;
+	int cpu;
+
+	if (!stream_stats)
+		return;
+
+	pthread_mutex_lock(&stream_mutex);
+
+	for (cpu = 0; cpu < stream_nr_cpus; cpu++)
+		placements += stream_stats[cpu].placements;
+
+	for (cpu = 0; cpu < stream_nr_cpus; cpu++) {
+		struct cpu_stream_stats *cs = &stream_stats[cpu];
+
+		if (!cs->rq_util_avg.count && !cs->placements)
+			continue;
+
+		fprintf(stdout, "cpu%d: %llu enqueues, %llu placements (%.1f%%, %.1f/s)\n",
+			cpu, cs->rq_util_avg.count, cs->placements,
+			placements ? 100.0 * cs->placements / placements : 0,
+			duration_ns ? cs->placements * 1e9 / duration_ns : 0);
+
+		if (cs->rq_util_avg.count) {
+			print_util_hist_summary("rq_util_avg", &cs->rq_util_avg);
+			print_util_hist_summary("p_util_avg", &cs->p_util_avg);
+			print_util_hist_summary("thermal_avg", &cs->thermal_avg);
 		}
-		fprintf(stdout, "Created %s\n", PELT_CSV_FILE);
-		fprintf(file, "ts, cpu, rq_util, p_util, capacity_orig, thermal_avg, uclamp_min, uclamp_max, overutilized, misfit\n");
 	}
 
-	if (e->uclamp_min > e->capacity_orig)
-		fprintf(stderr, "[%llu] Failed: uclamp_min > capacity_orig: %lu > %lu\n", e->ts, e->uclamp_min, e->capacity_orig);
+	if (energy_picks.wakeups) {
+		struct energy_pick_stats *ep = &energy_picks;
+		unsigned long long missed = ep->wakeups - ep->lowest - ep->not_candidate -
+					    ep->prev_kept;
 
-	if (e->thermal_avg && e->capacity_orig != 1024 && e->uclamp_min > capacity_thermal) {
-		fprintf(stderr, "[%llu] Failed: uclamp_min > capacity_orig - thermal_avg: %lu > %lu - %lu (%lu)\n",
-			e->ts, e->uclamp_min, e->capacity_orig, e->thermal_avg, capacity_thermal);
+		fprintf(stdout, "energy: %llu wakeups, lowest energy picked: %.1f%%, prev_cpu kept within margin: %llu, not a candidate: %llu, missed: %llu gap avg: %llu max: %llu\n",
+			ep->wakeups, 100.0 * ep->lowest / ep->wakeups, ep->prev_kept,
+			ep->not_candidate, missed, missed ? ep->gap_sum / missed : 0, ep->gap_max);
 	}
 
-	if ((e->uclamp_max > e->capacity_orig || e->uclamp_max == 1024) && e->p_util_avg > e->capacity_orig * 0.8 && e->overutilized != 2)
-		fprintf(stderr, "[%llu] Failed: overutilized flag not set: %lu > %lu\n", e->ts, e->p_util_avg, (unsigned long) (e->capacity_orig * 0.8));
+	if (model.verdicts[MODEL_OK] || model.verdicts[MODEL_NOT_FIT] || model.verdicts[MODEL_TOO_BIG]) {
+		fprintf(stdout, "placement model: %llu as expected, %llu %s, %llu %s\n",
+			model.verdicts[MODEL_OK],
+			model.verdicts[MODEL_NOT_FIT], model_verdict_names[MODEL_NOT_FIT],
+			model.verdicts[MODEL_TOO_BIG], model_verdict_names[MODEL_TOO_BIG]);
+	}
 
-	if (e->uclamp_min > e->capacity_orig - e->thermal_avg && !e->misfit)
-		fprintf(stderr, "[%llu] Failed: misfit flag not set: %lu > %lu\n", e->ts, e->uclamp_min, e->capacity_orig - e->thermal_avg);
+	memset(stream_stats, 0, stream_nr_cpus * sizeof(*stream_stats));
+	memset(&energy_picks, 0, sizeof(energy_picks));
+	memset(model.verdicts, 0, sizeof(model.verdicts));
 
-	for_each_capacity(cap, i) {
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+/*
+ * Scale-out mode: run 1, 2, 4, ... up to nr_scale_threads workload threads,
+ * each with its own uclamp values, so that several clamped tasks share the
+ * runqueues. rq_pelt events are accounted per TID.
+ */
+#define MAX_SCALE_THREADS	1024
+
+struct scale_thread {
+	pthread_t thread;
+	pid_t tid;
+	int cpu;
+	unsigned long uclamp_min;
+	unsigned long uclamp_max;
+	unsigned long long overruns;
+	unsigned long long events;
+	unsigned long long failed;
+	unsigned long long rq_util_sum;
+	unsigned long long p_util_sum;
+	unsigned long long cap_util_sum;
+	unsigned long long *cluster_events;
+	bool rejected;
+};
+
+/*
+ * TID to thread index, so that accounting an event doesn't walk all the
+ * threads of the scale-out or cgroup modes. Open addressing with linear
+ * probing, it's only filled as the threads start and cleared between steps,
+ * so it's never more than half full.
+ */
+#define TID_TABLE_SIZE		(2 * MAX_SCALE_THREADS)
+
+struct tid_table {
+	pid_t tid[TID_TABLE_SIZE];
+	int idx[TID_TABLE_SIZE];
+};
+
+static inline unsigned int tid_table_hash(pid_t tid)
+{
+	return ((unsigned int)tid * 2654435761u) & (TID_TABLE_SIZE - 1);
+}
+
+/* Called with the lock of the mode's threads held */
+static void tid_table_add(struct tid_table *t, pid_t tid, int idx)
+{
+	unsigned int i = tid_table_hash(tid);
+
+	while (t->tid[i] && t->tid[i] != tid)
+		i = (i + 1) & (TID_TABLE_SIZE - 1);
+
+	t->tid[i] = tid;
+	t->idx[i] = idx;
+}
+
+/* Called with the lock of the mode's threads held, -1 if tid isn't ours */
+static int tid_table_find(const struct tid_table *t, pid_t tid)
+{
+	unsigned int i = tid_table_hash(tid);
+
+	for (; t->tid[i]; i = (i + 1) & (TID_TABLE_SIZE - 1)) {
+		if (t->tid[i] == tid)
+			return t->idx[i];
+	}
+
+	return -1;
+}
+
+static int nr_scale_threads = 0;
+static bool scale_pin = false;
+static struct scale_thread *scale_threads;
+static struct tid_table scale_tids;
+static int scale_nr_running;
+static pthread_mutex_t scale_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called with scale_mutex held */
+static struct scale_thread *scale_tids_find(pid_t tid)
+{
+	int idx = tid_table_find(&scale_tids, tid);
+
+	return idx >= 0 && idx < scale_nr_running ? &scale_threads[idx] : NULL;
+}
+
+static void scale_account(const struct rq_pelt_event *e, unsigned int failed)
+{
+	struct scale_thread *st;
+
+	pthread_mutex_lock(&scale_mutex);
+	st = scale_tids_find(e->pid);
+	if (st) {
+		st->events++;
+		if (failed)
+			st->failed++;
+		st->rq_util_sum += e->rq_util_avg;
+		st->p_util_sum += e->p_util_avg;
+		st->cap_util_sum += e->p_util_avg * e->capacity_orig / SCHED_CAPACITY_SCALE;
+		if (e->cpu < capacities.nr_cpus)
+			st->cluster_events[capacities.cpu_cluster[e->cpu]]++;
+	}
+	pthread_mutex_unlock(&scale_mutex);
+}
+
+/*
+ * cgroup mode: one workload thread runs in every leaf of a cgroup
+ * hierarchy, see uclamp_cgroup.h, while clamps are changed at every level in
+ * turn. rq_pelt events are checked against the effective clamp each
+ * thread should have, its request restricted by the clamps of its group.
+ *
+ * After a change, a thread whose effective clamp changes converges on the
+ * first event that reports the new one. Events enqueued before the change
+ * are ignored, one that doesn't match once the thread converged is a
+ * mismatch.
+ */
+struct cgroup_thread {
+	pthread_t thread;
+	pid_t tid;
+	int leaf;
+	/* Task request then expected effective clamps */
+	unsigned long req_min;
+	unsigned long req_max;
+	unsigned long eff_min;
+	unsigned long eff_max;
+	unsigned long long converged_ts;
+	unsigned long long events;
+	unsigned long long mismatches;
+	bool affected;
+	bool volatile ready;
+	bool rejected;
+};
+
+static int cgroup_depth = 0;
+static int cgroup_fanout;
+static struct uclamp_cgroup_tree cgroup_tree;
+static struct cgroup_thread *cgroup_threads;
+static struct tid_table cgroup_tids;
+static int cgroup_nr_running;
+static unsigned long long cgroup_change_ts;
+static pthread_mutex_t cgroup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void cgroup_account(const struct rq_pelt_event *e)
+{
+	struct cgroup_thread *ct;
+	int idx;
+
+	pthread_mutex_lock(&cgroup_mutex);
+	idx = tid_table_find(&cgroup_tids, e->pid);
+	if (idx < 0 || idx >= cgroup_nr_running)
+		goto out;
+
+	ct = &cgroup_threads[idx];
+	ct->events++;
+	if (e->ts < cgroup_change_ts)
+		goto out;
+
+	if (e->uclamp_min == ct->eff_min && e->uclamp_max == ct->eff_max) {
+		if (!ct->converged_ts)
+			ct->converged_ts = e->ts;
+	} else if (ct->converged_ts) {
+		ct->mismatches++;
+		fprintf(stderr, "[%llu] Failed: pid %d in %s: uclamp_min: %lu uclamp_max: %lu, expected uclamp_min: %lu uclamp_max: %lu\n",
+			e->ts, e->pid, cgroup_tree.path[ct->leaf], e->uclamp_min,
+			e->uclamp_max, ct->eff_min, ct->eff_max);
+	}
+out:
+	pthread_mutex_unlock(&cgroup_mutex);
+}
+
+/*
+ * Checks and stats done on the rq signals of every wakeup, whether they come
+ * as a rq_pelt_event or as part of a wakeup_event.
+ */
+static void account_rq_pelt(const struct rq_pelt_event *e)
+{
+	enum model_verdict v = MODEL_OK;
+	unsigned int failed;
+
+	failed = check_rq_pelt_event(e, &capacities);
+
+	if (model.caps) {
+		pthread_mutex_lock(&stream_mutex);
+		v = eas_model_check(&model, e);
+		/* The heuristics only stand in for the model where it couldn't judge */
+		if (model.judged)
+			failed &= ~RQ_PELT_PLACEMENT_CHECKS;
+		pthread_mutex_unlock(&stream_mutex);
+
+		if (v != MODEL_OK)
+			eas_model_print(stderr, &model, e, v);
+	}
+
+	if (failed)
+		print_rq_pelt_checks(stderr, e, &capacities, failed);
+
+	/* A placement deviation fails the event like any other check */
+	if (v != MODEL_OK)
+		failed |= RQ_PELT_PLACEMENT_CHECKS;
 
-		if (e->uclamp_min <= cap && cap < smallest_uclamp_min_cap)
-			smallest_uclamp_min_cap = cap;
+	if (scale_nr_running)
+		scale_account(e, failed);
 
-		if (e->uclamp_max <= cap && cap < smallest_uclamp_max_cap)
-			smallest_uclamp_max_cap = cap;
+	if (cgroup_nr_running)
+		cgroup_account(e);
 
-		if (e->thermal_avg && cap < e->capacity_orig && capacity_thermal < cap) {
-			fprintf(stderr, "[%llu] Warning: capacity_inversion: capacity_orig - thermal_avg < cap: %lu - %lu (%lu) < %lu\n",
-				e->ts, e->capacity_orig, e->thermal_avg, capacity_thermal, cap);
+	stream_account_rq_pelt(e);
+}
+
+static const char * const rb_names[NR_RBS] = {
+	[RB_RQ_PELT]			= "rq_pelt",
+	[RB_SELECT_TASK_RQ_FAIR]	= "select_task_rq_fair",
+	[RB_COMPUTE_ENERGY]		= "compute_energy",
+	[RB_WAKEUP]			= "wakeup",
+};
+
+/*
+ * ts base of every CPU on every ring buffer, see struct ts_base_wire. Only
+ * the events thread touches them.
+ */
+static unsigned long long *ts_bases[NR_RBS];
+static int ts_nr_cpus;
+
+static int ts_bases_init(void)
+{
+	int i;
+
+	ts_nr_cpus = libbpf_num_possible_cpus();
+	if (ts_nr_cpus <= 0) {
+		fprintf(stderr, "Failed to get the number of possible cpus\n");
+		return -1;
+	}
+
+	for (i = 0; i < NR_RBS; i++) {
+		ts_bases[i] = calloc(ts_nr_cpus, sizeof(*ts_bases[i]));
+		if (!ts_bases[i]) {
+			perror("Failed to allocate ts bases");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void ts_bases_free(void)
+{
+	int i;
+
+	for (i = 0; i < NR_RBS; i++) {
+		free(ts_bases[i]);
+		ts_bases[i] = NULL;
+	}
+}
+
+/*
+ * Every record on the rq_pelt, select_task_rq_fair and compute_energy ring
+ * buffers is either a ts base or an event of event_sz bytes. Remember the
+ * former and return 1, return the base of the latter in base and 0.
+ */
+static int wire_ts_base(enum rb_id id, const void *data, size_t data_sz, size_t event_sz,
+			unsigned long long *base)
+{
+	const struct ts_base_wire *b = data;
+	const struct wire_hdr *hdr = data;
+
+	if (data_sz == sizeof(*b)) {
+		if (b->version != WIRE_VERSION) {
+			fprintf(stderr, "Unsupported %s wire version: %u, expected %u\n",
+				rb_names[id], b->version, WIRE_VERSION);
+			return -EINVAL;
+		}
+		if (b->src_cpu >= ts_nr_cpus) {
+			fprintf(stderr, "Invalid %s ts base cpu: %u\n", rb_names[id], b->src_cpu);
+			return -EINVAL;
 		}
+		ts_bases[id][b->src_cpu] = b->ts;
+		return 1;
 	}
 
-	if (e->p_util_avg < e->uclamp_min && e->capacity_orig != smallest_uclamp_min_cap)
-		fprintf(stderr, "[%llu] Warning: uclamp_min not on smallest fitting cap: %lu < %lu. Is it more energy efficient?\n", e->ts, e->uclamp_min, e->capacity_orig);
+	if (data_sz != event_sz || hdr->src_cpu >= ts_nr_cpus) {
+		fprintf(stderr, "Invalid %s record of %zu bytes\n", rb_names[id], data_sz);
+		return -EINVAL;
+	}
+
+	*base = ts_bases[id][hdr->src_cpu];
+	return 0;
+}
+
+static int handle_rq_pelt_event(void *ctx, void *data, size_t data_sz)
+{
+	struct rq_pelt_event ev, *e = &ev;
+	static FILE *file = NULL;
+	static bool err_once = false;
+	unsigned long long base;
+	int ret;
+
+	ret = wire_ts_base(RB_RQ_PELT, data, data_sz, sizeof(struct rq_pelt_wire), &base);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	rq_pelt_decode(e, data, base);
+
+	event_delivered(ctx, e->ts);
+
+	account_rq_pelt(e);
+
+	if (trace) {
+		record_event(TRACE_RQ_PELT, e, sizeof(*e));
+		return 0;
+	}
 
-	if (e->capacity_orig != smallest_uclamp_max_cap)
-		fprintf(stderr, "[%llu] Failed: uclamp_max not on smallest fitting cap: %lu < %lu\n", e->ts, e->uclamp_max, e->capacity_orig);
+	if (!file) {
+		file = fopen(PELT_CSV_FILE, "w");
+		if (!file) {
+			if (!err_once) {
+				err_once = true;
+				fprintf(stderr, "Failed to create %s file\n", PELT_CSV_FILE);
+			}
+			return 0;
+		}
+		fprintf(stdout, "Created %s\n", PELT_CSV_FILE);
+		fprintf(file, PELT_CSV_HEADER);
+	}
 
-	fprintf(file, "%llu, %d, %lu, %lu, %lu, %lu, %lu,%lu, %d, %d\n",
-		e->ts, e->cpu, e->rq_util_avg, e->p_util_avg, e->capacity_orig, e->thermal_avg, e->uclamp_min, e->uclamp_max, e->overutilized, e->misfit);
+	fprint_rq_pelt_csv(file, e);
 
 	fflush(file);
 	return 0;
 }
 
-#define STRQF_CSV_FILE	"uclamp_test_thermal_pressure_strqf.csv"
 static int handle_select_task_rq_fair_event(void *ctx, void *data, size_t data_sz)
 {
-	struct select_task_rq_fair_event *e = data;
+	struct select_task_rq_fair_event ev, *e = &ev;
 	static FILE *file = NULL;
 	static bool err_once = false;
+	unsigned long long base;
+	int ret;
+
+	ret = wire_ts_base(RB_SELECT_TASK_RQ_FAIR, data, data_sz,
+			   sizeof(struct select_task_rq_fair_wire), &base);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	select_task_rq_fair_decode(e, data, base);
+
+	event_delivered(ctx, e->ts);
+
+	stream_account_placement(e->cpu);
+
+	if (trace) {
+		record_event(TRACE_SELECT_TASK_RQ_FAIR, e, sizeof(*e));
+		return 0;
+	}
 
 	if (!file) {
 		file = fopen(STRQF_CSV_FILE, "w");
@@ -124,22 +609,51 @@ static int handle_select_task_rq_fair_event(void *ctx, void *data, size_t data_s
 			return 0;
 		}
 		fprintf(stdout, "Created %s\n", STRQF_CSV_FILE);
-		fprintf(file, "ts, cpu, p_util, uclamp_min, uclamp_max\n");
+		fprintf(file, STRQF_CSV_HEADER);
 	}
 
-	fprintf(file, "%llu, %d, %lu, %lu,%lu\n",
-		e->ts, e->cpu, e->p_util_avg, e->uclamp_min, e->uclamp_max);
+	fprint_select_task_rq_fair_csv(file, e);
 
 	fflush(file);
 	return 0;
 }
 
-#define COMPUTE_ENERGY_CSV_FILE	"uclamp_test_thermal_pressure_compute_energy.csv"
 static int handle_compute_energy_event(void *ctx, void *data, size_t data_sz)
 {
-	struct compute_energy_event *e = data;
+	unsigned long long energy[ENERGY_MAX_CANDIDATES], base_energy[ENERGY_MAX_CANDIDATES];
+	struct compute_energy_wire *w = data;
+	struct compute_energy_event ev, *e = &ev;
+	int cpu[ENERGY_MAX_CANDIDATES];
 	static FILE *file = NULL;
 	static bool err_once = false;
+	unsigned long long base;
+	unsigned int i, nr;
+	int ret;
+
+	ret = wire_ts_base(RB_COMPUTE_ENERGY, data, data_sz,
+			   sizeof(struct compute_energy_wire), &base);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	nr = compute_energy_nr_recorded(w);
+	for (i = 0; i < nr; i++) {
+		cpu[i] = w->cpu[i];
+		energy[i] = w->energy[i];
+		base_energy[i] = w->base_energy[i];
+	}
+
+	event_delivered(ctx, base + w->hdr.ts_delta);
+
+	stream_account_energy_pick(w->hdr.cpu, w->prev_cpu, cpu, energy, base_energy, nr);
+
+	/* Candidates are still written out one per row */
+	if (trace) {
+		for (i = 0; i < nr; i++) {
+			compute_energy_decode(e, w, base, i);
+			record_event(TRACE_COMPUTE_ENERGY, e, sizeof(*e));
+		}
+		return 0;
+	}
 
 	if (!file) {
 		file = fopen(COMPUTE_ENERGY_CSV_FILE, "w");
@@ -151,109 +665,821 @@ static int handle_compute_energy_event(void *ctx, void *data, size_t data_sz)
 			return 0;
 		}
 		fprintf(stdout, "Created %s\n", COMPUTE_ENERGY_CSV_FILE);
-		fprintf(file, "ts, dst_cpu, p_util, uclamp_min, uclamp_max, energy\n");
+		fprintf(file, COMPUTE_ENERGY_CSV_HEADER);
 	}
 
-	fprintf(file, "%llu, %d, %lu, %lu, %lu, %lu\n",
-		e->ts, e->dst_cpu, e->p_util_avg, e->uclamp_min, e->uclamp_max, e->energy);
+	for (i = 0; i < nr; i++) {
+		compute_energy_decode(e, w, base, i);
+		fprint_compute_energy_csv(file, e);
+	}
 
 	fflush(file);
 	return 0;
 }
 
-#define SYSFS_CAPACITIES	"/sys/devices/system/cpu/cpu*/cpu_capacity"
-static int get_capacities(void)
+static int handle_wakeup_event(void *ctx, void *data, size_t data_sz)
 {
-	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
-	char str[256] = {};
-	char *cap;
-	int read;
+	unsigned long long energy[WAKEUP_MAX_CANDIDATES], base_energy[WAKEUP_MAX_CANDIDATES];
+	struct wakeup_event *e = data;
+	int cpu[WAKEUP_MAX_CANDIDATES];
+	static FILE *file = NULL;
+	static bool err_once = false;
+	unsigned int i, nr;
 
-	FILE *fp = popen("cat " SYSFS_CAPACITIES " | sort -un", "r");
-	if (!fp) {
-		perror("Can't read capacities");
-		return -1;
+	event_delivered(ctx, e->enqueue.ts);
+
+	account_rq_pelt(&e->enqueue);
+	stream_account_placement(e->strqf_cpu);
+
+	nr = e->nr_candidates < WAKEUP_MAX_CANDIDATES ? e->nr_candidates : WAKEUP_MAX_CANDIDATES;
+	for (i = 0; i < nr; i++) {
+		cpu[i] = e->candidates[i].cpu;
+		energy[i] = e->candidates[i].energy;
+		base_energy[i] = e->candidates[i].base_energy;
 	}
+	if (e->strqf_cpu >= 0)
+		stream_account_energy_pick(e->strqf_cpu, e->strqf_prev_cpu, cpu, energy,
+					   base_energy, nr);
 
-	read = fread(str, 1, 256, fp);
-	fclose(fp);
-	if (!read) {
-		perror("Failed to read capacities");
-		return -1;
+	if (trace) {
+		record_event(TRACE_WAKEUP, e, sizeof(*e));
+		return 0;
 	}
 
-	capacities.cap = calloc(num_cpus, sizeof(unsigned long));
-	cap = strtok(str, "\n");
-	while (cap) {
-		pr_debug("Adding capacity: %i\n", atoi(cap));
-		capacities.cap[capacities.len] = atoi(cap);
-		capacities.len++;
-		cap = strtok(NULL, "\n");
+	if (!file) {
+		file = fopen(WAKEUP_CSV_FILE, "w");
+		if (!file) {
+			if (!err_once) {
+				err_once = true;
+				fprintf(stderr, "Failed to create %s file\n", WAKEUP_CSV_FILE);
+			}
+			return 0;
+		}
+		fprintf(stdout, "Created %s\n", WAKEUP_CSV_FILE);
+		fprintf(file, WAKEUP_CSV_HEADER);
 	}
 
+	fprint_wakeup_csv(file, e);
+
+	fflush(file);
 	return 0;
 }
 
+static int get_capacities(void)
+{
+	unsigned long cap;
+	int ret, i;
+
+	ret = capacities_discover(&capacities);
+	if (ret) {
+		fprintf(stderr, "Failed to read capacities\n");
+		return ret;
+	}
+
+	for_each_capacity(cap, i)
+		fprintf(stdout, "Capacity %lu: %u cpus\n", cap, capacities.cluster_nr_cpus[i]);
+
+	/* Keep a copy with the traces so they can be checked offline */
+	capacities_save(&capacities, CAPACITIES_CSV_FILE);
+
+	return eas_model_init(&model, &capacities);
+}
+
 /*
  * All events require to access this variable to get access to the ringbuffer.
- * Make it available for all event##_thread_fn.
  */
 struct uclamp_test_thermal_pressure_bpf *skel;
 
 /*
- * Define a pthread function handler for each event
+ * A single consumer thread services the ring buffers of all events.
  */
-EVENT_THREAD_FN(rq_pelt)
-EVENT_THREAD_FN(select_task_rq_fair)
-EVENT_THREAD_FN(compute_energy)
+INIT_EVENT_STATS(rq_pelt);
+INIT_EVENT_STATS(select_task_rq_fair);
+INIT_EVENT_STATS(compute_energy);
+INIT_EVENT_STATS(wakeup);
+INIT_EVENTS_RB();
+EVENTS_THREAD_FN()
 
-static inline __attribute__((always_inline)) void do_light_work(void)
+/*
+ * Add a task to the set of TIDs the BPF probes trace. Must be called after
+ * the skeleton is loaded.
+ */
+static int track_task(pid_t tid)
 {
-	int loops = NR_LOOPS;
+	__u8 val = 1;
+	int ret;
+
+	ret = bpf_map_update_elem(bpf_map__fd(skel->maps.tracked_tasks), &tid, &val, BPF_ANY);
+	if (ret)
+		fprintf(stderr, "Failed to track task %d: %d\n", tid, ret);
 
-	while (loops--)
-		usleep(16000);
+	return ret;
 }
 
-static inline __attribute__((always_inline)) void do_busy_work(void)
+static void untrack_task(pid_t tid)
 {
-	struct timespec start, ts;
-	long int time_diff_us;
-	int loops = NR_LOOPS;
-	int result, ret;
+	bpf_map_delete_elem(bpf_map__fd(skel->maps.tracked_tasks), &tid);
+	bpf_map_delete_elem(bpf_map__fd(skel->maps.wakeup_map), &tid);
+	bpf_map_delete_elem(bpf_map__fd(skel->maps.wakeup_ts_map), &tid);
+}
 
-	while (loops--) {
-		ret = clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-		if (ret) {
-			perror("Failed to get time");
-			return;
-		}
-		while (true) {
-			result = pow(loops, loops);
-			result = sqrt(result);
+/*
+ * Aggregation mode: the BPF side builds per-CPU histograms of the rq PELT
+ * signals and counts the failed checks. We read and reset them at the end of
+ * each phase.
+ */
+static bool aggregate = false;
 
-			ret = clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-			if (ret) {
-				perror("Failed to get time");
-				return;
-			}
+/* One wakeup_event per wakeup instead of separate rq_pelt, strqf and energy events */
+static bool wakeup_records = false;
 
-			time_diff_us = (ts.tv_sec - start.tv_sec) * 1000000;
-			time_diff_us += (ts.tv_nsec - start.tv_nsec) / 1000;
+/*
+ * Size of every ring buffer and how full, in percent, one must be before the
+ * producer wakes the consumer up. 0% wakes it up on every event.
+ */
+#define RB_WAKEUP_PCT	25
 
-			pr_debug("ts.tv_sec: %ld ts.tv_nsec: %ld\n", ts.tv_sec, ts.tv_nsec);
-			pr_debug("start.tv_sec: %ld start.tv_nsec: %ld\n", start.tv_sec, start.tv_nsec);
-			pr_debug("time_diff: %ld\n", time_diff_us);
+static unsigned long rb_size = RB_SIZE;
+static int rb_wakeup_pct = RB_WAKEUP_PCT;
 
-			if (time_diff_us >= 14000)
-				break;
+static int rb_set_size(void)
+{
+	struct bpf_map *rbs[NR_RBS] = {
+		[RB_RQ_PELT]			= skel->maps.rq_pelt_rb,
+		[RB_SELECT_TASK_RQ_FAIR]	= skel->maps.select_task_rq_fair_rb,
+		[RB_COMPUTE_ENERGY]		= skel->maps.compute_energy_rb,
+		[RB_WAKEUP]			= skel->maps.wakeup_rb,
+	};
+	int i, ret;
+
+	for (i = 0; i < NR_RBS; i++) {
+		ret = bpf_map__set_max_entries(rbs[i], rb_size);
+		if (ret) {
+			fprintf(stderr, "Failed to size %s ringbuffer: %d\n", rb_names[i], ret);
+			return ret;
 		}
-		usleep(2000);
 	}
+
+	skel->bss->rb_wakeup_bytes = rb_size * rb_wakeup_pct / 100;
+
+	return 0;
 }
 
-static void print_uclamp_values(void)
-{
+/*
+ * A clean run is only clean if no event was dropped because its ring buffer
+ * was full.
+ */
+static void print_rb_drops(void)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	int fd = bpf_map__fd(skel->maps.rb_drops);
+	unsigned long long *drops, total;
+	unsigned int id;
+	int cpu, ret;
+
+	drops = calloc(nr_cpus, sizeof(*drops));
+	if (!drops) {
+		perror("Failed to allocate rb_drops");
+		return;
+	}
+
+	for (id = 0; id < NR_RBS; id++) {
+		ret = bpf_map_lookup_elem(fd, &id, drops);
+		if (ret) {
+			fprintf(stderr, "Failed to read rb_drops[%u]: %d\n", id, ret);
+			break;
+		}
+
+		for (total = 0, cpu = 0; cpu < nr_cpus; cpu++)
+			total += drops[cpu];
+
+		fprintf(stdout, "[%s] ringbuffer drops: %llu", rb_names[id], total);
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (drops[cpu])
+				fprintf(stdout, " cpu%d: %llu", cpu, drops[cpu]);
+		}
+		fprintf(stdout, "\n");
+
+		if (total)
+			fprintf(stderr, "Failed: %llu %s events dropped, try a bigger --rb-size\n",
+				total, rb_names[id]);
+	}
+
+	free(drops);
+}
+
+/* @p is in [0, 100], see log2_hist_quantile() */
+static unsigned long long hist_linear_quantile(unsigned long long *slots, unsigned long long count,
+					       double p)
+{
+	unsigned long long target = count * p / 100, sum = 0;
+	int i;
+
+	for (i = 0; i < PELT_HIST_LINEAR_SLOTS; i++) {
+		sum += slots[i];
+		if (sum > target)
+			return (i + 1) * PELT_HIST_LINEAR_WIDTH - 1;
+	}
+
+	return PELT_HIST_LINEAR_SLOTS * PELT_HIST_LINEAR_WIDTH - 1;
+}
+
+/*
+ * h becomes what was added since prev. capacity_orig and thermal_max aren't
+ * counters, they stay as they are: thermal_max is since the start.
+ */
+static void rq_pelt_hist_sub(struct rq_pelt_hist *h, const struct rq_pelt_hist *prev)
+{
+	int i;
+
+	h->count -= prev->count;
+	for (i = 0; i < PELT_HIST_LOG2_SLOTS; i++) {
+		h->rq_util_avg[i] -= prev->rq_util_avg[i];
+		h->p_util_avg[i] -= prev->p_util_avg[i];
+	}
+	for (i = 0; i < PELT_HIST_LINEAR_SLOTS; i++)
+		h->thermal_avg[i] -= prev->thermal_avg[i];
+	h->overutilized -= prev->overutilized;
+	h->misfit -= prev->misfit;
+	h->uclamp_min_gt_cap -= prev->uclamp_min_gt_cap;
+	h->uclamp_min_gt_cap_thermal -= prev->uclamp_min_gt_cap_thermal;
+	h->overutilized_not_set -= prev->overutilized_not_set;
+	h->misfit_not_set -= prev->misfit_not_set;
+	h->p_util_lt_uclamp_min -= prev->p_util_lt_uclamp_min;
+}
+
+static void print_rq_pelt_hist(int cpu, struct rq_pelt_hist *h,
+			       unsigned long uclamp_min, unsigned long uclamp_max)
+{
+	unsigned long smallest_uclamp_min_cap = capacity_fit(&capacities, uclamp_min);
+	unsigned long smallest_uclamp_max_cap = capacity_fit(&capacities, uclamp_max);
+	unsigned long capacity_thermal = h->capacity_orig - h->thermal_max;
+	unsigned long cap;
+	int i;
+
+	fprintf(stdout, "cpu %d capacity_orig: %llu events: %llu overutilized: %llu misfit: %llu\n",
+		cpu, h->capacity_orig, h->count, h->overutilized, h->misfit);
+	fprintf(stdout, "\trq_util p50: %llu p99: %llu p_util p50: %llu p99: %llu thermal p50: %llu max: %llu\n",
+		log2_hist_quantile(h->rq_util_avg, PELT_HIST_LOG2_SLOTS, h->count,
+				   ULLONG_MAX, 50),
+		log2_hist_quantile(h->rq_util_avg, PELT_HIST_LOG2_SLOTS, h->count,
+				   ULLONG_MAX, 99),
+		log2_hist_quantile(h->p_util_avg, PELT_HIST_LOG2_SLOTS, h->count,
+				   ULLONG_MAX, 50),
+		log2_hist_quantile(h->p_util_avg, PELT_HIST_LOG2_SLOTS, h->count,
+				   ULLONG_MAX, 99),
+		hist_linear_quantile(h->thermal_avg, h->count, 50),
+		h->thermal_max);
+
+	if (h->uclamp_min_gt_cap)
+		fprintf(stderr, "Failed: uclamp_min > capacity_orig: %lu > %llu (%llu events)\n",
+			uclamp_min, h->capacity_orig, h->uclamp_min_gt_cap);
+	if (h->uclamp_min_gt_cap_thermal)
+		fprintf(stderr, "Failed: uclamp_min > capacity_orig - thermal_avg (%llu events)\n",
+			h->uclamp_min_gt_cap_thermal);
+	if (h->overutilized_not_set)
+		fprintf(stderr, "Failed: overutilized flag not set (%llu events)\n",
+			h->overutilized_not_set);
+	if (h->misfit_not_set)
+		fprintf(stderr, "Failed: misfit flag not set (%llu events)\n",
+			h->misfit_not_set);
+
+	if (smallest_uclamp_min_cap > h->capacity_orig)
+		smallest_uclamp_min_cap = h->capacity_orig;
+	if (smallest_uclamp_max_cap > h->capacity_orig)
+		smallest_uclamp_max_cap = h->capacity_orig;
+
+	for_each_capacity(cap, i) {
+		if (h->thermal_max && cap < h->capacity_orig && capacity_thermal < cap) {
+			fprintf(stderr, "Warning: capacity_inversion: capacity_orig - thermal_max < cap: %llu - %llu (%lu) < %lu\n",
+				h->capacity_orig, h->thermal_max, capacity_thermal, cap);
+		}
+	}
+
+	if (h->p_util_lt_uclamp_min && h->capacity_orig != smallest_uclamp_min_cap)
+		fprintf(stderr, "Warning: uclamp_min not on smallest fitting cap: %lu < %llu (%llu events). Is it more energy efficient?\n",
+			uclamp_min, h->capacity_orig, h->p_util_lt_uclamp_min);
+
+	if (h->capacity_orig != smallest_uclamp_max_cap)
+		fprintf(stderr, "Failed: uclamp_max not on smallest fitting cap: %lu < %llu (%llu events)\n",
+			uclamp_max, h->capacity_orig, h->count);
+}
+
+/* What rq_pelt_hist_map held at the previous report, it's never reset */
+static struct rq_pelt_hist *rq_pelt_hist_prev;
+
+static void report_rq_pelt_hist(unsigned long uclamp_min, unsigned long uclamp_max)
+{
+	int fd = bpf_map__fd(skel->maps.rq_pelt_hist_map);
+	unsigned int key, max_entries = bpf_map__max_entries(skel->maps.rq_pelt_hist_map);
+	struct rq_pelt_hist cur, h;
+	int ret;
+
+	if (!rq_pelt_hist_prev) {
+		rq_pelt_hist_prev = calloc(max_entries, sizeof(*rq_pelt_hist_prev));
+		if (!rq_pelt_hist_prev) {
+			perror("Failed to allocate rq_pelt_hist");
+			return;
+		}
+	}
+
+	fprintf(stdout, "--:: rq_pelt summary uclamp_min: %lu uclamp_max: %lu ::--\n",
+		uclamp_min, uclamp_max);
+
+	for (key = 0; key < max_entries; key++) {
+		ret = bpf_map_lookup_elem(fd, &key, &cur);
+		if (ret) {
+			fprintf(stderr, "Failed to read rq_pelt_hist_map[%u]: %d\n", key, ret);
+			break;
+		}
+
+		h = cur;
+		rq_pelt_hist_sub(&h, &rq_pelt_hist_prev[key]);
+		rq_pelt_hist_prev[key] = cur;
+		if (!h.count)
+			continue;
+
+		print_rq_pelt_hist(key / (UCLAMP_BUCKETS * UCLAMP_BUCKETS), &h,
+				   uclamp_min, uclamp_max);
+	}
+}
+
+/*
+ * Wakeup to running latency, the BPF side keys its histograms by uclamp
+ * values and CPU. They are merged per cluster and reported at the end of each
+ * phase.
+ *
+ * The BPF histograms are never reset: the CPU of the key keeps incrementing
+ * it while we read it, so deleting or overwriting it would lose what lands in
+ * between. We keep what each key held at the last report instead and report
+ * the difference, so the keys of the whole run share RUN_LAT_MAX_KEYS.
+ */
+struct run_lat_summary {
+	unsigned int uclamp_min;
+	unsigned int uclamp_max;
+	unsigned int cluster;
+	struct run_lat_hist hist;
+};
+
+static struct run_lat_key run_lat_keys[RUN_LAT_MAX_KEYS];
+static struct run_lat_summary run_lat_summaries[RUN_LAT_MAX_KEYS];
+static struct run_lat_key run_lat_prev_keys[RUN_LAT_MAX_KEYS];
+static struct run_lat_hist run_lat_prev[RUN_LAT_MAX_KEYS];
+static unsigned int run_lat_nr_prev;
+
+static struct run_lat_hist *run_lat_prev_get(const struct run_lat_key *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < run_lat_nr_prev; i++) {
+		if (!memcmp(&run_lat_prev_keys[i], key, sizeof(*key)))
+			return &run_lat_prev[i];
+	}
+
+	if (run_lat_nr_prev == RUN_LAT_MAX_KEYS)
+		return NULL;
+
+	run_lat_prev_keys[i] = *key;
+	memset(&run_lat_prev[i], 0, sizeof(run_lat_prev[i]));
+	run_lat_nr_prev++;
+	return &run_lat_prev[i];
+}
+
+/*
+ * h becomes what was added since prev. The max is since the start: if it
+ * didn't grow, the phase max is bounded by its highest non empty slot.
+ */
+static void run_lat_delta(struct run_lat_hist *h, const struct run_lat_hist *prev)
+{
+	int i, top = -1;
+
+	h->count -= prev->count;
+	for (i = 0; i < RUN_LAT_SLOTS; i++) {
+		h->slots[i] -= prev->slots[i];
+		if (h->slots[i])
+			top = i;
+	}
+
+	if (h->max > prev->max)
+		return;
+	if (top <= 0)
+		h->max = 0;
+	else if ((1ULL << top) - 1 < h->max)
+		h->max = (1ULL << top) - 1;
+}
+
+static void report_run_latency(void)
+{
+	int fd = bpf_map__fd(skel->maps.run_lat_map);
+	unsigned int nr_keys = 0, nr = 0, i, j;
+	struct run_lat_key *prev_key = NULL;
+	struct run_lat_hist h, *prev;
+
+	while (nr_keys < RUN_LAT_MAX_KEYS &&
+	       !bpf_map_get_next_key(fd, prev_key, &run_lat_keys[nr_keys])) {
+		prev_key = &run_lat_keys[nr_keys];
+		nr_keys++;
+	}
+
+	for (i = 0; i < nr_keys; i++) {
+		struct run_lat_key *key = &run_lat_keys[i];
+		struct run_lat_summary *sum;
+		unsigned int cluster;
+
+		if (bpf_map_lookup_elem(fd, key, &h))
+			continue;
+
+		prev = run_lat_prev_get(key);
+		if (!prev)
+			continue;
+		run_lat_delta(&h, prev);
+		prev->count += h.count;
+		for (j = 0; j < RUN_LAT_SLOTS; j++)
+			prev->slots[j] += h.slots[j];
+		if (h.max > prev->max)
+			prev->max = h.max;
+
+		if (!h.count || key->cpu < 0 || (unsigned int)key->cpu >= capacities.nr_cpus)
+			continue;
+		cluster = capacities.cpu_cluster[key->cpu];
+
+		for (j = 0; j < nr; j++) {
+			sum = &run_lat_summaries[j];
+			if (sum->uclamp_min == key->uclamp_min && sum->uclamp_max == key->uclamp_max &&
+			    sum->cluster == cluster)
+				break;
+		}
+		sum = &run_lat_summaries[j];
+		if (j == nr) {
+			memset(sum, 0, sizeof(*sum));
+			sum->uclamp_min = key->uclamp_min;
+			sum->uclamp_max = key->uclamp_max;
+			sum->cluster = cluster;
+			nr++;
+		}
+
+		sum->hist.count += h.count;
+		if (h.max > sum->hist.max)
+			sum->hist.max = h.max;
+		for (j = 0; j < RUN_LAT_SLOTS; j++)
+			sum->hist.slots[j] += h.slots[j];
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct run_lat_summary *sum = &run_lat_summaries[i];
+		struct run_lat_hist *sh = &sum->hist;
+
+		fprintf(stdout, "wakeup latency uclamp_min: %4u uclamp_max: %4u capacity: %4lu: %llu wakeups p50: %llu us p99: %llu us max: %llu us\n",
+			sum->uclamp_min, sum->uclamp_max, capacities.cap[sum->cluster], sh->count,
+			log2_hist_quantile(sh->slots, RUN_LAT_SLOTS, sh->count, sh->max, 50) / 1000,
+			log2_hist_quantile(sh->slots, RUN_LAT_SLOTS, sh->count, sh->max, 99) / 1000,
+			sh->max / 1000);
+	}
+}
+
+/*
+ * Overhead mode: BPF runtime stats are enabled so we can tell how much time
+ * each program adds to the path it hooks.
+ */
+#define MAX_PROGS		32
+#define OVERHEAD_CSV_FILE	"uclamp_test_thermal_pressure_overhead.csv"
+#define OVERHEAD_WAKEUPS	100000
+
+struct prog_stats {
+	const char *name;
+	unsigned long long run_cnt;
+	unsigned long long run_time_ns;
+};
+
+static bool overhead = false;
+static int overhead_stats_fd = -1;
+static FILE *overhead_file = NULL;
+static struct prog_stats phase_prog_stats[MAX_PROGS];
+
+static int overhead_init(void)
+{
+	overhead_stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+	if (overhead_stats_fd < 0) {
+		fprintf(stderr, "Failed to enable BPF runtime stats: %d\n", overhead_stats_fd);
+		return -1;
+	}
+
+	overhead_file = fopen(OVERHEAD_CSV_FILE, "w");
+	if (!overhead_file) {
+		fprintf(stderr, "Failed to create %s file\n", OVERHEAD_CSV_FILE);
+		close(overhead_stats_fd);
+		overhead_stats_fd = -1;
+		return -1;
+	}
+	fprintf(stdout, "Created %s\n", OVERHEAD_CSV_FILE);
+	fprintf(overhead_file, "kind, name, uclamp_min, uclamp_max, count, time_ns, ns_per_event\n");
+
+	return 0;
+}
+
+static void overhead_exit(void)
+{
+	if (overhead_file)
+		fclose(overhead_file);
+	if (overhead_stats_fd >= 0)
+		close(overhead_stats_fd);
+}
+
+/*
+ * Programs that weren't loaded are skipped, so the order is stable for the
+ * lifetime of the skeleton.
+ */
+static int read_prog_stats(struct prog_stats *stats)
+{
+	struct bpf_program *prog;
+	int n = 0;
+
+	bpf_object__for_each_program(prog, skel->obj) {
+		struct bpf_prog_info info = {};
+		__u32 len = sizeof(info);
+		int fd = bpf_program__fd(prog);
+
+		if (fd < 0)
+			continue;
+		if (n == MAX_PROGS)
+			break;
+		if (bpf_prog_get_info_by_fd(fd, &info, &len))
+			continue;
+
+		stats[n].name = bpf_program__name(prog);
+		stats[n].run_cnt = info.run_cnt;
+		stats[n].run_time_ns = info.run_time_ns;
+		n++;
+	}
+
+	return n;
+}
+
+static void report_prog_stats(const char *kind, struct prog_stats *before,
+			      unsigned long uclamp_min, unsigned long uclamp_max)
+{
+	struct prog_stats after[MAX_PROGS];
+	int i, n;
+
+	n = read_prog_stats(after);
+
+	fprintf(stdout, "%-32s %12s %14s %10s\n", "prog", "run_cnt", "run_time_ns", "ns/event");
+	for (i = 0; i < n; i++) {
+		unsigned long long cnt = after[i].run_cnt - before[i].run_cnt;
+		unsigned long long time = after[i].run_time_ns - before[i].run_time_ns;
+		double ns = cnt ? (double)time / cnt : 0;
+
+		fprintf(stdout, "%-32s %12llu %14llu %10.1f\n", after[i].name, cnt, time, ns);
+		fprintf(overhead_file, "%s, %s, %lu, %lu, %llu, %llu, %.1f\n",
+			kind, after[i].name, uclamp_min, uclamp_max, cnt, time, ns);
+	}
+
+	fflush(overhead_file);
+}
+
+static void *wakeup_peer_fn(void *data)
+{
+	pid_t tid = gettid();
+	int *fds = data;
+	char c;
+
+	track_task(tid);
+
+	while (read(fds[0], &c, 1) == 1) {
+		if (write(fds[1], &c, 1) != 1)
+			break;
+	}
+
+	/* The TID can be reused once the thread exits */
+	untrack_task(tid);
+
+	return NULL;
+}
+
+/*
+ * Ping-pong a byte between two tracked threads. Every round trip is two
+ * wakeups going through enqueue_task_fair and select_task_rq_fair.
+ */
+static long long run_wakeup_workload(int iterations)
+{
+	int ping[2], pong[2], peer_fds[2];
+	struct timespec t0, t1;
+	long long elapsed = -1;
+	pthread_t peer;
+	pid_t tid = gettid();
+	char c = 0;
+	int i;
+
+	if (pipe(ping))
+		return -1;
+	if (pipe(pong))
+		goto out_ping;
+
+	peer_fds[0] = ping[0];
+	peer_fds[1] = pong[1];
+	if (pthread_create(&peer, NULL, wakeup_peer_fn, peer_fds))
+		goto out_pong;
+
+	track_task(tid);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < iterations; i++) {
+		if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1)
+			break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (i == iterations)
+		elapsed = (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+
+	bpf_map_delete_elem(bpf_map__fd(skel->maps.tracked_tasks), &tid);
+
+	/* Closing the write end makes the peer read() return 0 */
+	close(ping[1]);
+	ping[1] = -1;
+	pthread_join(peer, NULL);
+out_pong:
+	close(pong[0]);
+	close(pong[1]);
+out_ping:
+	close(ping[0]);
+	if (ping[1] >= 0)
+		close(ping[1]);
+	return elapsed;
+}
+
+static void run_overhead_benchmark(void)
+{
+	struct prog_stats before[MAX_PROGS];
+	long long attached, detached;
+	unsigned long long wakeups = 2ULL * OVERHEAD_WAKEUPS;
+	int ret;
+
+	fprintf(stdout, "--:: Probe overhead: %d round trips ::--\n", OVERHEAD_WAKEUPS);
+
+	read_prog_stats(before);
+	attached = run_wakeup_workload(OVERHEAD_WAKEUPS);
+	report_prog_stats("workload", before, 0, 1024);
+
+	uclamp_test_thermal_pressure_bpf__detach(skel);
+	detached = run_wakeup_workload(OVERHEAD_WAKEUPS);
+	ret = uclamp_test_thermal_pressure_bpf__attach(skel);
+	if (ret)
+		fprintf(stderr, "Failed to re-attach BPF skeleton\n");
+
+	if (attached < 0 || detached < 0) {
+		fprintf(stderr, "Failed to run wakeup workload\n");
+		return;
+	}
+
+	fprintf(stdout, "%-32s %12s %14s %10s\n", "workload", "wakeups", "time_ns", "ns/wakeup");
+	fprintf(stdout, "%-32s %12llu %14lld %10.1f\n", "detached", wakeups, detached,
+		(double)detached / wakeups);
+	fprintf(stdout, "%-32s %12llu %14lld %10.1f\n", "attached", wakeups, attached,
+		(double)attached / wakeups);
+	fprintf(stdout, "slowdown: %.2f%%\n", 100.0 * (attached - detached) / detached);
+
+	fprintf(overhead_file, "workload, detached, 0, 1024, %llu, %lld, %.1f\n",
+		wakeups, detached, (double)detached / wakeups);
+	fprintf(overhead_file, "workload, attached, 0, 1024, %llu, %lld, %.1f\n",
+		wakeups, attached, (double)attached / wakeups);
+	fflush(overhead_file);
+}
+
+/*
+ * A phase is the time the task spends running with the same uclamp values,
+ * i.e: between two set_uclamp_values() calls.
+ */
+static struct {
+	bool active;
+	unsigned long uclamp_min;
+	unsigned long uclamp_max;
+	unsigned long long start_ns;
+} phase;
+
+static void phase_start(unsigned long uclamp_min, unsigned long uclamp_max)
+{
+	phase.uclamp_min = uclamp_min;
+	phase.uclamp_max = uclamp_max;
+	phase.start_ns = now_ns();
+	phase.active = true;
+
+	if (overhead)
+		read_prog_stats(phase_prog_stats);
+}
+
+static void phase_end(void)
+{
+	if (!phase.active)
+		return;
+
+	phase.active = false;
+
+	if (aggregate)
+		report_rq_pelt_hist(phase.uclamp_min, phase.uclamp_max);
+
+	if (stream_stats) {
+		fprintf(stdout, "--:: Streaming stats uclamp_min: %lu uclamp_max: %lu ::--\n",
+			phase.uclamp_min, phase.uclamp_max);
+		report_stream_stats(now_ns() - phase.start_ns);
+	}
+
+	fprintf(stdout, "--:: Wakeup latency uclamp_min: %lu uclamp_max: %lu ::--\n",
+		phase.uclamp_min, phase.uclamp_max);
+	report_run_latency();
+
+	if (overhead) {
+		fprintf(stdout, "--:: Probe overhead uclamp_min: %lu uclamp_max: %lu ::--\n",
+			phase.uclamp_min, phase.uclamp_max);
+		report_prog_stats("phase", phase_prog_stats, phase.uclamp_min, phase.uclamp_max);
+	}
+}
+
+/*
+ * Built-in phases: light wakes up every 16ms to do nearly nothing, busy runs
+ * 14ms out of every 16ms. Both last NR_LOOPS periods.
+ */
+static const struct workload_phase light_work = {
+	.name		= "light",
+	.period_ns	= 16000000ULL,
+	.duty		= 0,
+	.run_ns		= NR_LOOPS * 16000000ULL,
+	.uclamp_min	= WORKLOAD_UCLAMP_KEEP,
+	.uclamp_max	= WORKLOAD_UCLAMP_KEEP,
+};
+
+static const struct workload_phase busy_work = {
+	.name		= "busy",
+	.period_ns	= 16000000ULL,
+	.duty		= 87.5,
+	.run_ns		= NR_LOOPS * 16000000ULL,
+	.uclamp_min	= WORKLOAD_UCLAMP_KEEP,
+	.uclamp_max	= WORKLOAD_UCLAMP_KEEP,
+};
+
+static const char *scenario_file;
+
+/*
+ * Counters of the test thread. Together with the work units they tell how
+ * much throughput a clamp costs: units per busy second, IPC and the effective
+ * frequency, user cycles per task-clock ns. task-clock includes the time in
+ * the kernel, so it reads low for phases that spend time there.
+ */
+static struct perf_counters counters = { .fd = { -1, -1, -1 } };
+
+struct throughput {
+	double units_per_sec;
+	double ipc;
+	double freq_mhz;
+};
+
+/* tp is optional, the throughput is printed either way */
+static int do_work(const struct workload_phase *ph, struct throughput *tp)
+{
+	unsigned long long *d = counters.delta;
+	struct workload_stats st;
+	struct throughput local;
+	int ret;
+
+	if (!tp)
+		tp = &local;
+
+	perf_counters_start(&counters);
+	ret = workload_run_phase(ph, &st);
+	perf_counters_stop(&counters);
+
+	if (!ret) {
+		workload_print_stats(stdout, ph, &st);
+
+		tp->units_per_sec = workload_units_per_sec(&st);
+		tp->ipc = d[PERF_COUNTER_CYCLES] ?
+			(double)d[PERF_COUNTER_INSTRUCTIONS] / d[PERF_COUNTER_CYCLES] : 0;
+		tp->freq_mhz = d[PERF_COUNTER_TASK_CLOCK] ?
+			d[PERF_COUNTER_CYCLES] * 1000.0 / d[PERF_COUNTER_TASK_CLOCK] : 0;
+
+		if (st.units && perf_counter_valid(&counters, PERF_COUNTER_CYCLES)) {
+			fprintf(stdout, "%s: IPC: %.2f effective freq: %.0f MHz instructions/unit: %llu\n",
+				ph->name, tp->ipc, tp->freq_mhz,
+				d[PERF_COUNTER_INSTRUCTIONS] / st.units);
+		}
+	}
+	workload_free_stats(&st);
+
+	return ret;
+}
+
+static inline void do_light_work(void)
+{
+	do_work(&light_work, NULL);
+}
+
+static inline void do_busy_work(void)
+{
+	do_work(&busy_work, NULL);
+}
+
+static void print_uclamp_values(void)
+{
 	struct sched_attr sched_attr;
 	pid_t pid = gettid();
 	int ret;
@@ -275,6 +1501,8 @@ static int set_uclamp_values(struct sched_attr *sched_attr,
 	pid_t pid = gettid();
 	int ret;
 
+	phase_end();
+
 	fprintf(stdout, "Setting uclamp_min: %lu uclamp_max: %lu\n", uclamp_min, uclamp_max);
 	sched_attr->sched_util_min = uclamp_min;
 	sched_attr->sched_util_max = uclamp_max;
@@ -288,6 +1516,8 @@ static int set_uclamp_values(struct sched_attr *sched_attr,
 
 	print_uclamp_values();
 
+	phase_start(uclamp_min, uclamp_max);
+
 	usleep(1000);
 
 	return 0;
@@ -339,6 +1569,115 @@ static int test_uclamp_min(void)
 	return 0;
 }
 
+/*
+ * Throughput vs uclamp_max curve of every cluster: the test thread is pinned
+ * to each cluster in turn and runs the busy phase at uclamp_max 0, 128, ...
+ * 1024. It isn't traced meanwhile, pinning would only make the placement
+ * checks fail.
+ */
+#define THROUGHPUT_STEP		128
+#define THROUGHPUT_CSV_FILE	"uclamp_test_thermal_pressure_throughput.csv"
+#define THROUGHPUT_CSV_HEADER	"capacity, uclamp_max, units_per_sec, pct_unclamped, ipc, freq_mhz\n"
+
+static const struct workload_phase throughput_work = {
+	.name		= "throughput",
+	.period_ns	= 16000000ULL,
+	.duty		= 87.5,
+	.run_ns		= NR_LOOPS / 2 * 16000000ULL,
+	.uclamp_min	= WORKLOAD_UCLAMP_KEEP,
+	.uclamp_max	= WORKLOAD_UCLAMP_KEEP,
+};
+
+static int test_throughput(struct sched_attr *sched_attr)
+{
+	struct throughput curve[SCHED_CAPACITY_SCALE / THROUGHPUT_STEP + 1];
+	unsigned int nr_points = SCHED_CAPACITY_SCALE / THROUGHPUT_STEP + 1;
+	pid_t pid = gettid();
+	unsigned int cpu, j;
+	cpu_set_t cpuset, saved;
+	unsigned long cap;
+	FILE *file;
+	int ret = 0, i;
+
+	fprintf(stdout, "--:: Throughput vs uclamp_max ::--\n");
+
+	/* Restored once done, whatever the mask we were started with */
+	if (sched_getaffinity(0, sizeof(saved), &saved)) {
+		perror("Failed to get affinity");
+		return -1;
+	}
+
+	file = fopen(THROUGHPUT_CSV_FILE, "w");
+	if (!file) {
+		fprintf(stderr, "Failed to create %s file\n", THROUGHPUT_CSV_FILE);
+		return -1;
+	}
+	fprintf(file, THROUGHPUT_CSV_HEADER);
+
+	untrack_task(pid);
+
+	for_each_capacity(cap, i) {
+		CPU_ZERO(&cpuset);
+		for (cpu = 0; cpu < capacities.nr_cpus; cpu++) {
+			if (capacities.cpu_cluster[cpu] == (unsigned int)i)
+				CPU_SET(cpu, &cpuset);
+		}
+		ret = sched_setaffinity(0, sizeof(cpuset), &cpuset);
+		if (ret) {
+			perror("Failed to set affinity");
+			break;
+		}
+
+		for (j = 0; j < nr_points; j++) {
+			sched_attr->sched_util_min = 0;
+			sched_attr->sched_util_max = j * THROUGHPUT_STEP;
+			sched_attr->sched_flags = SCHED_FLAG_KEEP_ALL | SCHED_FLAG_UTIL_CLAMP;
+			ret = sched_setattr(pid, sched_attr, 0);
+			if (ret) {
+				perror("Failed to set attr");
+				break;
+			}
+
+			fprintf(stdout, "Capacity %lu uclamp_max: %u\n", cap, sched_attr->sched_util_max);
+			memset(&curve[j], 0, sizeof(curve[j]));
+			ret = do_work(&throughput_work, &curve[j]);
+			if (ret)
+				break;
+		}
+		if (ret)
+			break;
+
+		for (j = 0; j < nr_points; j++) {
+			struct throughput *tp = &curve[j];
+			double pct = curve[nr_points - 1].units_per_sec ?
+				100.0 * tp->units_per_sec / curve[nr_points - 1].units_per_sec : 0;
+
+			fprintf(stdout, "capacity %4lu uclamp_max %4u: %10.0f units/s (%5.1f%% of unclamped) IPC: %.2f freq: %.0f MHz\n",
+				cap, j * THROUGHPUT_STEP, tp->units_per_sec, pct, tp->ipc, tp->freq_mhz);
+			fprintf(file, "%lu, %u, %.0f, %.1f, %.2f, %.0f\n",
+				cap, j * THROUGHPUT_STEP, tp->units_per_sec, pct, tp->ipc, tp->freq_mhz);
+		}
+	}
+
+	fclose(file);
+	fprintf(stdout, "Created %s\n", THROUGHPUT_CSV_FILE);
+
+	/* Back to where the other tests run */
+	if (sched_setaffinity(0, sizeof(saved), &saved))
+		perror("Failed to restore affinity");
+
+	sched_attr->sched_util_min = 0;
+	sched_attr->sched_util_max = SCHED_CAPACITY_SCALE;
+	sched_attr->sched_flags = SCHED_FLAG_KEEP_ALL | SCHED_FLAG_UTIL_CLAMP;
+	if (sched_setattr(pid, sched_attr, 0))
+		perror("Failed to reset attr");
+
+	if (track_task(pid))
+		return -1;
+
+	return ret;
+}
+
 static int test_uclamp_max(void)
 {
 	struct sched_attr sched_attr;
@@ -381,60 +1720,1222 @@ static int test_uclamp_max(void)
 		do_busy_work();
 	}
 
-	return 0;
+	phase_end();
+
+	return test_throughput(&sched_attr);
 }
 
-static void *thread_loop(void *data)
+static int run_scenario(const char *path)
 {
+	struct sched_attr sched_attr;
+	unsigned long uclamp_min, uclamp_max;
+	struct workload w;
 	pid_t pid = gettid();
+	unsigned int i;
 	int ret;
 
-	skel->bss->pid = pid;
-
-	ret = get_capacities();
+	ret = workload_load(&w, path);
 	if (ret)
-		return NULL;
+		return ret;
 
-	while (!start)
-		usleep(5000);
+	ret = sched_getattr(pid, &sched_attr, sizeof(struct sched_attr), 0);
+	if (ret) {
+		perror("Failed to get attr");
+		fprintf(stderr, "Couldn't get schedattr for pid %d\n", pid);
+		goto out;
+	}
+	uclamp_min = sched_attr.sched_util_min;
+	uclamp_max = sched_attr.sched_util_max;
 
-	ret = test_uclamp_min();
+	fprintf(stdout, "--:: Running scenario %s ::--\n", path);
+
+	for (i = 0; i < w.nr_phases; i++) {
+		const struct workload_phase *ph = &w.phases[i];
+
+		if (ph->uclamp_min != WORKLOAD_UCLAMP_KEEP || ph->uclamp_max != WORKLOAD_UCLAMP_KEEP) {
+			if (ph->uclamp_min != WORKLOAD_UCLAMP_KEEP)
+				uclamp_min = ph->uclamp_min;
+			if (ph->uclamp_max != WORKLOAD_UCLAMP_KEEP)
+				uclamp_max = ph->uclamp_max;
+
+			ret = set_uclamp_values(&sched_attr, uclamp_min, uclamp_max);
+			if (ret)
+				goto out;
+		}
+
+		do_work(ph, NULL);
+	}
+
+out:
+	workload_free(&w);
+	return ret;
+}
+
+/* Every scale-out thread runs 4ms out of every 16ms */
+static const struct workload_phase scale_work = {
+	.name		= "scale",
+	.period_ns	= 16000000ULL,
+	.duty		= 25,
+	.run_ns		= NR_LOOPS * 16000000ULL,
+	.uclamp_min	= WORKLOAD_UCLAMP_KEEP,
+	.uclamp_max	= WORKLOAD_UCLAMP_KEEP,
+};
+
+static bool volatile scale_start = false;
+
+static void *scale_thread_fn(void *data)
+{
+	struct scale_thread *st = data;
+	struct sched_attr sched_attr;
+	struct workload_stats ws;
+	pid_t tid = gettid();
+	cpu_set_t cpuset;
+	int ret;
+
+	/* The events thread reads it */
+	pthread_mutex_lock(&scale_mutex);
+	st->tid = tid;
+	tid_table_add(&scale_tids, tid, st - scale_threads);
+	pthread_mutex_unlock(&scale_mutex);
+
+	if (st->cpu >= 0) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(st->cpu, &cpuset);
+		ret = sched_setaffinity(0, sizeof(cpuset), &cpuset);
+		if (ret)
+			perror("Failed to set affinity");
+	}
+
+	ret = sched_getattr(st->tid, &sched_attr, sizeof(struct sched_attr), 0);
+	if (!ret) {
+		sched_attr.sched_util_min = st->uclamp_min;
+		sched_attr.sched_util_max = st->uclamp_max;
+		sched_attr.sched_flags = SCHED_FLAG_KEEP_ALL | SCHED_FLAG_UTIL_CLAMP;
+		ret = sched_setattr(st->tid, &sched_attr, 0);
+	}
+	if (ret) {
+		perror("Failed to set attr");
+		fprintf(stderr, "Couldn't set schedattr for pid %d: uclamp_min: %lu uclamp_max: %lu\n",
+			st->tid, st->uclamp_min, st->uclamp_max);
+		st->rejected = true;
+		return NULL;
+	}
+
+	track_task(st->tid);
+
+	/* Start all the threads of the step together */
+	while (!scale_start)
+		usleep(1000);
+
+	if (!workload_run_phase(&scale_work, &ws))
+		st->overruns = ws.overruns;
+	workload_free_stats(&ws);
+
+	untrack_task(st->tid);
+
+	return NULL;
+}
+
+static void print_scale_step(int nr)
+{
+	unsigned long long events = 0, failed = 0, rq_util_sum = 0;
+	unsigned long cap;
+	int i, j;
+
+	fprintf(stdout, "%8s %10s %10s %4s %9s %10s %8s %11s %12s  placement\n",
+		"tid", "uclamp_min", "uclamp_max", "cpu", "overruns", "events",
+		"failed", "p_util_avg", "rq_util_avg");
+
+	pthread_mutex_lock(&scale_mutex);
+	for (i = 0; i < nr; i++) {
+		struct scale_thread *st = &scale_threads[i];
+
+		fprintf(stdout, "%8d %10lu %10lu %4d %9llu %10llu %8llu %11llu %12llu ",
+			st->tid, st->uclamp_min, st->uclamp_max, st->cpu,
+			st->overruns, st->events, st->failed,
+			st->events ? st->p_util_sum / st->events : 0,
+			st->events ? st->rq_util_sum / st->events : 0);
+
+		for_each_capacity(cap, j) {
+			fprintf(stdout, " %lu:%.0f%%", cap,
+				st->events ? 100.0 * st->cluster_events[j] / st->events : 0);
+		}
+		fprintf(stdout, "\n");
+
+		events += st->events;
+		failed += st->failed;
+		rq_util_sum += st->rq_util_sum;
+	}
+	pthread_mutex_unlock(&scale_mutex);
+
+	fprintf(stdout, "%d threads: %llu events, %llu failed (%.2f%%), mean rq_util_avg: %llu\n",
+		nr, events, failed, events ? 100.0 * failed / events : 0,
+		events ? rq_util_sum / events : 0);
+}
+
+static unsigned long long *scale_cluster_events;
+
+static int scale_alloc(int nr)
+{
+	scale_threads = calloc(nr, sizeof(*scale_threads));
+	scale_cluster_events = calloc(nr * capacities.len, sizeof(*scale_cluster_events));
+	if (!scale_threads || !scale_cluster_events) {
+		perror("Failed to allocate scale-out threads");
+		free(scale_threads);
+		free(scale_cluster_events);
+		scale_threads = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void scale_free(void)
+{
+	pthread_mutex_lock(&scale_mutex);
+	scale_nr_running = 0;
+	pthread_mutex_unlock(&scale_mutex);
+
+	free(scale_cluster_events);
+	free(scale_threads);
+	scale_threads = NULL;
+}
+
+/*
+ * Clear the stats of the first nr threads, the caller then sets their uclamp
+ * values and affinity before run_scale_threads().
+ */
+static void scale_reset(int nr)
+{
+	int i;
+
+	pthread_mutex_lock(&scale_mutex);
+	memset(scale_threads, 0, nr * sizeof(*scale_threads));
+	memset(&scale_tids, 0, sizeof(scale_tids));
+	memset(scale_cluster_events, 0, nr * capacities.len * sizeof(*scale_cluster_events));
+	for (i = 0; i < nr; i++) {
+		scale_threads[i].cpu = -1;
+		scale_threads[i].cluster_events = &scale_cluster_events[i * capacities.len];
+	}
+	scale_nr_running = nr;
+	pthread_mutex_unlock(&scale_mutex);
+}
+
+/*
+ * Run the first nr threads together and return how many could be started.
+ */
+static int run_scale_threads(int nr)
+{
+	int i, ret;
+
+	scale_start = false;
+	for (i = 0; i < nr; i++) {
+		ret = pthread_create(&scale_threads[i].thread, NULL,
+				     scale_thread_fn, &scale_threads[i]);
+		if (ret) {
+			perror("Failed to create scale-out thread");
+			nr = i;
+			break;
+		}
+	}
+	scale_start = true;
+
+	for (i = 0; i < nr; i++)
+		pthread_join(scale_threads[i].thread, NULL);
+
+	/* Let the events thread drain what's left for this step */
+	usleep(200000);
+
+	return nr;
+}
+
+/*
+ * Threads alternate between being boosted to and capped at each capacity in
+ * turn, so every step mixes boosts and caps on the same runqueues.
+ */
+static int run_scale_out(void)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nr, i, ret = 0;
+
+	if (scale_alloc(nr_scale_threads))
+		return -1;
+
+	for (nr = 1; ; nr *= 2) {
+		if (nr > nr_scale_threads)
+			nr = nr_scale_threads;
+
+		fprintf(stdout, "--:: Scale-out %d threads ::--\n", nr);
+
+		scale_reset(nr);
+		for (i = 0; i < nr; i++) {
+			struct scale_thread *st = &scale_threads[i];
+			unsigned long cap = capacities.cap[(i / 2) % capacities.len];
+
+			st->cpu = scale_pin ? i % nr_cpus : -1;
+			st->uclamp_min = i % 2 ? 0 : cap;
+			st->uclamp_max = i % 2 ? cap : 1024;
+		}
+
+		i = run_scale_threads(nr);
+		if (i < nr)
+			ret = -1;
+
+		print_scale_step(i);
+
+		if (ret || nr == nr_scale_threads)
+			break;
+	}
+
+	scale_free();
+	return ret;
+}
+
+/*
+ * cgroup mode: trees of depth 1, 2, ... cgroup_depth are built in turn. In
+ * each, going down from the base, the first group of every level gets its
+ * max and its min CGROUP_CLAMP_STEP below the level above, so that every
+ * change narrows the effective clamps of a smaller subtree. The clamps are
+ * then reset going back up. Every write is timed, and so is how long until
+ * the threads it changes the effective clamps of are seen with them.
+ *
+ * The write itself updates the clamps of the runnable tasks before it
+ * returns, write_us is the propagation cost. A thread is only seen at its
+ * next enqueue though, so the observed times mostly measure how long until
+ * it wakes up, not how long the kernel took.
+ */
+#define CGROUP_CLAMP_STEP		128
+#define CGROUP_CONVERGE_TIMEOUT_NS	(1000 * 1000000ULL)
+#define CGROUP_CSV_FILE		"uclamp_test_thermal_pressure_cgroup.csv"
+#define CGROUP_CSV_HEADER	"depth, fanout, groups, threads, level, knob, value, affected, write_us, observed_mean_us, observed_max_us, not_converged, mismatches\n"
+
+/* Thread i requests cgroup_task_req[i % NR_CGROUP_TASK_REQ] */
+#define NR_CGROUP_TASK_REQ	5
+static const unsigned long cgroup_task_req[NR_CGROUP_TASK_REQ][2] = {
+	{ 0, 1024 }, { 384, 1024 }, { 768, 1024 }, { 0, 640 }, { 384, 640 },
+};
+
+/* Same duty cycle as scale-out, run until cgroup_stop */
+static const struct workload_phase cgroup_work = {
+	.name		= "cgroup",
+	.period_ns	= 16000000ULL,
+	.duty		= 25,
+	.run_ns		= 10 * 16000000ULL,
+	.uclamp_min	= WORKLOAD_UCLAMP_KEEP,
+	.uclamp_max	= WORKLOAD_UCLAMP_KEEP,
+};
+
+static bool volatile cgroup_stop = false;
+
+struct cgroup_step_stats {
+	int affected;
+	int not_converged;
+	unsigned long long write_ns;
+	/* From the write to the first enqueue with the new clamps */
+	unsigned long long observed_mean_ns;
+	unsigned long long observed_max_ns;
+	unsigned long long mismatches;
+};
+
+/* What lowering the base cpu.uclamp.max cost, and the totals of the tree */
+struct cgroup_summary {
+	int groups;
+	int threads;
+	struct cgroup_step_stats base;
+	unsigned long long mismatches;
+	int not_converged;
+};
+
+static void *cgroup_thread_fn(void *data)
+{
+	struct cgroup_thread *ct = data;
+	struct sched_attr sched_attr;
+	struct workload_stats ws;
+	pid_t tid = gettid();
+	int ret;
+
+	/* The events thread reads it */
+	pthread_mutex_lock(&cgroup_mutex);
+	ct->tid = tid;
+	tid_table_add(&cgroup_tids, tid, ct - cgroup_threads);
+	pthread_mutex_unlock(&cgroup_mutex);
+
+	ret = sched_getattr(ct->tid, &sched_attr, sizeof(struct sched_attr), 0);
+	if (!ret) {
+		sched_attr.sched_util_min = ct->req_min;
+		sched_attr.sched_util_max = ct->req_max;
+		sched_attr.sched_flags = SCHED_FLAG_KEEP_ALL | SCHED_FLAG_UTIL_CLAMP;
+		ret = sched_setattr(ct->tid, &sched_attr, 0);
+		if (ret)
+			perror("Failed to set attr");
+	}
+	if (!ret)
+		ret = uclamp_cgroup_attach_thread(&cgroup_tree, ct->leaf, ct->tid);
+	if (!ret)
+		ret = track_task(ct->tid);
+	if (ret) {
+		fprintf(stderr, "Couldn't start pid %d in %s\n", ct->tid, cgroup_tree.path[ct->leaf]);
+		ct->rejected = true;
+		ct->ready = true;
+		return NULL;
+	}
+
+	ct->ready = true;
+
+	while (!cgroup_stop) {
+		ret = workload_run_phase(&cgroup_work, &ws);
+		workload_free_stats(&ws);
+		if (ret)
+			break;
+	}
+
+	untrack_task(ct->tid);
+
+	return NULL;
+}
+
+/*
+ * Work out the effective clamps of the first nr threads from the tree and
+ * reset the threads they change. Called with cgroup_mutex held.
+ */
+static int cgroup_update_expected(int nr)
+{
+	int i, affected = 0;
+
+	for (i = 0; i < nr; i++) {
+		struct cgroup_thread *ct = &cgroup_threads[i];
+		unsigned long eff_min = uclamp_cgroup_task_eff(&cgroup_tree, ct->leaf, ct->req_min);
+		unsigned long eff_max = uclamp_cgroup_task_eff(&cgroup_tree, ct->leaf, ct->req_max);
+
+		ct->mismatches = 0;
+		ct->affected = !ct->rejected &&
+			       (eff_min != ct->eff_min || eff_max != ct->eff_max);
+		if (!ct->affected)
+			continue;
+
+		ct->eff_min = eff_min;
+		ct->eff_max = eff_max;
+		ct->converged_ts = 0;
+		affected++;
+	}
+
+	return affected;
+}
+
+static int cgroup_nr_pending(int nr)
+{
+	int i, pending = 0;
+
+	pthread_mutex_lock(&cgroup_mutex);
+	for (i = 0; i < nr; i++) {
+		if (cgroup_threads[i].affected && !cgroup_threads[i].converged_ts)
+			pending++;
+	}
+	pthread_mutex_unlock(&cgroup_mutex);
+
+	return pending;
+}
+
+/* Wait for the affected threads to be enqueued with their new clamps */
+static void cgroup_converge(int nr, struct cgroup_step_stats *ss)
+{
+	unsigned long long deadline, lat, sum = 0;
+	int i;
+
+	deadline = now_ns() + CGROUP_CONVERGE_TIMEOUT_NS;
+	while (cgroup_nr_pending(nr) && now_ns() < deadline)
+		usleep(1000);
+
+	pthread_mutex_lock(&cgroup_mutex);
+	for (i = 0; i < nr; i++) {
+		struct cgroup_thread *ct = &cgroup_threads[i];
+
+		ss->mismatches += ct->mismatches;
+		if (!ct->affected)
+			continue;
+		if (!ct->converged_ts) {
+			ss->not_converged++;
+			continue;
+		}
+
+		lat = ct->converged_ts > cgroup_change_ts ? ct->converged_ts - cgroup_change_ts : 0;
+		sum += lat;
+		if (lat > ss->observed_max_ns)
+			ss->observed_max_ns = lat;
+	}
+	pthread_mutex_unlock(&cgroup_mutex);
+
+	if (ss->affected > ss->not_converged)
+		ss->observed_mean_ns = sum / (ss->affected - ss->not_converged);
+}
+
+static int cgroup_step(int nr, int level, enum uclamp_cgroup_knob knob, unsigned long value,
+		       FILE *csv, struct cgroup_step_stats *ss)
+{
+	struct uclamp_cgroup_tree *t = &cgroup_tree;
+	int node = uclamp_cgroup_level_first(t, level);
+
+	memset(ss, 0, sizeof(*ss));
+
+	/* Events enqueued from now on may already have the new clamps */
+	pthread_mutex_lock(&cgroup_mutex);
+	uclamp_cgroup_set_req(t, node, knob, value);
+	ss->affected = cgroup_update_expected(nr);
+	cgroup_change_ts = now_ns();
+	pthread_mutex_unlock(&cgroup_mutex);
+
+	if (uclamp_cgroup_write_knob(t, node, knob, &ss->write_ns))
+		return -1;
+
+	cgroup_converge(nr, ss);
+
+	fprintf(stdout, "level %d %s=%lu: %d/%d threads affected, write: %llu us, observed after mean: %llu us max: %llu us, %d not converged, %llu mismatches\n",
+		level, uclamp_cgroup_names[knob], value, ss->affected, nr,
+		ss->write_ns / 1000, ss->observed_mean_ns / 1000, ss->observed_max_ns / 1000,
+		ss->not_converged, ss->mismatches);
+
+	if (csv) {
+		fprintf(csv, "%d, %d, %d, %d, %d, %s, %lu, %d, %llu, %llu, %llu, %d, %llu\n",
+			t->depth, t->fanout, t->nr_nodes, nr, level,
+			uclamp_cgroup_names[knob], value, ss->affected,
+			ss->write_ns / 1000, ss->observed_mean_ns / 1000, ss->observed_max_ns / 1000,
+			ss->not_converged, ss->mismatches);
+	}
+
+	return 0;
+}
+
+/* A min above max is fine, the effective min is capped by the max */
+static unsigned long cgroup_level_clamp(int depth, int level, enum uclamp_cgroup_knob knob)
+{
+	long value;
+
+	if (knob == UCLAMP_CGROUP_MIN)
+		value = (long)CGROUP_CLAMP_STEP * (depth - level + 1);
+	else
+		value = SCHED_CAPACITY_SCALE - (long)CGROUP_CLAMP_STEP * (level + 1);
+
+	if (value < 0)
+		return 0;
+	return value < SCHED_CAPACITY_SCALE ? value : SCHED_CAPACITY_SCALE;
+}
+
+static int run_cgroup_depth(int depth, FILE *csv, struct cgroup_summary *sum)
+{
+	struct uclamp_cgroup_tree *t = &cgroup_tree;
+	struct cgroup_step_stats ss = {};
+	int nr, started, first, level, i, ret;
+
+	if (uclamp_cgroup_tree_create(t, depth, cgroup_fanout))
+		return -1;
+
+	ret = uclamp_cgroup_enter(t);
+	if (ret)
+		goto out_destroy;
+
+	nr = uclamp_cgroup_nr_leaves(t);
+	first = uclamp_cgroup_level_first(t, depth);
+
+	fprintf(stdout, "--:: cgroup depth %d fan-out %d: %d groups, %d threads ::--\n",
+		depth, cgroup_fanout, t->nr_nodes, nr);
+
+	pthread_mutex_lock(&cgroup_mutex);
+	memset(cgroup_threads, 0, nr * sizeof(*cgroup_threads));
+	memset(&cgroup_tids, 0, sizeof(cgroup_tids));
+	for (i = 0; i < nr; i++) {
+		struct cgroup_thread *ct = &cgroup_threads[i];
+
+		ct->leaf = first + i;
+		ct->req_min = cgroup_task_req[i % NR_CGROUP_TASK_REQ][0];
+		ct->req_max = cgroup_task_req[i % NR_CGROUP_TASK_REQ][1];
+		/* Not a valid clamp, every thread is affected by the first update */
+		ct->eff_min = ct->eff_max = ULONG_MAX;
+	}
+	cgroup_nr_running = nr;
+	pthread_mutex_unlock(&cgroup_mutex);
+
+	cgroup_stop = false;
+	for (started = 0; started < nr; started++) {
+		ret = pthread_create(&cgroup_threads[started].thread, NULL,
+				     cgroup_thread_fn, &cgroup_threads[started]);
+		if (ret) {
+			perror("Failed to create cgroup thread");
+			break;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		while (!cgroup_threads[i].ready)
+			usleep(1000);
+	}
+
+	/* The threads must report their own requests before anything changes */
+	if (!ret) {
+		pthread_mutex_lock(&cgroup_mutex);
+		ss.affected = cgroup_update_expected(nr);
+		cgroup_change_ts = now_ns();
+		pthread_mutex_unlock(&cgroup_mutex);
+
+		cgroup_converge(nr, &ss);
+		if (ss.not_converged)
+			fprintf(stderr, "%d threads didn't report their clamps\n", ss.not_converged);
+	}
+
+	memset(sum, 0, sizeof(*sum));
+	sum->groups = t->nr_nodes;
+	sum->threads = nr;
+
+	for (level = 0; !ret && level <= depth; level++) {
+		ret = cgroup_step(nr, level, UCLAMP_CGROUP_MAX,
+				  cgroup_level_clamp(depth, level, UCLAMP_CGROUP_MAX), csv, &ss);
+		if (ret)
+			break;
+		if (!level)
+			sum->base = ss;
+		sum->mismatches += ss.mismatches;
+		sum->not_converged += ss.not_converged;
+
+		ret = cgroup_step(nr, level, UCLAMP_CGROUP_MIN,
+				  cgroup_level_clamp(depth, level, UCLAMP_CGROUP_MIN), csv, &ss);
+		sum->mismatches += ss.mismatches;
+		sum->not_converged += ss.not_converged;
+	}
+
+	for (level = depth; !ret && level >= 0; level--) {
+		ret = cgroup_step(nr, level, UCLAMP_CGROUP_MIN, 0, csv, &ss);
+		if (ret)
+			break;
+		sum->mismatches += ss.mismatches;
+		sum->not_converged += ss.not_converged;
+
+		ret = cgroup_step(nr, level, UCLAMP_CGROUP_MAX, SCHED_CAPACITY_SCALE, csv, &ss);
+		sum->mismatches += ss.mismatches;
+		sum->not_converged += ss.not_converged;
+	}
+
+	cgroup_stop = true;
+	for (i = 0; i < started; i++)
+		pthread_join(cgroup_threads[i].thread, NULL);
+
+	/* Let the events thread drain what's left for this tree */
+	usleep(200000);
+
+	pthread_mutex_lock(&cgroup_mutex);
+	cgroup_nr_running = 0;
+	pthread_mutex_unlock(&cgroup_mutex);
+
+	if (uclamp_cgroup_leave(t))
+		ret = -1;
+out_destroy:
+	uclamp_cgroup_tree_destroy(t);
+	return ret ? -1 : 0;
+}
+
+static int run_cgroup(void)
+{
+	struct cgroup_summary summary[CGROUP_MAX_DEPTH + 1];
+	int depth, nr, ret = 0;
+	FILE *csv;
+
+	nr = uclamp_cgroup_nr_nodes(cgroup_depth, cgroup_fanout) -
+	     uclamp_cgroup_nr_nodes(cgroup_depth - 1, cgroup_fanout);
+	cgroup_threads = calloc(nr, sizeof(*cgroup_threads));
+	if (!cgroup_threads) {
+		perror("Failed to allocate cgroup threads");
+		return -1;
+	}
+
+	csv = fopen(CGROUP_CSV_FILE, "w");
+	if (!csv)
+		fprintf(stderr, "Failed to create %s file\n", CGROUP_CSV_FILE);
+	else
+		fprintf(csv, CGROUP_CSV_HEADER);
+
+	for (depth = 1; depth <= cgroup_depth; depth++) {
+		ret = run_cgroup_depth(depth, csv, &summary[depth]);
+		if (ret)
+			break;
+	}
+
+	if (csv) {
+		fclose(csv);
+		fprintf(stdout, "Created %s\n", CGROUP_CSV_FILE);
+	}
+
+	fprintf(stdout, "--:: cgroup base %s change ::--\n", uclamp_cgroup_names[UCLAMP_CGROUP_MAX]);
+	fprintf(stdout, "%5s %7s %7s %8s %9s %16s %15s %13s %10s\n",
+		"depth", "groups", "threads", "affected", "write_us", "observed_mean_us",
+		"observed_max_us", "not_converged", "mismatches");
+	for (nr = 1; nr < depth; nr++) {
+		struct cgroup_summary *s = &summary[nr];
+
+		fprintf(stdout, "%5d %7d %7d %8d %9llu %16llu %15llu %13d %10llu\n",
+			nr, s->groups, s->threads, s->base.affected, s->base.write_ns / 1000,
+			s->base.observed_mean_ns / 1000, s->base.observed_max_ns / 1000,
+			s->not_converged, s->mismatches);
+	}
+
+	free(cgroup_threads);
+	cgroup_threads = NULL;
+	return ret;
+}
+
+/*
+ * Grid sweep: one cell per (uclamp_min, uclamp_max) pair, grid_jobs cells run
+ * concurrently on scale-out threads. The threads are not pinned, placement is
+ * what's being measured.
+ *
+ * Cells running together share the CPUs and change each other's placement
+ * and rq signals, so only one runs at a time unless asked otherwise.
+ */
+#define MAX_GRID_VALUES		32
+#define GRID_CSV_FILE		"uclamp_test_thermal_pressure_grid.csv"
+#define GRID_CSV_HEADER		"uclamp_min, uclamp_max, rejected, events, failed, correct_pct, p_util_avg, cap_util\n"
+
+struct grid_cell {
+	bool rejected;
+	unsigned long long events;
+	unsigned long long failed;
+	unsigned long long p_util_sum;
+	unsigned long long cap_util_sum;
+};
+
+static unsigned long grid_min[MAX_GRID_VALUES];
+static unsigned long grid_max[MAX_GRID_VALUES];
+static int nr_grid_min = 0;
+static int nr_grid_max = 0;
+static int grid_jobs = 1;
+
+static int parse_grid_list(const char *str, const char *end, unsigned long *values)
+{
+	int nr = 0;
+	char *p;
+
+	while (str < end) {
+		if (nr == MAX_GRID_VALUES)
+			return -1;
+
+		values[nr] = strtoul(str, &p, 0);
+		if (p == str || values[nr] > SCHED_CAPACITY_SCALE)
+			return -1;
+		nr++;
+
+		str = p;
+		if (str < end && *str++ != ',')
+			return -1;
+	}
+
+	return nr ? nr : -1;
+}
+
+/*
+ * MIN_LIST[:MAX_LIST], comma separated values. The same list is used for both
+ * axes if MAX_LIST is omitted.
+ */
+static int parse_grid(const char *spec)
+{
+	const char *sep = strchr(spec, ':');
+	const char *end = spec + strlen(spec);
+
+	nr_grid_min = parse_grid_list(spec, sep ? sep : end, grid_min);
+	if (sep)
+		nr_grid_max = parse_grid_list(sep + 1, end, grid_max);
+	else
+		nr_grid_max = parse_grid_list(spec, end, grid_max);
+
+	if (nr_grid_min < 0 || nr_grid_max < 0) {
+		fprintf(stderr, "Invalid grid %s\n", spec);
+		return -1;
+	}
+
+	return 0;
+}
+
+static double grid_correct_pct(const struct grid_cell *c)
+{
+	return c->events ? 100.0 * (c->events - c->failed) / c->events : 0;
+}
+
+static void print_grid_matrix(const char *name, struct grid_cell *cells,
+			      double (*value)(const struct grid_cell *))
+{
+	int i, j;
+
+	fprintf(stdout, "%s (rows: uclamp_min, columns: uclamp_max)\n%10s", name, "");
+	for (j = 0; j < nr_grid_max; j++)
+		fprintf(stdout, " %8lu", grid_max[j]);
+	fprintf(stdout, "\n");
+
+	for (i = 0; i < nr_grid_min; i++) {
+		fprintf(stdout, "%10lu", grid_min[i]);
+		for (j = 0; j < nr_grid_max; j++) {
+			struct grid_cell *c = &cells[i * nr_grid_max + j];
+
+			if (c->rejected)
+				fprintf(stdout, " %8s", "rej");
+			else if (!c->events)
+				fprintf(stdout, " %8s", "-");
+			else
+				fprintf(stdout, " %8.1f", value(c));
+		}
+		fprintf(stdout, "\n");
+	}
+}
+
+static double grid_p_util_avg(const struct grid_cell *c)
+{
+	return (double)c->p_util_sum / c->events;
+}
+
+/*
+ * p_util_avg * capacity_orig / 1024, how much of the biggest CPU the task
+ * used. Only a hint of the energy cost: it ignores the OPPs and the energy
+ * model.
+ */
+static double grid_cap_util(const struct grid_cell *c)
+{
+	return (double)c->cap_util_sum / c->events;
+}
+
+static int run_grid(void)
+{
+	int nr_cells = nr_grid_min * nr_grid_max;
+	struct grid_cell *cells;
+	int cell, nr, i, ret = 0;
+	FILE *file;
+
+	if (grid_jobs > 1)
+		fprintf(stderr, "Warning: %d cells run concurrently and interfere with each other\n",
+			grid_jobs);
+
+	cells = calloc(nr_cells, sizeof(*cells));
+	if (!cells) {
+		perror("Failed to allocate grid");
+		return -1;
+	}
+
+	if (scale_alloc(grid_jobs)) {
+		free(cells);
+		return -1;
+	}
+
+	for (cell = 0; cell < nr_cells; cell += nr) {
+		nr = nr_cells - cell < grid_jobs ? nr_cells - cell : grid_jobs;
+
+		fprintf(stdout, "--:: Grid cells %d-%d of %d ::--\n", cell + 1, cell + nr, nr_cells);
+
+		scale_reset(nr);
+		for (i = 0; i < nr; i++) {
+			scale_threads[i].uclamp_min = grid_min[(cell + i) / nr_grid_max];
+			scale_threads[i].uclamp_max = grid_max[(cell + i) % nr_grid_max];
+		}
+
+		if (run_scale_threads(nr) < nr) {
+			ret = -1;
+			break;
+		}
+
+		pthread_mutex_lock(&scale_mutex);
+		for (i = 0; i < nr; i++) {
+			struct scale_thread *st = &scale_threads[i];
+			struct grid_cell *c = &cells[cell + i];
+
+			c->rejected = st->rejected;
+			c->events = st->events;
+			c->failed = st->failed;
+			c->p_util_sum = st->p_util_sum;
+			c->cap_util_sum = st->cap_util_sum;
+		}
+		pthread_mutex_unlock(&scale_mutex);
+	}
+
+	scale_free();
+
+	if (ret)
+		goto out;
+
+	print_grid_matrix("Placement correct %", cells, grid_correct_pct);
+	print_grid_matrix("Mean p_util_avg", cells, grid_p_util_avg);
+	print_grid_matrix("Mean p_util_avg * capacity_orig / 1024", cells, grid_cap_util);
+
+	file = fopen(GRID_CSV_FILE, "w");
+	if (!file) {
+		fprintf(stderr, "Failed to create %s file\n", GRID_CSV_FILE);
+		goto out;
+	}
+
+	fprintf(file, GRID_CSV_HEADER);
+	for (cell = 0; cell < nr_cells; cell++) {
+		struct grid_cell *c = &cells[cell];
+
+		fprintf(file, "%lu, %lu, %d, %llu, %llu, %.2f, %.1f, %.1f\n",
+			grid_min[cell / nr_grid_max], grid_max[cell % nr_grid_max],
+			c->rejected, c->events, c->failed, grid_correct_pct(c),
+			c->events ? grid_p_util_avg(c) : 0,
+			c->events ? grid_cap_util(c) : 0);
+	}
+	fclose(file);
+	fprintf(stdout, "Created %s\n", GRID_CSV_FILE);
+
+out:
+	free(cells);
+	return ret;
+}
+
+static void *thread_loop(void *data)
+{
+	pid_t pid = gettid();
+	int ret;
+
+	ret = get_capacities();
 	if (ret)
 		return NULL;
 
-	ret = test_uclamp_max();
+	/* Throughput is still reported in work units without them */
+	perf_counters_open(&counters);
+
+	while (!start)
+		usleep(5000);
+
+	ret = track_task(pid);
 	if (ret)
 		return NULL;
 
+	if (nr_grid_min) {
+		ret = run_grid();
+		if (ret)
+			return NULL;
+	} else if (nr_scale_threads) {
+		ret = run_scale_out();
+		if (ret)
+			return NULL;
+	} else if (cgroup_depth) {
+		ret = run_cgroup();
+		if (ret)
+			return NULL;
+	} else if (scenario_file) {
+		ret = run_scenario(scenario_file);
+		if (ret)
+			return NULL;
+	} else {
+		ret = test_uclamp_min();
+		if (ret)
+			return NULL;
+
+		ret = test_uclamp_max();
+		if (ret)
+			return NULL;
+	}
+
+	phase_end();
+	perf_counters_close(&counters);
+
 	pr_debug("thread_loop pid: %u\n", pid);
 
 	return NULL;
 }
 
-int main(int argc, char **argv)
+/*
+ * Open the skeleton with either the fexit or the kprobe programs enabled and
+ * apply the configuration that must be done before load.
+ */
+static int open_skel(bool use_fentry)
 {
-	INIT_EVENT_THREAD(rq_pelt);
-	INIT_EVENT_THREAD(select_task_rq_fair);
-	INIT_EVENT_THREAD(compute_energy);
-	pthread_t thread;
 	int ret;
 
 	skel = uclamp_test_thermal_pressure_bpf__open();
 	if (!skel) {
-		fprintf(stderr, "Failed to open and load BPF skeleton\n");
+		fprintf(stderr, "Failed to open BPF skeleton\n");
+		return -1;
+	}
+
+	bpf_program__set_autoload(skel->progs.fexit_enqueue_task_fair, use_fentry);
+	bpf_program__set_autoload(skel->progs.fexit_select_task_rq_fair, use_fentry);
+	bpf_program__set_autoload(skel->progs.kprobe_enqueue_task_fair, !use_fentry);
+	bpf_program__set_autoload(skel->progs.kretprobe_enqueue_task_fair, !use_fentry);
+	bpf_program__set_autoload(skel->progs.kprobe_select_task_rq_fair, !use_fentry);
+	bpf_program__set_autoload(skel->progs.kretprobe_select_task_rq_fair, !use_fentry);
+
+	if (aggregate) {
+		skel->bss->aggregate = true;
+		ret = bpf_map__set_max_entries(skel->maps.rq_pelt_hist_map,
+					       libbpf_num_possible_cpus() * UCLAMP_BUCKETS * UCLAMP_BUCKETS);
+		if (ret) {
+			fprintf(stderr, "Failed to size rq_pelt_hist_map: %d\n", ret);
+			goto err;
+		}
+	}
+
+	skel->bss->wakeup_records = wakeup_records;
+
+	ret = rb_set_size();
+	if (ret)
+		goto err;
+
+	return 0;
+err:
+	uclamp_test_thermal_pressure_bpf__destroy(skel);
+	skel = NULL;
+	return ret;
+}
+
+/*
+ * The fexit programs get their arguments by position, with the return value
+ * right after them. select_task_rq_fair() had an extra sd_flag argument
+ * before 5.10, so check the kernel has the prototypes they were written for.
+ */
+static const struct {
+	const char *name;
+	unsigned int nr_args;
+} fexit_funcs[] = {
+	{ "enqueue_task_fair",		3 },
+	{ "select_task_rq_fair",	3 },
+};
+
+static bool fexit_protos_match(void)
+{
+	const struct btf_type *t;
+	bool match = true;
+	struct btf *btf;
+	unsigned int i;
+	int id;
+
+	btf = btf__load_vmlinux_btf();
+	if (libbpf_get_error(btf)) {
+		fprintf(stderr, "No kernel BTF\n");
+		return false;
+	}
+
+	for (i = 0; i < sizeof(fexit_funcs) / sizeof(fexit_funcs[0]); i++) {
+		id = btf__find_by_name_kind(btf, fexit_funcs[i].name, BTF_KIND_FUNC);
+		if (id < 0) {
+			fprintf(stderr, "%s() not in kernel BTF\n", fexit_funcs[i].name);
+			match = false;
+			break;
+		}
+
+		t = btf__type_by_id(btf, btf__type_by_id(btf, id)->type);
+		if (!t || !btf_is_func_proto(t) || btf_vlen(t) != fexit_funcs[i].nr_args) {
+			fprintf(stderr, "%s() takes %u arguments, expected %u\n",
+				fexit_funcs[i].name, t ? btf_vlen(t) : 0, fexit_funcs[i].nr_args);
+			match = false;
+			break;
+		}
+	}
+
+	btf__free(btf);
+	return match;
+}
+
+/*
+ * Prefer fentry/fexit, they're much cheaper than kretprobes on the hot path
+ * we are measuring. Use kprobes if the kernel functions don't have the
+ * prototypes the fexit programs expect.
+ */
+static int open_and_load_skel(bool force_kprobes)
+{
+	int ret;
+
+	if (!force_kprobes && !fexit_protos_match()) {
+		fprintf(stderr, "fentry/fexit can't be used, falling back to kprobes\n");
+		force_kprobes = true;
+	}
+
+	ret = open_skel(!force_kprobes);
+	if (ret)
+		return ret;
+
+	ret = uclamp_test_thermal_pressure_bpf__load(skel);
+	if (ret) {
+		fprintf(stderr, "Failed to load and verify BPF skeleton%s\n",
+			force_kprobes ? "" : ", try --kprobes");
+		uclamp_test_thermal_pressure_bpf__destroy(skel);
+		skel = NULL;
+		return ret;
+	}
+
+	fprintf(stdout, "Using %s probes\n", force_kprobes ? "kprobe/kretprobe" : "fentry/fexit");
+	return 0;
+}
+
+static const struct option long_options[] = {
+	{ "aggregate",	no_argument,		0, 'a' },
+	{ "kprobes",	no_argument,		0, 'k' },
+	{ "overhead",	no_argument,		0, 'o' },
+	{ "record",	required_argument,	0, 'r' },
+	{ "scenario",	required_argument,	0, 's' },
+	{ "threads",	required_argument,	0, 'n' },
+	{ "pin",	no_argument,		0, 'p' },
+	{ "grid",	required_argument,	0, 'g' },
+	{ "jobs",	required_argument,	0, 'j' },
+	{ "wakeup",	no_argument,		0, 'w' },
+	{ "rb-size",	required_argument,	0, 'b' },
+	{ "rb-wakeup",	required_argument,	0, 'W' },
+	{ "cgroup",	required_argument,	0, 'c' },
+	{ "help",	no_argument,		0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS]\n", prog);
+	fprintf(stderr, "  -a, --aggregate\t\tAggregate rq PELT signals in BPF, report once per phase\n");
+	fprintf(stderr, "  -k, --kprobes\t\tUse kprobes even if fentry/fexit are supported\n");
+	fprintf(stderr, "  -o, --overhead\t\tReport BPF programs runtime per phase and probes slowdown\n");
+	fprintf(stderr, "  -r, --record FILE\tRecord raw events into binary FILE instead of CSV\n");
+	fprintf(stderr, "  -s, --scenario FILE\tRun the phases in FILE instead of the built-in tests, see workload.h\n");
+	fprintf(stderr, "  -n, --threads N\tScale-out: run 1, 2, 4, ... N threads with different uclamp values\n");
+	fprintf(stderr, "  -p, --pin\t\tScale-out: pin thread i to CPU i %% nr_cpus\n");
+	fprintf(stderr, "  -g, --grid MIN[:MAX]\tSweep every (uclamp_min, uclamp_max) pair of the comma separated lists\n");
+	fprintf(stderr, "  -j, --jobs N\t\tGrid: number of cells run concurrently, they interfere (default: 1)\n");
+	fprintf(stderr, "  -w, --wakeup\t\tEmit one combined record per wakeup instead of one per probe\n");
+	fprintf(stderr, "  -b, --rb-size KB	Size of every ring buffer, a power of 2 multiple of the page size (default: %d)\n",
+		RB_SIZE / 1024);
+	fprintf(stderr, "  -W, --rb-wakeup PCT	Wake the consumer up once a ring buffer is PCT%% full, 0 on every event (default: %d)\n",
+		RB_WAKEUP_PCT);
+	fprintf(stderr, "  -c, --cgroup DEPTH:FANOUT	Clamp threads through cgroup trees of depth 1 to DEPTH, one thread per leaf\n");
+	fprintf(stderr, "  -h, --help\t\tShow this help\n");
+}
+
+int main(int argc, char **argv)
+{
+	INIT_EVENTS_THREAD();
+	pthread_t thread;
+	bool events_started = false;
+	const char *record_file = NULL;
+	bool force_kprobes = false;
+	bool threads_set = false;
+	int ret, opt;
+
+	while ((opt = getopt_long(argc, argv, "akor:s:n:pg:j:wb:W:c:h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			aggregate = true;
+			break;
+		case 'k':
+			force_kprobes = true;
+			break;
+		case 'o':
+			overhead = true;
+			break;
+		case 'r':
+			record_file = optarg;
+			break;
+		case 's':
+			scenario_file = optarg;
+			break;
+		case 'n':
+			nr_scale_threads = atoi(optarg);
+			threads_set = true;
+			break;
+		case 'p':
+			scale_pin = true;
+			break;
+		case 'g':
+			if (parse_grid(optarg))
+				return EXIT_FAILURE;
+			break;
+		case 'j':
+			grid_jobs = atoi(optarg);
+			break;
+		case 'w':
+			wakeup_records = true;
+			break;
+		case 'b':
+			rb_size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'W':
+			rb_wakeup_pct = atoi(optarg);
+			break;
+		case 'c':
+			if (sscanf(optarg, "%d:%d", &cgroup_depth, &cgroup_fanout) != 2) {
+				fprintf(stderr, "--cgroup takes DEPTH:FANOUT\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (threads_set && (nr_scale_threads < 1 || nr_scale_threads > MAX_SCALE_THREADS)) {
+		fprintf(stderr, "--threads must be between 1 and %d\n", MAX_SCALE_THREADS);
 		return EXIT_FAILURE;
 	}
 
-	ret = pthread_create(&thread, NULL, thread_loop, NULL);
+	if (grid_jobs < 1 || grid_jobs > MAX_SCALE_THREADS) {
+		fprintf(stderr, "--jobs must be between 1 and %d\n", MAX_SCALE_THREADS);
+		return EXIT_FAILURE;
+	}
+
+	if (cgroup_depth && (cgroup_depth < 1 || cgroup_fanout < 1 ||
+			     uclamp_cgroup_nr_nodes(cgroup_depth, cgroup_fanout) < 0 ||
+			     uclamp_cgroup_nr_nodes(cgroup_depth, cgroup_fanout) -
+			     uclamp_cgroup_nr_nodes(cgroup_depth - 1, cgroup_fanout) > MAX_SCALE_THREADS)) {
+		fprintf(stderr, "--cgroup tree can have at most %d groups and %d leaves, %d levels deep\n",
+			CGROUP_MAX_NODES, MAX_SCALE_THREADS, CGROUP_MAX_DEPTH);
+		return EXIT_FAILURE;
+	}
+
+	/* The scale-out, grid and cgroup reports are built from the rq_pelt events */
+	if ((nr_scale_threads || nr_grid_min || cgroup_depth || wakeup_records) && aggregate) {
+		fprintf(stderr, "--threads, --grid, --cgroup and --wakeup can't be used with --aggregate\n");
+		return EXIT_FAILURE;
+	}
+
+	if (rb_size < (unsigned long)getpagesize() || (rb_size & (rb_size - 1))) {
+		fprintf(stderr, "--rb-size must be a power of 2 multiple of the page size\n");
+		return EXIT_FAILURE;
+	}
+
+	if (rb_wakeup_pct < 0 || rb_wakeup_pct > 100) {
+		fprintf(stderr, "--rb-wakeup must be between 0 and 100\n");
+		return EXIT_FAILURE;
+	}
+
+	if (record_file) {
+		trace = trace_writer_open(record_file);
+		if (!trace)
+			return EXIT_FAILURE;
+		fprintf(stdout, "Recording events into %s\n", record_file);
+	}
+
+	ret = open_and_load_skel(force_kprobes);
+	if (ret)
+		return EXIT_FAILURE;
+
+	ret = ts_bases_init();
 	if (ret) {
-		perror("Failed to create thread");
-		goto cleanup;
+		ts_bases_free();
+		uclamp_test_thermal_pressure_bpf__destroy(skel);
+		return EXIT_FAILURE;
 	}
 
-	ret = uclamp_test_thermal_pressure_bpf__load(skel);
+	/* Aggregate mode already summarizes in BPF */
+	if (!aggregate) {
+		ret = stream_stats_init();
+		if (ret) {
+			uclamp_test_thermal_pressure_bpf__destroy(skel);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (overhead) {
+		ret = overhead_init();
+		if (ret) {
+			uclamp_test_thermal_pressure_bpf__destroy(skel);
+			return EXIT_FAILURE;
+		}
+	}
+
+	ret = pthread_create(&thread, NULL, thread_loop, NULL);
 	if (ret) {
-		fprintf(stderr, "Failed to load and verify BPF skeleton\n");
-		goto cleanup;
+		perror("Failed to create thread");
+		uclamp_test_thermal_pressure_bpf__destroy(skel);
+		return EXIT_FAILURE;
 	}
 
 	ret = uclamp_test_thermal_pressure_bpf__attach(skel);
@@ -443,23 +2944,54 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
-	CREATE_EVENT_THREAD(rq_pelt);
-	CREATE_EVENT_THREAD(select_task_rq_fair);
-	CREATE_EVENT_THREAD(compute_energy);
+	if (wakeup_records) {
+		ADD_EVENT_RB(wakeup);
+	} else {
+		ADD_EVENT_RB(rq_pelt);
+		ADD_EVENT_RB(select_task_rq_fair);
+		ADD_EVENT_RB(compute_energy);
+	}
+
+	CREATE_EVENTS_THREAD();
+	events_started = true;
 
-	/* Wait for events threads to start */
+	/* Wait for events thread to start */
 	sleep(1);
 
 cleanup:
 	start = true;
 	pthread_join(thread, NULL);
+
+	if (overhead && events_started)
+		run_overhead_benchmark();
+
 	done = true;
 
 	pr_debug("main pid: %u\n", gettid());
 
-	DESTROY_EVENT_THREAD(rq_pelt);
-	DESTROY_EVENT_THREAD(select_task_rq_fair);
-	DESTROY_EVENT_THREAD(compute_energy);
+	if (events_started) {
+		DESTROY_EVENTS_THREAD();
+
+		print_event_stats(&rq_pelt_stats);
+		print_event_stats(&select_task_rq_fair_stats);
+		print_event_stats(&compute_energy_stats);
+		print_event_stats(&wakeup_stats);
+		print_events_consumer_stats(&events_consumer_stats);
+		print_rb_drops();
+	}
+	DESTROY_EVENTS_RB();
+	if (trace) {
+		fprintf(stdout, "Recorded %llu events into %s\n", trace->records, record_file);
+		if (trace->failed)
+			fprintf(stderr, "Failed to record %llu events, %s is incomplete\n",
+				trace->failed, record_file);
+		trace_writer_close(trace);
+	}
+	overhead_exit();
+	free(stream_stats);
+	free(rq_pelt_hist_prev);
+	eas_model_free(&model);
+	ts_bases_free();
 	uclamp_test_thermal_pressure_bpf__destroy(skel);
 	return ret < 0 ? -ret : EXIT_SUCCESS;
 }
@@ -0,0 +1,413 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uclamp_test_thermal_pressure_checks.h"
+#include "uclamp_test_thermal_pressure_events.h"
+#include "uclamp_test_thermal_pressure_model.h"
+#include "uclamp_test_thermal_pressure_trace.h"
+
+/*
+ * Replay the rq_pelt checks on a recorded trace, either the CSV the live test
+ * writes or a binary trace recorded with --record. No root or BPF needed.
+ *
+ * The trace is mmap()ed and split into one chunk per thread for the stateless
+ * checks. The placement model depends on every event before the one it
+ * judges, so one more thread runs it over the whole trace, in trace order,
+ * and the verdicts don't depend on the number of threads.
+ */
+
+#define MAX_THREADS	256
+
+struct check_job {
+	pthread_t thread;
+	const char *data;
+	size_t start;
+	size_t end;
+	bool binary;
+	unsigned long long events;
+	unsigned long long failed[NR_RQ_PELT_CHECKS];
+	/* Run the placement model rather than the stateless checks */
+	bool placement;
+	struct eas_model model;
+};
+
+static struct capacities capacities;
+static bool verbose = false;
+static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void check_event(struct check_job *job, const struct rq_pelt_event *e)
+{
+	unsigned int failed = check_rq_pelt_event(e, &capacities);
+	enum model_verdict v = MODEL_OK;
+	int i;
+
+	if (job->placement) {
+		v = eas_model_check(&job->model, e);
+		/* The heuristics only stand in for the model where it couldn't judge */
+		failed &= job->model.judged ? 0 : RQ_PELT_PLACEMENT_CHECKS;
+	} else {
+		failed &= ~RQ_PELT_PLACEMENT_CHECKS;
+		job->events++;
+	}
+
+	if (!failed && v == MODEL_OK)
+		return;
+
+	for (i = 0; i < NR_RQ_PELT_CHECKS; i++) {
+		if (failed & RQ_PELT_CHECK(i))
+			job->failed[i]++;
+	}
+
+	if (verbose) {
+		pthread_mutex_lock(&print_mutex);
+		print_rq_pelt_checks(stdout, e, &capacities, failed);
+		eas_model_print(stdout, &job->model, e, v);
+		pthread_mutex_unlock(&print_mutex);
+	}
+}
+
+static inline unsigned long long parse_field(const char **p, const char *end)
+{
+	unsigned long long val = 0;
+	const char *s = *p;
+
+	while (s < end && (*s == ' ' || *s == ','))
+		s++;
+	while (s < end && *s >= '0' && *s <= '9')
+		val = val * 10 + (*s++ - '0');
+
+	*p = s;
+	return val;
+}
+
+/*
+ * Parse the uclamp_test_thermal_pressure_pelt.csv layout, see
+ * fprint_rq_pelt_csv().
+ */
+static bool parse_rq_pelt_csv(const char *line, const char *end, struct rq_pelt_event *e)
+{
+	const char *p = line;
+
+	if (line == end || *line < '0' || *line > '9')
+		return false;
+
+	e->ts = parse_field(&p, end);
+	e->cpu = parse_field(&p, end);
+	e->rq_util_avg = parse_field(&p, end);
+	e->p_util_avg = parse_field(&p, end);
+	e->capacity_orig = parse_field(&p, end);
+	e->thermal_avg = parse_field(&p, end);
+	e->uclamp_min = parse_field(&p, end);
+	e->uclamp_max = parse_field(&p, end);
+	e->overutilized = parse_field(&p, end);
+	e->misfit = parse_field(&p, end);
+	e->pid = parse_field(&p, end);
+
+	return true;
+}
+
+static void *check_csv_fn(void *data)
+{
+	struct check_job *job = data;
+	const char *p = job->data + job->start;
+	const char *end = job->data + job->end;
+	struct rq_pelt_event e;
+
+	if (job->placement && eas_model_init(&job->model, &capacities))
+		return NULL;
+
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+
+		if (!eol)
+			eol = end;
+
+		memset(&e, 0, sizeof(e));
+		if (parse_rq_pelt_csv(p, eol, &e))
+			check_event(job, &e);
+
+		p = eol + 1;
+	}
+
+	if (job->placement)
+		eas_model_free(&job->model);
+	return NULL;
+}
+
+static void *check_binary_fn(void *data)
+{
+	struct check_job *job = data;
+	const struct trace_record *rec;
+	size_t off = job->start;
+
+	if (job->placement && eas_model_init(&job->model, &capacities))
+		return NULL;
+
+	while (off < job->end && (rec = trace_next_record(job->data, job->end, &off))) {
+		if (rec->type == TRACE_RQ_PELT)
+			check_event(job, trace_record_data(rec));
+		else if (rec->type == TRACE_WAKEUP)
+			check_event(job, &((const struct wakeup_event *)trace_record_data(rec))->enqueue);
+	}
+
+	if (job->placement)
+		eas_model_free(&job->model);
+	return NULL;
+}
+
+/*
+ * Split [start, size) into nr_jobs chunks ending on a line boundary.
+ */
+static void split_csv(struct check_job *jobs, int nr_jobs, const char *data, size_t size)
+{
+	size_t start = 0;
+	int i;
+
+	/* Skip the header */
+	if (size && (data[0] < '0' || data[0] > '9')) {
+		const char *eol = memchr(data, '\n', size);
+
+		start = eol ? eol - data + 1 : size;
+	}
+
+	for (i = 0; i < nr_jobs; i++) {
+		size_t end = start + (size - start) / (nr_jobs - i);
+
+		if (end < size) {
+			const char *eol = memchr(data + end, '\n', size - end);
+
+			end = eol ? eol - data + 1 : size;
+		}
+
+		jobs[i].start = start;
+		jobs[i].end = end;
+		start = end;
+	}
+}
+
+/*
+ * Records are variable length, so walk their headers once to find the
+ * record boundaries closest to an even split.
+ */
+static void split_binary(struct check_job *jobs, int nr_jobs, struct trace_reader *tr)
+{
+	size_t off = tr->hdr->header_len;
+	int i;
+
+	for (i = 0; i < nr_jobs; i++) {
+		size_t target = tr->size * (i + 1) / nr_jobs;
+
+		jobs[i].start = off;
+		while (off < target && trace_next_record(tr->data, tr->size, &off))
+			;
+		/* Truncated trace, the last job will stop at the same place */
+		if (off < target)
+			off = tr->size;
+		jobs[i].end = off;
+	}
+
+	jobs[nr_jobs - 1].end = tr->size;
+}
+
+/* A binary trace starts with TRACE_MAGIC, anything else is CSV */
+static int is_binary_trace(const char *path)
+{
+	__u32 magic = 0;
+	FILE *file;
+	int binary;
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror("Failed to open trace");
+		return -1;
+	}
+
+	binary = fread(&magic, sizeof(magic), 1, file) == 1 && magic == TRACE_MAGIC;
+	fclose(file);
+
+	return binary;
+}
+
+static int map_csv(struct trace_reader *tr, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror("Failed to open trace");
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	tr->size = st.st_size;
+	tr->data = tr->size ? mmap(NULL, tr->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (tr->data == MAP_FAILED) {
+		perror("Failed to mmap trace");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS] TRACE\n", prog);
+	fprintf(stderr, "  TRACE is either a rq_pelt CSV file or a binary trace\n");
+	fprintf(stderr, "  -c, --capacities FILE\tCapacity table (default: %s)\n", CAPACITIES_CSV_FILE);
+	fprintf(stderr, "  -j, --jobs N\t\tNumber of threads (default: online cpus)\n");
+	fprintf(stderr, "  -v, --verbose\t\tPrint every failed event\n");
+	fprintf(stderr, "  -h, --help\t\tShow this help\n");
+}
+
+static const struct option long_options[] = {
+	{ "capacities",	required_argument,	0, 'c' },
+	{ "jobs",	required_argument,	0, 'j' },
+	{ "verbose",	no_argument,		0, 'v' },
+	{ "help",	no_argument,		0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	const char *capacities_file = CAPACITIES_CSV_FILE;
+	unsigned long long failed[NR_RQ_PELT_CHECKS] = {};
+	unsigned long long verdicts[NR_MODEL_VERDICTS] = {};
+	unsigned long long events = 0, nr_failed = 0;
+	int nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	struct check_job *jobs;
+	struct trace_reader tr;
+	struct timespec t0, t1;
+	double elapsed;
+	bool binary;
+	int opt, i, ret;
+
+	while ((opt = getopt_long(argc, argv, "c:j:vh", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			capacities_file = optarg;
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (nr_jobs < 1)
+		nr_jobs = 1;
+	if (nr_jobs > MAX_THREADS)
+		nr_jobs = MAX_THREADS;
+
+	if (capacities_load(&capacities, capacities_file))
+		return EXIT_FAILURE;
+
+	memset(&tr, 0, sizeof(tr));
+	ret = is_binary_trace(argv[optind]);
+	if (ret < 0)
+		return EXIT_FAILURE;
+	binary = ret;
+
+	if (binary)
+		ret = trace_reader_open(&tr, argv[optind]);
+	else
+		ret = map_csv(&tr, argv[optind]);
+	if (ret)
+		return EXIT_FAILURE;
+
+	/* One more job for the placement model */
+	jobs = calloc(nr_jobs + 1, sizeof(*jobs));
+	if (!jobs) {
+		perror("Failed to allocate jobs");
+		return EXIT_FAILURE;
+	}
+
+	if (binary)
+		split_binary(jobs, nr_jobs, &tr);
+	else
+		split_csv(jobs, nr_jobs, tr.data, tr.size);
+
+	jobs[nr_jobs].start = jobs[0].start;
+	jobs[nr_jobs].end = jobs[nr_jobs - 1].end;
+	jobs[nr_jobs].placement = true;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (i = 0; i <= nr_jobs; i++) {
+		jobs[i].data = tr.data;
+		jobs[i].binary = binary;
+		ret = pthread_create(&jobs[i].thread, NULL,
+				     binary ? check_binary_fn : check_csv_fn, &jobs[i]);
+		if (ret) {
+			fprintf(stderr, "Failed to create check thread: %d\n", ret);
+			break;
+		}
+	}
+
+	/* A partial check would look like a clean one */
+	if (i <= nr_jobs) {
+		while (i--)
+			pthread_join(jobs[i].thread, NULL);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i <= nr_jobs; i++) {
+		int j;
+
+		pthread_join(jobs[i].thread, NULL);
+		events += jobs[i].events;
+		for (j = 0; j < NR_RQ_PELT_CHECKS; j++)
+			failed[j] += jobs[i].failed[j];
+		for (j = 0; j < NR_MODEL_VERDICTS; j++)
+			verdicts[j] += jobs[i].model.verdicts[j];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	fprintf(stdout, "Checked %llu rq_pelt events with %d threads in %.3f s (%.0f events/s)\n",
+		events, nr_jobs, elapsed, elapsed > 0 ? events / elapsed : 0);
+
+	for (i = 0; i < NR_RQ_PELT_CHECKS; i++) {
+		fprintf(stdout, "%-8s %-44s %llu\n",
+			rq_pelt_checks[i].warning ? "Warning:" : "Failed:",
+			rq_pelt_checks[i].name, failed[i]);
+		if (!rq_pelt_checks[i].warning)
+			nr_failed += failed[i];
+	}
+
+	for (i = MODEL_NOT_FIT; i < NR_MODEL_VERDICTS; i++) {
+		fprintf(stdout, "%-8s %-44s %llu\n", "Failed:", model_verdict_names[i], verdicts[i]);
+		nr_failed += verdicts[i];
+	}
+
+	if (tr.data)
+		munmap((void *)tr.data, tr.size);
+	free(jobs);
+	capacities_free(&capacities);
+
+	return nr_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
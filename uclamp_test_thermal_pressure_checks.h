@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#ifndef __UCLAMP_TEST_THERMAL_PRESSURE_CHECKS_H__
+#define __UCLAMP_TEST_THERMAL_PRESSURE_CHECKS_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "capacities.h"
+#include "uclamp_test_thermal_pressure_events.h"
+
+/*
+ * Invariant checks done on every rq_pelt_event. Shared between the live test
+ * and the offline checker so that both flag exactly the same events.
+ */
+
+enum rq_pelt_check {
+	CHECK_UCLAMP_MIN_GT_CAP,
+	CHECK_UCLAMP_MIN_GT_CAP_THERMAL,
+	CHECK_OVERUTILIZED_NOT_SET,
+	CHECK_MISFIT_NOT_SET,
+	CHECK_CAPACITY_INVERSION,
+	CHECK_UCLAMP_MIN_NOT_SMALLEST_FIT,
+	CHECK_UCLAMP_MAX_NOT_SMALLEST_FIT,
+	NR_RQ_PELT_CHECKS,
+};
+
+struct rq_pelt_check_desc {
+	const char *name;
+	bool warning;
+};
+
+static const struct rq_pelt_check_desc rq_pelt_checks[NR_RQ_PELT_CHECKS] = {
+	[CHECK_UCLAMP_MIN_GT_CAP]		= { "uclamp_min > capacity_orig", false },
+	[CHECK_UCLAMP_MIN_GT_CAP_THERMAL]	= { "uclamp_min > capacity_orig - thermal_avg", false },
+	[CHECK_OVERUTILIZED_NOT_SET]		= { "overutilized flag not set", false },
+	[CHECK_MISFIT_NOT_SET]			= { "misfit flag not set", false },
+	[CHECK_CAPACITY_INVERSION]		= { "capacity_inversion", true },
+	[CHECK_UCLAMP_MIN_NOT_SMALLEST_FIT]	= { "uclamp_min not on smallest fitting cap", true },
+	[CHECK_UCLAMP_MAX_NOT_SMALLEST_FIT]	= { "uclamp_max not on smallest fitting cap", false },
+};
+
+#define RQ_PELT_CHECK(check)	(1U << (check))
+
+/*
+ * Placement heuristics, superseded by the placement model where the events
+ * are seen in order and it had a fresh view of the clusters the task could
+ * have gone to, see uclamp_test_thermal_pressure_model.h.
+ */
+#define RQ_PELT_PLACEMENT_CHECKS	(RQ_PELT_CHECK(CHECK_UCLAMP_MIN_NOT_SMALLEST_FIT) | \
+					 RQ_PELT_CHECK(CHECK_UCLAMP_MAX_NOT_SMALLEST_FIT))
+
+/*
+ * Return a mask of RQ_PELT_CHECK() bits for every check @e failed.
+ */
+static inline unsigned int check_rq_pelt_event(const struct rq_pelt_event *e,
+					       const struct capacities *caps)
+{
+	unsigned long capacity_thermal = e->capacity_orig - e->thermal_avg;
+	unsigned long smallest_uclamp_min_cap = capacity_fit(caps, e->uclamp_min);
+	unsigned long smallest_uclamp_max_cap = capacity_fit(caps, e->uclamp_max);
+	unsigned int failed = 0;
+
+	if (e->uclamp_min > e->capacity_orig)
+		failed |= RQ_PELT_CHECK(CHECK_UCLAMP_MIN_GT_CAP);
+
+	if (e->thermal_avg && e->capacity_orig != 1024 && e->uclamp_min > capacity_thermal)
+		failed |= RQ_PELT_CHECK(CHECK_UCLAMP_MIN_GT_CAP_THERMAL);
+
+	if ((e->uclamp_max > e->capacity_orig || e->uclamp_max == 1024) && e->p_util_avg > e->capacity_orig * 0.8 && e->overutilized != SG_OVERUTILIZED)
+		failed |= RQ_PELT_CHECK(CHECK_OVERUTILIZED_NOT_SET);
+
+	if (e->uclamp_min > capacity_thermal && !e->misfit)
+		failed |= RQ_PELT_CHECK(CHECK_MISFIT_NOT_SET);
+
+	/* We're on a smaller capacity than what fits, that's fine */
+	if (smallest_uclamp_min_cap > e->capacity_orig)
+		smallest_uclamp_min_cap = e->capacity_orig;
+	if (smallest_uclamp_max_cap > e->capacity_orig)
+		smallest_uclamp_max_cap = e->capacity_orig;
+
+	/* Is any smaller capacity now bigger than what's left of ours? */
+	if (e->thermal_avg && capacity_thermal < capacity_lower(caps, e->capacity_orig))
+		failed |= RQ_PELT_CHECK(CHECK_CAPACITY_INVERSION);
+
+	if (e->p_util_avg < e->uclamp_min && e->capacity_orig != smallest_uclamp_min_cap)
+		failed |= RQ_PELT_CHECK(CHECK_UCLAMP_MIN_NOT_SMALLEST_FIT);
+
+	if (e->capacity_orig != smallest_uclamp_max_cap)
+		failed |= RQ_PELT_CHECK(CHECK_UCLAMP_MAX_NOT_SMALLEST_FIT);
+
+	return failed;
+}
+
+/*
+ * Print the detailed message of every check @e failed.
+ */
+static inline void print_rq_pelt_checks(FILE *file, const struct rq_pelt_event *e,
+					const struct capacities *caps, unsigned int failed)
+{
+	unsigned long capacity_thermal = e->capacity_orig - e->thermal_avg;
+	unsigned int i;
+
+	if (failed & RQ_PELT_CHECK(CHECK_UCLAMP_MIN_GT_CAP))
+		fprintf(file, "[%llu] Failed: uclamp_min > capacity_orig: %lu > %lu\n", e->ts, e->uclamp_min, e->capacity_orig);
+
+	if (failed & RQ_PELT_CHECK(CHECK_UCLAMP_MIN_GT_CAP_THERMAL)) {
+		fprintf(file, "[%llu] Failed: uclamp_min > capacity_orig - thermal_avg: %lu > %lu - %lu (%lu)\n",
+			e->ts, e->uclamp_min, e->capacity_orig, e->thermal_avg, capacity_thermal);
+	}
+
+	if (failed & RQ_PELT_CHECK(CHECK_OVERUTILIZED_NOT_SET))
+		fprintf(file, "[%llu] Failed: overutilized flag not set: %lu > %lu\n", e->ts, e->p_util_avg, (unsigned long) (e->capacity_orig * 0.8));
+
+	if (failed & RQ_PELT_CHECK(CHECK_MISFIT_NOT_SET))
+		fprintf(file, "[%llu] Failed: misfit flag not set: %lu > %lu\n", e->ts, e->uclamp_min, capacity_thermal);
+
+	if (failed & RQ_PELT_CHECK(CHECK_CAPACITY_INVERSION)) {
+		for (i = 0; i < caps->len; i++) {
+			unsigned long cap = caps->cap[i];
+
+			if (cap < e->capacity_orig && capacity_thermal < cap) {
+				fprintf(file, "[%llu] Warning: capacity_inversion: capacity_orig - thermal_avg < cap: %lu - %lu (%lu) < %lu\n",
+					e->ts, e->capacity_orig, e->thermal_avg, capacity_thermal, cap);
+			}
+		}
+	}
+
+	if (failed & RQ_PELT_CHECK(CHECK_UCLAMP_MIN_NOT_SMALLEST_FIT))
+		fprintf(file, "[%llu] Warning: uclamp_min not on smallest fitting cap: %lu < %lu. Is it more energy efficient?\n", e->ts, e->uclamp_min, e->capacity_orig);
+
+	if (failed & RQ_PELT_CHECK(CHECK_UCLAMP_MAX_NOT_SMALLEST_FIT))
+		fprintf(file, "[%llu] Failed: uclamp_max not on smallest fitting cap: %lu < %lu\n", e->ts, e->uclamp_max, e->capacity_orig);
+}
+
+#endif /* __UCLAMP_TEST_THERMAL_PRESSURE_CHECKS_H__ */
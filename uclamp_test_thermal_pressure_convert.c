@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uclamp_test_thermal_pressure_events.h"
+#include "uclamp_test_thermal_pressure_trace.h"
+
+/*
+ * Convert a binary trace recorded with uclamp_test_thermal_pressure --record
+ * into the same CSV files the live test produces.
+ */
+
+#define CSV_BUF_SIZE	(1024 * 1024)
+
+static FILE *open_csv(const char *dir, const char *name, const char *header)
+{
+	char path[PATH_MAX];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "Failed to create %s file\n", path);
+		return NULL;
+	}
+
+	setvbuf(file, NULL, _IOFBF, CSV_BUF_SIZE);
+	fprintf(file, "%s", header);
+	fprintf(stdout, "Created %s\n", path);
+
+	return file;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long nr_events[TRACE_NR_TYPES] = {};
+	unsigned long long nr_unknown = 0;
+	FILE *files[TRACE_NR_TYPES] = {};
+	const struct trace_record *rec;
+	struct trace_reader tr;
+	const char *dir = ".";
+	int ret = EXIT_FAILURE;
+	size_t off;
+	int i;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s TRACE [OUTPUT_DIR]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (argc == 3)
+		dir = argv[2];
+
+	if (trace_reader_open(&tr, argv[1]))
+		return EXIT_FAILURE;
+
+	files[TRACE_RQ_PELT] = open_csv(dir, PELT_CSV_FILE, PELT_CSV_HEADER);
+	files[TRACE_SELECT_TASK_RQ_FAIR] = open_csv(dir, STRQF_CSV_FILE, STRQF_CSV_HEADER);
+	files[TRACE_COMPUTE_ENERGY] = open_csv(dir, COMPUTE_ENERGY_CSV_FILE, COMPUTE_ENERGY_CSV_HEADER);
+	files[TRACE_WAKEUP] = open_csv(dir, WAKEUP_CSV_FILE, WAKEUP_CSV_HEADER);
+	for (i = TRACE_RQ_PELT; i < TRACE_NR_TYPES; i++) {
+		if (!files[i])
+			goto cleanup;
+	}
+
+	off = tr.hdr->header_len;
+	while ((rec = trace_next_record(tr.data, tr.size, &off))) {
+		const void *data = trace_record_data(rec);
+
+		switch (rec->type) {
+		case TRACE_RQ_PELT:
+			fprint_rq_pelt_csv(files[rec->type], data);
+			break;
+		case TRACE_SELECT_TASK_RQ_FAIR:
+			fprint_select_task_rq_fair_csv(files[rec->type], data);
+			break;
+		case TRACE_COMPUTE_ENERGY:
+			fprint_compute_energy_csv(files[rec->type], data);
+			break;
+		case TRACE_WAKEUP:
+			fprint_wakeup_csv(files[rec->type], data);
+			break;
+		default:
+			nr_unknown++;
+			continue;
+		}
+		nr_events[rec->type]++;
+	}
+
+	if (off != tr.size)
+		fprintf(stderr, "Warning: trace truncated at offset %zu of %zu\n", off, tr.size);
+
+	fprintf(stdout, "rq_pelt: %llu select_task_rq_fair: %llu compute_energy: %llu wakeup: %llu unknown: %llu\n",
+		nr_events[TRACE_RQ_PELT], nr_events[TRACE_SELECT_TASK_RQ_FAIR],
+		nr_events[TRACE_COMPUTE_ENERGY], nr_events[TRACE_WAKEUP], nr_unknown);
+
+	ret = EXIT_SUCCESS;
+cleanup:
+	for (i = TRACE_RQ_PELT; i < TRACE_NR_TYPES; i++) {
+		if (files[i])
+			fclose(files[i]);
+	}
+	trace_reader_close(&tr);
+	return ret;
+}
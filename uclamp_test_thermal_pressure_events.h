@@ -3,9 +3,18 @@
 #ifndef __UCLAMP_TEST_THERMAL_PRESSURE_EVENTS_H__
 #define __UCLAMP_TEST_THERMAL_PRESSURE_EVENTS_H__
 
+/*
+ * rq->rd->overutilized when set. Kernels where it's a bool are read as this
+ * too, so overutilized is always 0 or SG_OVERUTILIZED in the events.
+ */
+#ifndef SG_OVERUTILIZED
+#define SG_OVERUTILIZED		0x2
+#endif
+
 struct rq_pelt_event {
 	unsigned long long ts;
 	int cpu;
+	int pid;
 	unsigned long rq_util_avg;
 	unsigned long p_util_avg;
 	unsigned long capacity_orig;
@@ -19,6 +28,7 @@ struct rq_pelt_event {
 struct select_task_rq_fair_event {
 	unsigned long long ts;
 	int cpu;
+	int pid;
 	unsigned long p_util_avg;
 	unsigned long uclamp_min;
 	unsigned long uclamp_max;
@@ -27,10 +37,251 @@ struct select_task_rq_fair_event {
 struct compute_energy_event {
 	unsigned long long ts;
 	int dst_cpu;
+	int pid;
 	unsigned long p_util_avg;
 	unsigned long uclamp_min;
 	unsigned long uclamp_max;
 	unsigned long energy;
+	/* Energy of dst_cpu's perf domain without p, energy - base_energy is its cost */
+	unsigned long base_energy;
+	/* CPU p was on before select_task_rq_fair() */
+	int prev_cpu;
+};
+
+/*
+ * On-wire layout of the rq_pelt, select_task_rq_fair and compute_energy
+ * events. The util, capacity and uclamp values all fit in 11 bits, so they are
+ * sent as u16 and decoded back into the structs above by the consumer.
+ *
+ * Timestamps are sent as a u32 delta from a per-CPU base. Every CPU emits a
+ * struct ts_base_wire on a ring buffer before its first event and whenever
+ * the delta would overflow. It can't be mistaken for an event as none of them
+ * has the same size.
+ */
+#define WIRE_VERSION		3
+
+#define WIRE_OVERUTILIZED	(1 << 0)
+#define WIRE_MISFIT		(1 << 1)
+
+struct ts_base_wire {
+	unsigned long long ts;
+	unsigned short src_cpu;
+	unsigned char version;
+};
+
+struct wire_hdr {
+	unsigned int ts_delta;
+	/* CPU the event was emitted on, ts_delta is relative to its base */
+	unsigned short src_cpu;
+	/* rq cpu, selected cpu or dst_cpu depending on the event */
+	unsigned short cpu;
+};
+
+struct rq_pelt_wire {
+	struct wire_hdr hdr;
+	int pid;
+	unsigned short rq_util_avg;
+	unsigned short p_util_avg;
+	unsigned short capacity_orig;
+	unsigned short thermal_avg;
+	unsigned short uclamp_min;
+	unsigned short uclamp_max;
+	unsigned char flags;
+};
+
+struct select_task_rq_fair_wire {
+	struct wire_hdr hdr;
+	int pid;
+	unsigned short p_util_avg;
+	unsigned short uclamp_min;
+	unsigned short uclamp_max;
+};
+
+/*
+ * All the candidates compute_energy evaluated during one select_task_rq_fair()
+ * call, hdr.cpu is the CPU that was picked in the end. nr_candidates counts
+ * all of them, only the first ENERGY_MAX_CANDIDATES are recorded.
+ *
+ * Energies are of the candidate's perf domain only, base_energy[i] is that
+ * same domain evaluated without the task (the dst_cpu == -1 call).
+ */
+#define ENERGY_MAX_CANDIDATES	8
+
+struct compute_energy_wire {
+	struct wire_hdr hdr;
+	int pid;
+	unsigned short p_util_avg;
+	unsigned short uclamp_min;
+	unsigned short uclamp_max;
+	unsigned short nr_candidates;
+	unsigned short prev_cpu;
+	unsigned short cpu[ENERGY_MAX_CANDIDATES];
+	unsigned long long energy[ENERGY_MAX_CANDIDATES];
+	unsigned long long base_energy[ENERGY_MAX_CANDIDATES];
 };
 
+/* Consumers tell a ts_base_wire from the events by its size */
+_Static_assert(sizeof(struct ts_base_wire) != sizeof(struct rq_pelt_wire),
+	       "ts_base_wire and rq_pelt_wire must differ in size");
+_Static_assert(sizeof(struct ts_base_wire) != sizeof(struct select_task_rq_fair_wire),
+	       "ts_base_wire and select_task_rq_fair_wire must differ in size");
+_Static_assert(sizeof(struct ts_base_wire) != sizeof(struct compute_energy_wire),
+	       "ts_base_wire and compute_energy_wire must differ in size");
+
+static inline void rq_pelt_decode(struct rq_pelt_event *e, const struct rq_pelt_wire *w,
+				  unsigned long long base)
+{
+	e->ts = base + w->hdr.ts_delta;
+	e->cpu = w->hdr.cpu;
+	e->pid = w->pid;
+	e->rq_util_avg = w->rq_util_avg;
+	e->p_util_avg = w->p_util_avg;
+	e->capacity_orig = w->capacity_orig;
+	e->thermal_avg = w->thermal_avg;
+	e->uclamp_min = w->uclamp_min;
+	e->uclamp_max = w->uclamp_max;
+	e->overutilized = w->flags & WIRE_OVERUTILIZED ? SG_OVERUTILIZED : 0;
+	e->misfit = !!(w->flags & WIRE_MISFIT);
+}
+
+static inline void select_task_rq_fair_decode(struct select_task_rq_fair_event *e,
+					      const struct select_task_rq_fair_wire *w,
+					      unsigned long long base)
+{
+	e->ts = base + w->hdr.ts_delta;
+	e->cpu = w->hdr.cpu;
+	e->pid = w->pid;
+	e->p_util_avg = w->p_util_avg;
+	e->uclamp_min = w->uclamp_min;
+	e->uclamp_max = w->uclamp_max;
+}
+
+static inline unsigned int compute_energy_nr_recorded(const struct compute_energy_wire *w)
+{
+	return w->nr_candidates < ENERGY_MAX_CANDIDATES ? w->nr_candidates : ENERGY_MAX_CANDIDATES;
+}
+
+/* Decode candidate i of w */
+static inline void compute_energy_decode(struct compute_energy_event *e,
+					 const struct compute_energy_wire *w,
+					 unsigned long long base, unsigned int i)
+{
+	e->ts = base + w->hdr.ts_delta;
+	e->dst_cpu = w->cpu[i];
+	e->pid = w->pid;
+	e->p_util_avg = w->p_util_avg;
+	e->uclamp_min = w->uclamp_min;
+	e->uclamp_max = w->uclamp_max;
+	e->energy = w->energy[i];
+	e->base_energy = w->base_energy[i];
+	e->prev_cpu = w->prev_cpu;
+}
+
+#define WAKEUP_MAX_CANDIDATES	8
+
+struct wakeup_candidate {
+	int cpu;
+	unsigned long energy;
+	unsigned long base_energy;
+};
+
+/*
+ * All the stages of one wakeup of a traced task in a single record: the
+ * compute_energy candidates, the CPU select_task_rq_fair picked and the rq
+ * signals once enqueued. seq numbers the wakeups of each task.
+ *
+ * strqf_cpu and strqf_prev_cpu are -1 if select_task_rq_fair wasn't seen for
+ * this wakeup.
+ * nr_candidates counts all the compute_energy calls, only the first
+ * WAKEUP_MAX_CANDIDATES are recorded.
+ */
+struct wakeup_event {
+	unsigned long long seq;
+	unsigned long long strqf_ts;
+	int strqf_cpu;
+	int strqf_prev_cpu;
+	int nr_candidates;
+	struct wakeup_candidate candidates[WAKEUP_MAX_CANDIDATES];
+	struct rq_pelt_event enqueue;
+};
+
+/*
+ * Default size of every ring buffer, userspace can resize them before load.
+ * Must be a power of 2 multiple of the page size.
+ */
+#define RB_SIZE		(256 * 1024)
+
+/*
+ * Index of every ring buffer in rb_drops, the per-CPU count of events dropped
+ * because bpf_ringbuf_reserve() failed.
+ */
+enum rb_id {
+	RB_RQ_PELT,
+	RB_SELECT_TASK_RQ_FAIR,
+	RB_COMPUTE_ENERGY,
+	RB_WAKEUP,
+	NR_RBS,
+};
+
+/*
+ * Wakeup to running latency of the traced tasks, log2 histograms in ns built
+ * in BPF and keyed by the uclamp values of the task and the CPU it ran on.
+ */
+#define RUN_LAT_SLOTS		32	/* 0, [1, 2), [2, 4), ... [2^30, inf) ns */
+#define RUN_LAT_MAX_KEYS	1024
+
+struct run_lat_key {
+	unsigned int uclamp_min;
+	unsigned int uclamp_max;
+	int cpu;
+};
+
+struct run_lat_hist {
+	unsigned long long count;
+	unsigned long long max;
+	unsigned long long slots[RUN_LAT_SLOTS];
+};
+
+/*
+ * In-kernel aggregation of rq_pelt_event, keyed by rq cpu and by the uclamp
+ * buckets of the task. See rq_pelt_hist_key().
+ */
+#define UCLAMP_BUCKETS		5
+#define UCLAMP_BUCKET_DELTA	205	/* DIV_ROUND_CLOSEST(1024, UCLAMP_BUCKETS) */
+
+#define PELT_HIST_LOG2_SLOTS	12	/* 0, [1, 2), [2, 4), ... [1024, 2048) */
+#define PELT_HIST_LINEAR_SLOTS	16
+#define PELT_HIST_LINEAR_WIDTH	64
+
+struct rq_pelt_hist {
+	unsigned long long count;
+	unsigned long long rq_util_avg[PELT_HIST_LOG2_SLOTS];
+	unsigned long long p_util_avg[PELT_HIST_LOG2_SLOTS];
+	unsigned long long thermal_avg[PELT_HIST_LINEAR_SLOTS];
+	unsigned long long overutilized;
+	unsigned long long misfit;
+	unsigned long long capacity_orig;
+	unsigned long long thermal_max;
+	/* Hits of the checks done on each rq_pelt_event */
+	unsigned long long uclamp_min_gt_cap;
+	unsigned long long uclamp_min_gt_cap_thermal;
+	unsigned long long overutilized_not_set;
+	unsigned long long misfit_not_set;
+	unsigned long long p_util_lt_uclamp_min;
+};
+
+static inline unsigned int uclamp_bucket_id(unsigned long value)
+{
+	unsigned int id = value / UCLAMP_BUCKET_DELTA;
+
+	return id < UCLAMP_BUCKETS ? id : UCLAMP_BUCKETS - 1;
+}
+
+static inline unsigned int rq_pelt_hist_key(int cpu, unsigned long uclamp_min,
+					    unsigned long uclamp_max)
+{
+	return (cpu * UCLAMP_BUCKETS + uclamp_bucket_id(uclamp_min)) * UCLAMP_BUCKETS +
+		uclamp_bucket_id(uclamp_max);
+}
+
 #endif /* __UCLAMP_TEST_THERMAL_PRESSURE_EVENTS_H__ */
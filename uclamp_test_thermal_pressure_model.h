@@ -0,0 +1,278 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#ifndef __UCLAMP_TEST_THERMAL_PRESSURE_MODEL_H__
+#define __UCLAMP_TEST_THERMAL_PRESSURE_MODEL_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capacities.h"
+#include "uclamp_test_thermal_pressure_events.h"
+
+/*
+ * Userspace model of the capacity aware placement done at wakeup.
+ *
+ * The model keeps the last rq_util_avg and thermal_avg every rq_pelt_event
+ * reported for each CPU, and for every cluster the CPU with the most spare
+ * capacity. Given a wakeup, it works out the smallest cluster the task fits
+ * on, the way util_fits_cpu() does, and tells whether the CPU the task was
+ * enqueued on is a deviation:
+ *
+ *  - MODEL_NOT_FIT: the task doesn't fit where it was put, but fits on
+ *    another CPU.
+ *  - MODEL_TOO_BIG: EAS is on (!overutilized) and the task was put on a
+ *    bigger cluster than the smallest one it fits on. The energy model isn't
+ *    known here, we assume like the rest of the test that the smallest
+ *    fitting capacity is the most efficient.
+ *
+ * CPUs that didn't report anything for MODEL_STALE_NS are ignored, nothing is
+ * flagged based on them. The state is only allocated once, updating it and
+ * checking an event don't allocate and only rescan a cluster when its best
+ * CPU got busier or went stale.
+ *
+ * The model only learns about a CPU from the enqueues of the traced tasks.
+ * With a single workload thread, the CPUs it isn't running on go stale after
+ * MODEL_STALE_NS, so MODEL_NOT_FIT and MODEL_TOO_BIG can hardly ever be
+ * reported. The verdicts mean something once enough traced threads keep
+ * every cluster fresh, like the scale-out (--threads) and grid modes do.
+ * judged tells whether the last verdict was: when a cluster the task could
+ * have gone to had no fresh CPU, callers fall back to the placement
+ * heuristics of check_rq_pelt_event().
+ */
+#define MODEL_STALE_NS		(32 * 1000 * 1000ULL)	/* PELT half-life */
+
+/* fits_capacity(): util * 1280 < capacity * 1024 */
+#define MODEL_FIT_MARGIN	1280
+
+enum model_verdict {
+	MODEL_OK,
+	MODEL_NOT_FIT,
+	MODEL_TOO_BIG,
+	NR_MODEL_VERDICTS,
+};
+
+static const char * const model_verdict_names[NR_MODEL_VERDICTS] = {
+	[MODEL_OK]	= "placement as expected",
+	[MODEL_NOT_FIT]	= "placed where it doesn't fit",
+	[MODEL_TOO_BIG]	= "placed on a bigger cluster than needed",
+};
+
+struct model_cpu {
+	unsigned long long ts;
+	unsigned long rq_util_avg;
+	unsigned long thermal_avg;
+};
+
+struct model_cluster {
+	int best_cpu;
+	long best_spare;
+};
+
+struct eas_model {
+	const struct capacities *caps;
+	struct model_cpu *cpu;
+	struct model_cluster *cluster;
+	/* The CPU a correct decision would have picked for the last event */
+	int expected_cpu;
+	/* Every cluster the last event could have gone to had a fresh CPU */
+	bool judged;
+	unsigned long long verdicts[NR_MODEL_VERDICTS];
+};
+
+static inline int eas_model_init(struct eas_model *m, const struct capacities *caps)
+{
+	unsigned int i;
+
+	memset(m, 0, sizeof(*m));
+	m->caps = caps;
+	m->cpu = calloc(caps->nr_cpus, sizeof(*m->cpu));
+	m->cluster = calloc(caps->len, sizeof(*m->cluster));
+	if (!m->cpu || !m->cluster) {
+		perror("Failed to allocate placement model");
+		free(m->cpu);
+		free(m->cluster);
+		return -1;
+	}
+
+	for (i = 0; i < caps->len; i++)
+		m->cluster[i].best_cpu = -1;
+
+	return 0;
+}
+
+/* The verdicts are kept so they can still be read */
+static inline void eas_model_free(struct eas_model *m)
+{
+	free(m->cpu);
+	free(m->cluster);
+	m->cpu = NULL;
+	m->cluster = NULL;
+	m->caps = NULL;
+}
+
+static inline bool model_fresh(const struct model_cpu *c, unsigned long long now)
+{
+	return c->ts && c->ts + MODEL_STALE_NS >= now;
+}
+
+static inline long model_spare(const struct eas_model *m, unsigned int cpu)
+{
+	const struct model_cpu *c = &m->cpu[cpu];
+
+	return (long)m->caps->cpu_cap[cpu] - (long)c->thermal_avg - (long)c->rq_util_avg;
+}
+
+static inline void model_rescan_cluster(struct eas_model *m, unsigned int k,
+					unsigned long long now)
+{
+	struct model_cluster *cl = &m->cluster[k];
+	unsigned int cpu;
+
+	cl->best_cpu = -1;
+	for (cpu = 0; cpu < m->caps->nr_cpus; cpu++) {
+		long spare;
+
+		if (m->caps->cpu_cluster[cpu] != k || !model_fresh(&m->cpu[cpu], now))
+			continue;
+
+		spare = model_spare(m, cpu);
+		if (cl->best_cpu < 0 || spare > cl->best_spare) {
+			cl->best_cpu = cpu;
+			cl->best_spare = spare;
+		}
+	}
+}
+
+static inline void eas_model_update(struct eas_model *m, const struct rq_pelt_event *e)
+{
+	struct model_cluster *cl;
+	long spare;
+
+	if (e->cpu < 0 || (unsigned int)e->cpu >= m->caps->nr_cpus)
+		return;
+
+	m->cpu[e->cpu].ts = e->ts;
+	m->cpu[e->cpu].rq_util_avg = e->rq_util_avg;
+	m->cpu[e->cpu].thermal_avg = e->thermal_avg;
+
+	cl = &m->cluster[m->caps->cpu_cluster[e->cpu]];
+	spare = model_spare(m, e->cpu);
+
+	if (cl->best_cpu < 0 || spare >= cl->best_spare ||
+	    !model_fresh(&m->cpu[cl->best_cpu], e->ts)) {
+		cl->best_cpu = e->cpu;
+		cl->best_spare = spare;
+	} else if (cl->best_cpu == e->cpu) {
+		model_rescan_cluster(m, m->caps->cpu_cluster[e->cpu], e->ts);
+	}
+}
+
+/*
+ * Mirror of util_fits_cpu(): uclamp_max lets a task fit a CPU its util
+ * doesn't, uclamp_min can make it not fit a CPU its util does.
+ */
+static inline bool model_fits(unsigned long util, unsigned long uclamp_min,
+			      unsigned long uclamp_max, unsigned long capacity_orig,
+			      unsigned long thermal_avg)
+{
+	unsigned long capacity = capacity_orig > thermal_avg ? capacity_orig - thermal_avg : 0;
+	bool fits = util * MODEL_FIT_MARGIN < capacity * SCHED_CAPACITY_SCALE;
+
+	if (!fits && uclamp_max <= capacity_orig &&
+	    !(capacity_orig == SCHED_CAPACITY_SCALE && uclamp_max == SCHED_CAPACITY_SCALE))
+		fits = true;
+
+	if (uclamp_min > uclamp_max)
+		uclamp_min = uclamp_max;
+	if (util < uclamp_min && uclamp_min > capacity)
+		return false;
+
+	return fits;
+}
+
+/*
+ * Update the model with e then return whether putting e->pid on e->cpu
+ * deviates from a correct placement. expected_cpu is set to the CPU the model
+ * would have picked, or -1 if it has no better one.
+ */
+static inline enum model_verdict eas_model_check(struct eas_model *m,
+						 const struct rq_pelt_event *e)
+{
+	const struct capacities *caps = m->caps;
+	unsigned int k, cluster;
+	bool placed_fits;
+	enum model_verdict v = MODEL_OK;
+
+	m->expected_cpu = -1;
+	m->judged = false;
+
+	if (e->cpu < 0 || (unsigned int)e->cpu >= caps->nr_cpus)
+		return MODEL_OK;
+
+	m->judged = true;
+
+	eas_model_update(m, e);
+
+	/* rq_util_avg already accounts the task on the CPU it was enqueued on */
+	cluster = caps->cpu_cluster[e->cpu];
+	placed_fits = model_fits(e->rq_util_avg, e->uclamp_min, e->uclamp_max,
+				 e->capacity_orig, e->thermal_avg);
+
+	/* Smallest cluster whose best CPU could take the task */
+	for (k = 0; k < caps->len; k++) {
+		struct model_cluster *cl = &m->cluster[k];
+		const struct model_cpu *c;
+
+		if (k == cluster && placed_fits)
+			break;
+
+		if (cl->best_cpu >= 0 && !model_fresh(&m->cpu[cl->best_cpu], e->ts))
+			model_rescan_cluster(m, k, e->ts);
+		if (cl->best_cpu < 0) {
+			/* Unless another fits, we can't tell whether it's this one */
+			m->judged = false;
+			continue;
+		}
+		if (cl->best_cpu == e->cpu)
+			continue;
+
+		c = &m->cpu[cl->best_cpu];
+		if (model_fits(c->rq_util_avg + e->p_util_avg, e->uclamp_min, e->uclamp_max,
+			       caps->cpu_cap[cl->best_cpu], c->thermal_avg)) {
+			m->expected_cpu = cl->best_cpu;
+			m->judged = true;
+			break;
+		}
+	}
+
+	if (m->expected_cpu >= 0) {
+		if (!placed_fits)
+			v = MODEL_NOT_FIT;
+		/* Without EAS any CPU the task fits on will do */
+		else if (e->overutilized != SG_OVERUTILIZED && k < cluster)
+			v = MODEL_TOO_BIG;
+	}
+
+	m->verdicts[v]++;
+	return v;
+}
+
+static inline void eas_model_print(FILE *file, const struct eas_model *m,
+				   const struct rq_pelt_event *e, enum model_verdict v)
+{
+	const struct capacities *caps = m->caps;
+	int cpu = m->expected_cpu;
+
+	if (v == MODEL_OK || cpu < 0)
+		return;
+
+	fprintf(file, "[%llu] Failed: %s: pid %d on cpu%d (capacity_orig %lu rq_util_avg %lu thermal_avg %lu), expected cpu%d (capacity_orig %lu rq_util_avg %lu thermal_avg %lu) p_util_avg: %lu uclamp_min: %lu uclamp_max: %lu\n",
+		e->ts, model_verdict_names[v], e->pid, e->cpu, e->capacity_orig,
+		e->rq_util_avg, e->thermal_avg, cpu, caps->cpu_cap[cpu],
+		m->cpu[cpu].rq_util_avg, m->cpu[cpu].thermal_avg, e->p_util_avg,
+		e->uclamp_min, e->uclamp_max);
+}
+
+#endif /* __UCLAMP_TEST_THERMAL_PRESSURE_MODEL_H__ */
@@ -0,0 +1,337 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#ifndef __UCLAMP_TEST_THERMAL_PRESSURE_TRACE_H__
+#define __UCLAMP_TEST_THERMAL_PRESSURE_TRACE_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/types.h>
+
+#include "uclamp_test_thermal_pressure_events.h"
+
+/*
+ * CSV output. Shared between the live test and the trace converter so that
+ * both produce identical files.
+ */
+#define PELT_CSV_FILE		"uclamp_test_thermal_pressure_pelt.csv"
+#define STRQF_CSV_FILE		"uclamp_test_thermal_pressure_strqf.csv"
+#define COMPUTE_ENERGY_CSV_FILE	"uclamp_test_thermal_pressure_compute_energy.csv"
+#define WAKEUP_CSV_FILE		"uclamp_test_thermal_pressure_wakeup.csv"
+
+#define PELT_CSV_HEADER		"ts, cpu, rq_util, p_util, capacity_orig, thermal_avg, uclamp_min, uclamp_max, overutilized, misfit, pid\n"
+#define STRQF_CSV_HEADER	"ts, cpu, p_util, uclamp_min, uclamp_max, pid\n"
+#define COMPUTE_ENERGY_CSV_HEADER "ts, dst_cpu, p_util, uclamp_min, uclamp_max, energy, base_energy, prev_cpu, pid\n"
+#define WAKEUP_CSV_HEADER	"seq, pid, strqf_ts, strqf_cpu, strqf_prev_cpu, nr_candidates, candidates, ts, cpu, rq_util, p_util, capacity_orig, thermal_avg, uclamp_min, uclamp_max, overutilized, misfit\n"
+
+static inline void fprint_rq_pelt_csv(FILE *file, const struct rq_pelt_event *e)
+{
+	fprintf(file, "%llu, %d, %lu, %lu, %lu, %lu, %lu,%lu, %d, %d, %d\n",
+		e->ts, e->cpu, e->rq_util_avg, e->p_util_avg, e->capacity_orig, e->thermal_avg, e->uclamp_min, e->uclamp_max, e->overutilized, e->misfit, e->pid);
+}
+
+static inline void fprint_select_task_rq_fair_csv(FILE *file, const struct select_task_rq_fair_event *e)
+{
+	fprintf(file, "%llu, %d, %lu, %lu,%lu, %d\n",
+		e->ts, e->cpu, e->p_util_avg, e->uclamp_min, e->uclamp_max, e->pid);
+}
+
+static inline void fprint_compute_energy_csv(FILE *file, const struct compute_energy_event *e)
+{
+	fprintf(file, "%llu, %d, %lu, %lu, %lu, %lu, %lu, %d, %d\n",
+		e->ts, e->dst_cpu, e->p_util_avg, e->uclamp_min, e->uclamp_max, e->energy,
+		e->base_energy, e->prev_cpu, e->pid);
+}
+
+/* candidates is a space separated list of cpu:energy:base_energy */
+static inline void fprint_wakeup_csv(FILE *file, const struct wakeup_event *e)
+{
+	const struct rq_pelt_event *r = &e->enqueue;
+	int i, nr = e->nr_candidates;
+
+	if (nr > WAKEUP_MAX_CANDIDATES)
+		nr = WAKEUP_MAX_CANDIDATES;
+
+	fprintf(file, "%llu, %d, %llu, %d, %d, %d, ", e->seq, r->pid, e->strqf_ts, e->strqf_cpu,
+		e->strqf_prev_cpu, e->nr_candidates);
+	for (i = 0; i < nr; i++)
+		fprintf(file, "%s%d:%lu:%lu", i ? " " : "", e->candidates[i].cpu,
+			e->candidates[i].energy, e->candidates[i].base_energy);
+	fprintf(file, ", %llu, %d, %lu, %lu, %lu, %lu, %lu, %lu, %d, %d\n",
+		r->ts, r->cpu, r->rq_util_avg, r->p_util_avg, r->capacity_orig, r->thermal_avg, r->uclamp_min, r->uclamp_max, r->overutilized, r->misfit);
+}
+
+/*
+ * Binary trace format.
+ *
+ * A trace_header followed by a stream of records. Each record is a
+ * trace_record header followed by len bytes of the raw event as it came out
+ * of the ring buffer. Unknown record types can be skipped using len.
+ *
+ * The reader uses the events in place, so the header, the record headers
+ * and the events are all multiples of 8 bytes to keep every event 8 bytes
+ * aligned.
+ */
+#define TRACE_MAGIC		0x50544355	/* "UCTP" */
+#define TRACE_VERSION		5
+#define TRACE_BUF_SIZE		(1024 * 1024)
+
+enum trace_record_type {
+	TRACE_RQ_PELT = 1,
+	TRACE_SELECT_TASK_RQ_FAIR,
+	TRACE_COMPUTE_ENERGY,
+	TRACE_WAKEUP,
+	TRACE_NR_TYPES,
+};
+
+struct trace_header {
+	__u32 magic;
+	__u16 version;
+	__u16 header_len;
+	/* Size of the raw events, lets readers detect ABI mismatches */
+	__u16 event_size[TRACE_NR_TYPES];
+} __attribute__((aligned(8)));
+
+_Static_assert(sizeof(struct trace_header) % 8 == 0, "trace_header must keep records 8 bytes aligned");
+
+struct trace_record {
+	__u16 type;
+	__u16 len;
+	/* Keep the events 8 bytes aligned */
+	__u32 reserved;
+};
+
+_Static_assert(sizeof(struct trace_record) % 8 == 0, "trace_record must keep events 8 bytes aligned");
+
+struct trace_writer {
+	int fd;
+	char *buf;
+	size_t len;
+	unsigned long long records;
+	unsigned long long bytes;
+	/* Records not written, nothing is written after the first failure */
+	unsigned long long failed;
+};
+
+static inline int trace_writer_flush(struct trace_writer *tw)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	while (off < tw->len) {
+		ret = write(tw->fd, tw->buf + off, tw->len - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Failed to write trace");
+			return -1;
+		}
+		off += ret;
+	}
+
+	tw->bytes += tw->len;
+	tw->len = 0;
+	return 0;
+}
+
+static inline int trace_writer_append(struct trace_writer *tw, const void *data, size_t len)
+{
+	if (tw->len + len > TRACE_BUF_SIZE && trace_writer_flush(tw))
+		return -1;
+
+	memcpy(tw->buf + tw->len, data, len);
+	tw->len += len;
+	return 0;
+}
+
+static inline int trace_write(struct trace_writer *tw, enum trace_record_type type,
+			      const void *data, size_t len)
+{
+	struct trace_record rec = { .type = type, .len = len };
+
+	if (tw->failed || trace_writer_append(tw, &rec, sizeof(rec)) ||
+	    trace_writer_append(tw, data, len)) {
+		tw->failed++;
+		return -1;
+	}
+
+	tw->records++;
+	return 0;
+}
+
+static inline struct trace_writer *trace_writer_open(const char *path)
+{
+	struct trace_header hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.header_len = sizeof(struct trace_header),
+		.event_size = {
+			[TRACE_RQ_PELT] = sizeof(struct rq_pelt_event),
+			[TRACE_SELECT_TASK_RQ_FAIR] = sizeof(struct select_task_rq_fair_event),
+			[TRACE_COMPUTE_ENERGY] = sizeof(struct compute_energy_event),
+			[TRACE_WAKEUP] = sizeof(struct wakeup_event),
+		},
+	};
+	struct trace_writer *tw;
+
+	tw = calloc(1, sizeof(*tw));
+	if (!tw)
+		return NULL;
+
+	tw->buf = malloc(TRACE_BUF_SIZE);
+	if (!tw->buf)
+		goto err_free;
+
+	tw->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (tw->fd < 0) {
+		perror("Failed to create trace file");
+		goto err_free;
+	}
+
+	if (trace_writer_append(tw, &hdr, sizeof(hdr)))
+		goto err_close;
+
+	return tw;
+
+err_close:
+	close(tw->fd);
+err_free:
+	free(tw->buf);
+	free(tw);
+	return NULL;
+}
+
+static inline void trace_writer_close(struct trace_writer *tw)
+{
+	if (!tw)
+		return;
+
+	/* What's left after a failure could end in a partial record */
+	if (!tw->failed)
+		trace_writer_flush(tw);
+	close(tw->fd);
+	free(tw->buf);
+	free(tw);
+}
+
+/* Size of the raw events of type, 0 for the types we don't know */
+static inline size_t trace_event_size(unsigned int type)
+{
+	switch (type) {
+	case TRACE_RQ_PELT:
+		return sizeof(struct rq_pelt_event);
+	case TRACE_SELECT_TASK_RQ_FAIR:
+		return sizeof(struct select_task_rq_fair_event);
+	case TRACE_COMPUTE_ENERGY:
+		return sizeof(struct compute_energy_event);
+	case TRACE_WAKEUP:
+		return sizeof(struct wakeup_event);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Reading is done by mmap()ing the whole trace and walking the records in
+ * place.
+ */
+struct trace_reader {
+	const char *data;
+	size_t size;
+	const struct trace_header *hdr;
+};
+
+static inline int trace_reader_open(struct trace_reader *tr, const char *path)
+{
+	struct stat st;
+	int fd, i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("Failed to open trace file");
+		return -1;
+	}
+
+	if (fstat(fd, &st) || st.st_size < sizeof(struct trace_header)) {
+		fprintf(stderr, "%s: not a valid trace\n", path);
+		close(fd);
+		return -1;
+	}
+
+	tr->size = st.st_size;
+	tr->data = mmap(NULL, tr->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (tr->data == MAP_FAILED) {
+		perror("Failed to mmap trace file");
+		return -1;
+	}
+
+	tr->hdr = (const struct trace_header *)tr->data;
+	if (tr->hdr->magic != TRACE_MAGIC || tr->hdr->version != TRACE_VERSION ||
+	    tr->hdr->header_len > tr->size || tr->hdr->header_len % 8) {
+		fprintf(stderr, "%s: unsupported trace (magic: 0x%x version: %u)\n",
+			path, tr->hdr->magic, tr->hdr->version);
+		goto err;
+	}
+
+	if (tr->hdr->header_len >= sizeof(struct trace_header)) {
+		for (i = TRACE_RQ_PELT; i < TRACE_NR_TYPES; i++) {
+			size_t expected = trace_event_size(i);
+
+			if (tr->hdr->event_size[i] != expected) {
+				fprintf(stderr, "%s: event %d size mismatch: %u != %zu\n",
+					path, i, tr->hdr->event_size[i], expected);
+				goto err;
+			}
+		}
+	}
+
+	return 0;
+err:
+	munmap((void *)tr->data, tr->size);
+	return -1;
+}
+
+static inline void trace_reader_close(struct trace_reader *tr)
+{
+	munmap((void *)tr->data, tr->size);
+}
+
+/*
+ * Return the record at *off and advance *off past it. NULL at the end of the
+ * trace, if the trace is truncated or if a record is shorter than its type.
+ * trace_reader_open() checked the event sizes of the header match ours.
+ */
+static inline const struct trace_record *trace_next_record(const char *data, size_t size,
+							     size_t *off)
+{
+	const struct trace_record *rec;
+
+	if (*off + sizeof(*rec) > size)
+		return NULL;
+
+	rec = (const struct trace_record *)(data + *off);
+	if (*off + sizeof(*rec) + rec->len > size)
+		return NULL;
+
+	if (rec->len < trace_event_size(rec->type)) {
+		fprintf(stderr, "Corrupt trace: record at %zu of type %u is %u bytes, expected %zu\n",
+			*off, rec->type, rec->len, trace_event_size(rec->type));
+		return NULL;
+	}
+
+	*off += sizeof(*rec) + rec->len;
+	return rec;
+}
+
+static inline const void *trace_record_data(const struct trace_record *rec)
+{
+	return rec + 1;
+}
+
+#endif /* __UCLAMP_TEST_THERMAL_PRESSURE_TRACE_H__ */
@@ -0,0 +1,276 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2022 Qais Yousef */
+#ifndef __WORKLOAD_H__
+#define __WORKLOAD_H__
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+/*
+ * Periodic workload engine.
+ *
+ * A phase runs for run_ns as a sequence of periods. Each period starts by
+ * spinning for duty% of period_ns, then sleeps until the start of the next
+ * period. Periods are timed with clock_nanosleep(TIMER_ABSTIME) against the
+ * phase start so they don't drift however long the busy part or the wakeup
+ * takes.
+ *
+ * A period whose busy part ends after the next period was due to start is an
+ * overrun; the engine skips the sleep and starts the next one right away.
+ * Otherwise the wakeup jitter, how late we woke up after the period start, is
+ * recorded.
+ *
+ * uclamp_min/uclamp_max of -1 keep whatever the task currently has.
+ */
+#define WORKLOAD_NAME_LEN	32
+#define WORKLOAD_UCLAMP_KEEP	-1
+
+/*
+ * The busy part is made of work units of WORKLOAD_UNIT_ITERS dependent
+ * sqrt(), a fixed amount of work whatever the CPU and its frequency. The
+ * clock is read once per unit, so the number of units done in a phase is its
+ * throughput.
+ */
+#define WORKLOAD_UNIT_ITERS	64
+
+struct workload_phase {
+	char name[WORKLOAD_NAME_LEN];
+	unsigned long long period_ns;
+	double duty;
+	unsigned long long run_ns;
+	long uclamp_min;
+	long uclamp_max;
+};
+
+struct workload_stats {
+	unsigned long long periods;
+	unsigned long long overruns;
+	unsigned long long max_overrun_ns;
+	unsigned long long units;
+	unsigned long long busy_ns;
+	struct samples jitter;
+};
+
+struct workload {
+	struct workload_phase *phases;
+	unsigned int nr_phases;
+};
+
+static inline void timespec_from_ns(struct timespec *ts, unsigned long long ns)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+/* Keep the compiler from optimizing the busy loop away */
+static volatile double workload_sink;
+
+/* Returns the number of work units done */
+static inline unsigned long long workload_spin_until(unsigned long long deadline)
+{
+	unsigned long long units = 0;
+	double x = 1.0;
+	int i;
+
+	do {
+		for (i = 0; i < WORKLOAD_UNIT_ITERS; i++)
+			x = sqrt(x + i);
+		units++;
+	} while (now_ns() < deadline);
+
+	workload_sink = x;
+
+	return units;
+}
+
+static inline int workload_run_phase(const struct workload_phase *ph, struct workload_stats *st)
+{
+	unsigned long long busy_ns = ph->period_ns * ph->duty / 100;
+	unsigned long long start, next, end, now;
+	struct timespec ts;
+	int ret;
+
+	memset(st, 0, sizeof(*st));
+	if (samples_init(&st->jitter, ph->run_ns / ph->period_ns + 1)) {
+		perror("Failed to allocate workload stats");
+		return -1;
+	}
+
+	start = now_ns();
+	end = start + ph->run_ns;
+
+	for (next = start; next < end; ) {
+		if (busy_ns) {
+			now = now_ns();
+			st->units += workload_spin_until(next + busy_ns);
+			st->busy_ns += now_ns() - now;
+		}
+
+		st->periods++;
+		next += ph->period_ns;
+
+		now = now_ns();
+		if (now > next) {
+			st->overruns++;
+			if (now - next > st->max_overrun_ns)
+				st->max_overrun_ns = now - next;
+			continue;
+		}
+
+		timespec_from_ns(&ts, next);
+		do {
+			ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		} while (ret == EINTR);
+		if (ret) {
+			errno = ret;
+			perror("Failed to sleep");
+			return -1;
+		}
+
+		samples_add(&st->jitter, now_ns() - next);
+	}
+
+	return 0;
+}
+
+/* Work units done per second spent in the busy part */
+static inline double workload_units_per_sec(const struct workload_stats *st)
+{
+	return st->busy_ns ? st->units * 1e9 / st->busy_ns : 0;
+}
+
+static inline void workload_print_stats(FILE *file, const struct workload_phase *ph,
+					struct workload_stats *st)
+{
+	samples_sort(&st->jitter);
+	fprintf(file, "%s: %llu periods, %llu overruns (max %llu us), jitter p50: %llu us p99: %llu us max: %llu us, %.0f work units/s\n",
+		ph->name, st->periods, st->overruns, st->max_overrun_ns / 1000,
+		samples_percentile(&st->jitter, 50) / 1000,
+		samples_percentile(&st->jitter, 99) / 1000,
+		st->jitter.max / 1000, workload_units_per_sec(st));
+}
+
+static inline void workload_free_stats(struct workload_stats *st)
+{
+	samples_free(&st->jitter);
+}
+
+/* '-' or 0..1024, returns -1 for anything else */
+static inline int workload_parse_uclamp(const char *str, long *value)
+{
+	unsigned long v;
+	char *end;
+
+	if (!strcmp(str, "-")) {
+		*value = WORKLOAD_UCLAMP_KEEP;
+		return 0;
+	}
+
+	if (*str < '0' || *str > '9')
+		return -1;
+
+	errno = 0;
+	v = strtoul(str, &end, 10);
+	if (errno || *end || v > 1024)
+		return -1;
+
+	*value = v;
+	return 0;
+}
+
+/*
+ * Scenario file, one phase per line, # starts a comment:
+ *
+ *	# name	period_us	duty_%	run_ms	uclamp_min	uclamp_max
+ *	light	16000		0	1600	0		1024
+ *	busy	16000		87.5	1600	-		512
+ *
+ * uclamp values are 0 to 1024, '-' keeps the value of the previous phase.
+ */
+static inline int workload_load(struct workload *w, const char *path)
+{
+	char line[256], min[16], max[16];
+	unsigned long long period_us, run_ms;
+	struct workload_phase *ph;
+	unsigned int size = 8, nr_line = 0;
+	FILE *file;
+
+	memset(w, 0, sizeof(*w));
+
+	file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "Failed to open %s file\n", path);
+		return -1;
+	}
+
+	w->phases = calloc(size, sizeof(*w->phases));
+	if (!w->phases)
+		goto err;
+
+	while (fgets(line, sizeof(line), file)) {
+		char *comment = strchr(line, '#');
+
+		nr_line++;
+		if (comment)
+			*comment = '\0';
+		if (strspn(line, " \t\r\n") == strlen(line))
+			continue;
+
+		if (w->nr_phases == size) {
+			ph = realloc(w->phases, 2 * size * sizeof(*w->phases));
+			if (!ph)
+				goto err;
+			w->phases = ph;
+			size *= 2;
+		}
+
+		ph = &w->phases[w->nr_phases];
+		memset(ph, 0, sizeof(*ph));
+		if (sscanf(line, "%31s %llu %lf %llu %15s %15s", ph->name, &period_us,
+			   &ph->duty, &run_ms, min, max) != 6 ||
+		    !period_us || ph->duty < 0 || ph->duty > 100 ||
+		    workload_parse_uclamp(min, &ph->uclamp_min) ||
+		    workload_parse_uclamp(max, &ph->uclamp_max)) {
+			fprintf(stderr, "%s:%u: invalid phase\n", path, nr_line);
+			fclose(file);
+			free(w->phases);
+			w->phases = NULL;
+			return -1;
+		}
+
+		ph->period_ns = period_us * 1000;
+		ph->run_ns = run_ms * 1000000;
+		w->nr_phases++;
+	}
+
+	fclose(file);
+
+	if (!w->nr_phases) {
+		fprintf(stderr, "%s: no phases\n", path);
+		free(w->phases);
+		w->phases = NULL;
+		return -1;
+	}
+
+	return 0;
+err:
+	perror("Failed to load workload");
+	fclose(file);
+	free(w->phases);
+	w->phases = NULL;
+	return -1;
+}
+
+static inline void workload_free(struct workload *w)
+{
+	free(w->phases);
+	memset(w, 0, sizeof(*w));
+}
+
+#endif /* __WORKLOAD_H__ */